@@ -0,0 +1,310 @@
+#include "bench.h"
+#include "query.h"
+#include "renderer.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void init_camera_path(struct camera_path* path) {
+    VLB_ZINIT(*path);
+}
+void free_camera_path(struct camera_path* path) {
+    VLB_FREE(*path);
+    VLB_ZINIT(*path);
+}
+
+unsigned add_camera_path_frame(struct camera_path* path, const struct vec3* pos, const struct vec3* rot) {
+    struct camera_path_frame frame;
+    frame.pos = *pos;
+    frame.rot = *rot;
+    VLB_ADD(*path, frame, 2, 1, fputs("Memory error\n", stderr); return 0;);
+    return 1;
+}
+
+unsigned read_camera_path(const char* filename, struct camera_path* out) {
+    struct camera_path_frame frame;
+    FILE* f;
+    int got;
+
+    init_camera_path(out);
+    f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open '%s': %s\n", filename, strerror(errno));
+        return 0;
+    }
+    while ((got = fscanf(
+        f, "%f %f %f %f %f %f",
+        &frame.pos.x, &frame.pos.y, &frame.pos.z, &frame.rot.x, &frame.rot.y, &frame.rot.z
+    )) == 6) {
+        if (!add_camera_path_frame(out, &frame.pos, &frame.rot)) goto reterr;
+    }
+    if (got != EOF || ferror(f)) {
+        fprintf(stderr, "Invalid camera path in '%s' at frame %lu\n", filename, out->len + 1);
+        goto reterr;
+    }
+    if (!out->len) {
+        fprintf(stderr, "No frames in camera path '%s'\n", filename);
+        goto reterr;
+    }
+    fclose(f);
+    return 1;
+
+    reterr:
+    fclose(f);
+    free_camera_path(out);
+    return 0;
+}
+
+unsigned write_camera_path(const char* filename, const struct camera_path* path) {
+    unsigned long i;
+    FILE* f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to open '%s': %s\n", filename, strerror(errno));
+        return 0;
+    }
+    for (i = 0; i < path->len; ++i) {
+        const struct camera_path_frame* frame = &path->data[i];
+        fprintf(
+            f, "%.9g %.9g %.9g %.9g %.9g %.9g\n",
+            (double)frame->pos.x, (double)frame->pos.y, (double)frame->pos.z,
+            (double)frame->rot.x, (double)frame->rot.y, (double)frame->rot.z
+        );
+    }
+    if (ferror(f) | fclose(f)) {
+        fprintf(stderr, "Failed to write '%s': %s\n", filename, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    Make a path that flies a figure eight through the middle of the map,
+    bobbing up and down, and always looking the way it is going. It goes
+    through walls, but that is fine for timing.
+*/
+unsigned make_camera_path(const struct map* map, unsigned long frames, struct camera_path* out) {
+    float radius = map->size * 0.375f;
+    float height = map->size * 0.0625f;
+    unsigned long i;
+
+    init_camera_path(out);
+    for (i = 0; i < frames; ++i) {
+        double t = 2.0 * PI_DBL * i / frames;
+        double dx = cos(t), dy = 3.0 * (double)height / (double)radius * cos(3.0 * t), dz = cos(2.0 * t);
+        struct vec3 pos, rot;
+        pos.x = radius * (float)sin(t);
+        pos.y = height * (float)sin(3.0 * t);
+        pos.z = radius * 0.5f * (float)sin(2.0 * t);
+        rot.x = (float)(atan2(dy, sqrt(dx * dx + dz * dz)) * 180.0 / PI_DBL);
+        rot.y = fwrap((float)(atan2(dx, dz) * 180.0 / PI_DBL), 360.0f);
+        rot.z = 0.0f;
+        if (!add_camera_path_frame(out, &pos, &rot)) {
+            free_camera_path(out);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int sort_ulongs(const void* a_ptr, const void* b_ptr) {
+    unsigned long a = *(const unsigned long*)a_ptr, b = *(const unsigned long*)b_ptr;
+    return (a > b) - (a < b);
+}
+
+/* Sort 'values' and print the percentiles of them */
+static void put_percentiles(const char* name, unsigned long* values, unsigned long count) {
+    qsort(values, count, sizeof(*values), sort_ulongs);
+    /* Nearest rank, so p99 is a value that was really seen */
+    printf(
+        "    %-10s %10lu %10lu %10lu %10lu\n", name,
+        values[0], values[(count * 50 + 99) / 100 - 1], values[(count * 99 + 99) / 100 - 1], values[count - 1]
+    );
+}
+
+/*
+    Render each frame of 'path' as fast as possible, write what each one took
+    to 'csv_filename', and print a summary. 'recalc_proj' and 'set_map' have
+    to be called first.
+*/
+unsigned run_benchmark(const struct camera_path* path, const char* csv_filename) {
+    unsigned long* times;    /* The render time, nodes and vertices of each frame, one after the other */
+    unsigned long* nodes;
+    unsigned long* vertices;
+    unsigned long vis_changes = 0;
+    unsigned long total_us = 0;
+    unsigned long i;
+    unsigned retval = 1;
+    FILE* f;
+
+    if (!path->len) {
+        fputs("No frames to benchmark\n", stderr);
+        return 0;
+    }
+    times = malloc(path->len * 3 * sizeof(*times));
+    if (!times) {
+        fputs("Memory error\n", stderr);
+        return 0;
+    }
+    nodes = times + path->len;
+    vertices = nodes + path->len;
+    f = fopen(csv_filename, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to open '%s': %s\n", csv_filename, strerror(errno));
+        free(times);
+        return 0;
+    }
+
+    fputs(
+        "frame,render_us,find_us,cull_us,draw_us,finish_us,vis_node,vis_changed,parent_nodes,vis_nodes,geom_nodes,"
+        "cells,frustum_culled,occlusion_culled,cells_drawn,quads,vertices\n", f
+    );
+    for (i = 0; i < path->len; ++i) {
+        struct camera_path_frame frame = path->data[i];
+        struct render_stats stats;
+        unsigned long start = gettime_us();
+        if (!render(&frame.pos, &frame.rot)) {
+            fputs("Rendering error\n", stderr);
+            retval = 0;
+            goto ret;
+        }
+        times[i] = gettime_us() - start;
+        if (!get_render_stats(0, &stats)) memset(&stats, 0, sizeof(stats));
+        nodes[i] = stats.parent_nodes + stats.vis_nodes;
+        vertices[i] = stats.vertices;
+        vis_changes += stats.vis_changed;
+        total_us += times[i];
+        fprintf(
+            f, "%lu,%lu,%lu,%lu,%lu,%lu,%u,%u,%lu,%lu,%lu,%u,%u,%u,%u,%lu,%lu\n",
+            i, times[i], stats.find_us, stats.cull_us, stats.draw_us, stats.finish_us,
+            stats.vis_node, stats.vis_changed, stats.parent_nodes, stats.vis_nodes, stats.geom_nodes,
+            stats.cells, stats.frustum_culled, stats.occlusion_culled, stats.cells_drawn, stats.quads, stats.vertices
+        );
+    }
+
+    printf(
+        "Rendered %lu frames in %.3f s (%.1f FPS), the camera changed 'vis' node %lu times\n",
+        path->len, total_us / 1000000.0, (total_us) ? path->len * 1000000.0 / total_us : 0.0, vis_changes
+    );
+    printf("    %-10s %10s %10s %10s %10s\n", "", "min", "p50", "p99", "max");
+    put_percentiles("render_us", times, path->len);
+    put_percentiles("nodes", nodes, path->len);
+    put_percentiles("vertices", vertices, path->len);
+
+    ret:
+    if (ferror(f) | fclose(f)) {
+        fprintf(stderr, "Failed to write '%s': %s\n", csv_filename, strerror(errno));
+        retval = 0;
+    }
+    free(times);
+    return retval;
+}
+
+/* Size of the grid of rays cast each frame by 'run_ray_benchmark' */
+#define RAY_BENCH_WIDTH 128
+#define RAY_BENCH_HEIGHT 96
+
+/*
+    Make the rays through a grid of pixels for a camera, looking the way the
+    renderer would (roll is ignored). The rays are put in 4x4 blocks of
+    pixels, so each run of QUERY_PACKET_RAYS rays is a packet of rays that
+    are close together.
+*/
+static void make_camera_rays(const struct camera_path_frame* frame, float fov, float max_dist, struct query_ray* out) {
+    float front[3], right[3], up[3];
+    float scale = (float)tan(DEGTORAD_FLT(fov) * 0.5f);
+    float aspect = (float)RAY_BENCH_WIDTH / RAY_BENCH_HEIGHT;
+    unsigned long i = 0;
+    unsigned bx, by, x, y;
+    {
+        float radx = DEGTORAD_FLT(frame->rot.x);
+        float rady = DEGTORAD_FLT(frame->rot.y);
+        front[0] = (float)(cos(radx) * sin(rady));
+        front[1] = (float)sin(radx);
+        front[2] = (float)(cos(radx) * cos(rady));
+        right[0] = (float)cos(rady);
+        right[1] = 0.0f;
+        right[2] = (float)-sin(rady);
+        up[0] = front[1] * right[2] - front[2] * right[1];
+        up[1] = front[2] * right[0] - front[0] * right[2];
+        up[2] = front[0] * right[1] - front[1] * right[0];
+    }
+    for (by = 0; by < RAY_BENCH_HEIGHT; by += 4) {
+        for (bx = 0; bx < RAY_BENCH_WIDTH; bx += 4) {
+            for (y = by; y < by + 4; ++y) {
+                for (x = bx; x < bx + 4; ++x) {
+                    float sx = ((x + 0.5f) / RAY_BENCH_WIDTH * 2.0f - 1.0f) * scale * aspect;
+                    float sy = (1.0f - (y + 0.5f) / RAY_BENCH_HEIGHT * 2.0f) * scale;
+                    struct query_ray* ray = &out[i++];
+                    ray->origin = frame->pos;
+                    ray->dir.x = front[0] + right[0] * sx + up[0] * sy;
+                    ray->dir.y = front[1] + right[1] * sx + up[1] * sy;
+                    ray->dir.z = front[2] + right[2] * sx + up[2] * sy;
+                    ray->max_dist = max_dist;
+                }
+            }
+        }
+    }
+}
+
+/*
+    Cast a grid of rays from each frame of 'path', one at a time and then in
+    packets, and print how many rays a second each way managed. The hits of
+    both ways are checked against each other.
+*/
+unsigned run_ray_benchmark(const struct map* map, const struct camera_path* path, float fov) {
+    enum {RAYS = RAY_BENCH_WIDTH * RAY_BENCH_HEIGHT};
+    struct query_ray* rays;
+    struct query_ray_hit* hits;     /* From 'query_rays', then from 'query_ray_packets' */
+    unsigned long single_us = 0, packet_us = 0;
+    unsigned long hit_count = 0, mismatches = 0;
+    unsigned long total;
+    unsigned long i, j;
+
+    if (!path->len) {
+        fputs("No frames to benchmark\n", stderr);
+        return 0;
+    }
+    rays = malloc(RAYS * sizeof(*rays));
+    hits = malloc(RAYS * 2 * sizeof(*hits));
+    if (!rays || !hits) {
+        fputs("Memory error\n", stderr);
+        free(rays);
+        free(hits);
+        return 0;
+    }
+
+    for (i = 0; i < path->len; ++i) {
+        unsigned long start;
+        /* Far enough to go right across the map from anywhere in it */
+        make_camera_rays(&path->data[i], fov, map->size * 2.0f, rays);
+        start = gettime_us();
+        query_rays(map, rays, RAYS, hits);
+        single_us += gettime_us() - start;
+        start = gettime_us();
+        query_ray_packets(map, rays, RAYS, hits + RAYS);
+        packet_us += gettime_us() - start;
+        for (j = 0; j < RAYS; ++j) {
+            const struct query_ray_hit* single = &hits[j];
+            const struct query_ray_hit* packet = &hits[RAYS + j];
+            if (single->geom != -1U) ++hit_count;
+            /* Rays that go through an edge can hit either node, but only at the same distance */
+            if ((single->geom == -1U) != (packet->geom == -1U) || fabs((double)(single->dist - packet->dist)) > (double)map->size * 1e-5) ++mismatches;
+        }
+    }
+
+    total = path->len * RAYS;
+    printf(
+        "Cast %lu rays over %lu frames, %.1f%% hit something\n",
+        total, path->len, hit_count * 100.0 / total
+    );
+    printf("    %-10s %10.3f s %12.0f rays/s\n", "single", single_us / 1000000.0, (single_us) ? total * 1000000.0 / single_us : 0.0);
+    printf("    %-10s %10.3f s %12.0f rays/s\n", "packets", packet_us / 1000000.0, (packet_us) ? total * 1000000.0 / packet_us : 0.0);
+    if (mismatches) printf("    %lu rays hit something different in packets\n", mismatches);
+
+    free(rays);
+    free(hits);
+    return !mismatches;
+}
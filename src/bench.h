@@ -0,0 +1,28 @@
+#ifndef OCTEST_BENCH_H
+#define OCTEST_BENCH_H
+
+#include "util.h"
+#include "map.h"
+#include "vlb.h"
+
+/*
+    A camera path is where the camera was and where it looked for each frame.
+    In a file, it is text with one frame per line, as "X Y Z ROTX ROTY ROTZ".
+*/
+struct camera_path_frame {
+    struct vec3 pos;
+    struct vec3 rot;
+};
+struct camera_path VLB(struct camera_path_frame);
+
+void init_camera_path(struct camera_path* path);
+void free_camera_path(struct camera_path* path);
+unsigned add_camera_path_frame(struct camera_path* path, const struct vec3* pos, const struct vec3* rot);
+unsigned read_camera_path(const char* filename, struct camera_path* out);
+unsigned write_camera_path(const char* filename, const struct camera_path* path);
+unsigned make_camera_path(const struct map* map, unsigned long frames, struct camera_path* out);
+
+unsigned run_benchmark(const struct camera_path* path, const char* csv_filename);
+unsigned run_ray_benchmark(const struct map* map, const struct camera_path* path, float fov);
+
+#endif
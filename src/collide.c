@@ -0,0 +1,295 @@
+#include "collide.h"
+#include "query.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Gap left between a box and what it stops at, so float error can't put it inside */
+#define COLLIDE_SKIN 0.001f
+/* How many times a move can be turned along what it hits */
+#define COLLIDE_MAX_SLIDES 4
+/* Boxes further than this into something when they start moving are let out through it */
+#define COLLIDE_ESCAPE_DEPTH (COLLIDE_SKIN * 4.0f)
+
+/* Index bit of the negative side of each axis (see 'struct map_node_geom_shape') */
+static const unsigned axis_bits[3] = {1, 4, 2};
+
+/* The 'geom' nodes near the last move, kept around so they don't have to be allocated every time */
+static struct query_node* nodes;
+static unsigned long node_space;
+
+/* Returns 1 if the shape fills its whole node, which only needs the 3 axes of the box to be tested */
+static unsigned shape_is_cube(const struct map_node_geom_shape* shape) {
+    unsigned i;
+    for (i = 0; i < 8; ++i) {
+        if (
+            shape->points[i].x != ((i & axis_bits[0]) ? -1.0f : 1.0f) ||
+            shape->points[i].y != ((i & axis_bits[1]) ? -1.0f : 1.0f) ||
+            shape->points[i].z != ((i & axis_bits[2]) ? -1.0f : 1.0f)
+        ) return 0;
+    }
+    return 1;
+}
+
+/*
+    Work out the axes a box and a shape could be separated along: the axes
+    of the box, the normal of every 3 points of the shape, and the line
+    between every 2 points crossed with each axis of the box. Shapes can be
+    twisted, so the faces and edges of their convex hull aren't always the
+    ones they are drawn with, and every one has to be tried. Returns how
+    many axes there are.
+*/
+#define COLLIDE_MAX_AXES (3 + 56 + 28 * 3)
+static unsigned get_axes(float points[8][3], unsigned cube, float axes[COLLIDE_MAX_AXES][3]) {
+    unsigned count = 3;
+    unsigned i, j, k;
+    for (i = 0; i < 3; ++i) {
+        axes[i][0] = (i == 0) ? 1.0f : 0.0f;
+        axes[i][1] = (i == 1) ? 1.0f : 0.0f;
+        axes[i][2] = (i == 2) ? 1.0f : 0.0f;
+    }
+    if (cube) return count;
+    for (i = 0; i < 8; ++i) {
+        for (j = i + 1; j < 8; ++j) {
+            float e1[3];
+            e1[0] = points[j][0] - points[i][0];
+            e1[1] = points[j][1] - points[i][1];
+            e1[2] = points[j][2] - points[i][2];
+            /* Crossed with X, Y and Z */
+            axes[count][0] = 0.0f;
+            axes[count][1] = e1[2];
+            axes[count][2] = -e1[1];
+            axes[count + 1][0] = -e1[2];
+            axes[count + 1][1] = 0.0f;
+            axes[count + 1][2] = e1[0];
+            axes[count + 2][0] = e1[1];
+            axes[count + 2][1] = -e1[0];
+            axes[count + 2][2] = 0.0f;
+            count += 3;
+            for (k = j + 1; k < 8; ++k) {
+                float e2[3];
+                e2[0] = points[k][0] - points[i][0];
+                e2[1] = points[k][1] - points[i][1];
+                e2[2] = points[k][2] - points[i][2];
+                axes[count][0] = e1[1] * e2[2] - e1[2] * e2[1];
+                axes[count][1] = e1[2] * e2[0] - e1[0] * e2[2];
+                axes[count][2] = e1[0] * e2[1] - e1[1] * e2[0];
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+/*
+    Sweep a box along 'move' against the convex hull of a shape's points.
+    Returns 1 and fills in 't' and 'normal' if it hits, or if it starts just
+    inside and is moving further in.
+*/
+static unsigned sweep_shape(
+    float points[8][3], unsigned cube, const float* center, const float* half, const float* move,
+    float* t, float* normal
+) {
+    float axes[COLLIDE_MAX_AXES][3];
+    unsigned axis_count = get_axes(points, cube, axes);
+    float enter = -FLT_MAX, leave = FLT_MAX;
+    float depth = FLT_MAX;  /* How far the box is inside at the start along the axis it is least inside on */
+    float enter_normal[3] = {0.0f, 0.0f, 0.0f};
+    float depth_normal[3] = {0.0f, 0.0f, 0.0f};
+    unsigned i, j;
+
+    for (i = 0; i < axis_count; ++i) {
+        float* n = axes[i];
+        float len = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+        float min = FLT_MAX, max = -FLT_MAX;
+        float box_center, box_radius, speed, sep;
+        /* Parallel edges give no axis */
+        if (len < 1e-20f) continue;
+        len = 1.0f / (float)sqrt(len);
+        n[0] *= len;
+        n[1] *= len;
+        n[2] *= len;
+        for (j = 0; j < 8; ++j) {
+            float d = n[0] * points[j][0] + n[1] * points[j][1] + n[2] * points[j][2];
+            if (d < min) min = d;
+            if (d > max) max = d;
+        }
+        box_center = n[0] * center[0] + n[1] * center[1] + n[2] * center[2];
+        box_radius = half[0] * (float)fabs(n[0]) + half[1] * (float)fabs(n[1]) + half[2] * (float)fabs(n[2]);
+        speed = n[0] * move[0] + n[1] * move[1] + n[2] * move[2];
+        sep = box_center - box_radius - max;
+        if (min - box_center - box_radius > sep) sep = min - box_center - box_radius;
+
+        if (-sep < depth) {
+            /* Out of the side of the shape the box's center is on */
+            float sign = (box_center * 2.0f > min + max) ? 1.0f : -1.0f;
+            depth = -sep;
+            depth_normal[0] = n[0] * sign;
+            depth_normal[1] = n[1] * sign;
+            depth_normal[2] = n[2] * sign;
+        }
+        if (speed != 0.0f) {
+            float ta = (min - box_radius - box_center) / speed;
+            float tb = (max + box_radius - box_center) / speed;
+            float lo = (ta < tb) ? ta : tb, hi = (ta < tb) ? tb : ta;
+            if (lo > enter) {
+                /* Against the way the box is going */
+                float sign = (speed > 0.0f) ? -1.0f : 1.0f;
+                enter = lo;
+                enter_normal[0] = n[0] * sign;
+                enter_normal[1] = n[1] * sign;
+                enter_normal[2] = n[2] * sign;
+            }
+            if (hi < leave) leave = hi;
+            if (enter >= leave || enter > 1.0f || leave <= 0.0f) return 0;
+        } else if (sep >= 0.0f) {
+            /* Never gets any closer on this axis */
+            return 0;
+        }
+    }
+
+    if (depth > 0.0f) {
+        /* Already inside, so only stop it if it is barely in and going further in */
+        if (depth > COLLIDE_ESCAPE_DEPTH) return 0;
+        if (depth_normal[0] * move[0] + depth_normal[1] * move[1] + depth_normal[2] * move[2] >= 0.0f) return 0;
+        *t = 0.0f;
+        normal[0] = depth_normal[0];
+        normal[1] = depth_normal[1];
+        normal[2] = depth_normal[2];
+        return 1;
+    }
+    *t = (enter > 0.0f) ? enter : 0.0f;
+    normal[0] = enter_normal[0];
+    normal[1] = enter_normal[1];
+    normal[2] = enter_normal[2];
+    return 1;
+}
+
+/* Find the 'geom' nodes that could be hit on the way, returns -1 if the map is broken */
+static unsigned long find_nodes(const struct map* map, const float* center, const float* half, const float* move) {
+    struct query_box box;
+    unsigned long count, end;
+    box.min.x = center[0] - half[0] + ((move[0] < 0.0f) ? move[0] : 0.0f) - COLLIDE_SKIN;
+    box.min.y = center[1] - half[1] + ((move[1] < 0.0f) ? move[1] : 0.0f) - COLLIDE_SKIN;
+    box.min.z = center[2] - half[2] + ((move[2] < 0.0f) ? move[2] : 0.0f) - COLLIDE_SKIN;
+    box.max.x = center[0] + half[0] + ((move[0] > 0.0f) ? move[0] : 0.0f) + COLLIDE_SKIN;
+    box.max.y = center[1] + half[1] + ((move[1] > 0.0f) ? move[1] : 0.0f) + COLLIDE_SKIN;
+    box.max.z = center[2] + half[2] + ((move[2] > 0.0f) ? move[2] : 0.0f) + COLLIDE_SKIN;
+    count = query_boxes(map, &box, 1, nodes, node_space, &end);
+    if (count == -1UL || count <= node_space) return count;
+    /* Didn't fit, so make room and look again */
+    {
+        unsigned long new_space = count * 2;
+        struct query_node* new_nodes = realloc(nodes, new_space * sizeof(*nodes));
+        if (!new_nodes) {
+            fputs("Memory error\n", stderr);
+            return -1UL;
+        }
+        nodes = new_nodes;
+        node_space = new_space;
+    }
+    return query_boxes(map, &box, 1, nodes, node_space, &end);
+}
+
+/*
+    Sweep a box with its center at 'pos' along 'move', and find the first
+    'geom' node it hits. Returns 1 if it hits one. Boxes that start just
+    touching something (like after 'collide_slide') count as hitting it if
+    they move towards it.
+*/
+unsigned collide_sweep(
+    const struct map* map, const struct vec3* pos, const struct vec3* half, const struct vec3* move,
+    struct collide_hit* out
+) {
+    float center[3], half_size[3], dir[3];
+    unsigned long count, i;
+
+    out->geom = -1U;
+    out->t = 1.0f;
+    out->normal.x = out->normal.y = out->normal.z = 0.0f;
+    center[0] = pos->x;
+    center[1] = pos->y;
+    center[2] = pos->z;
+    half_size[0] = half->x;
+    half_size[1] = half->y;
+    half_size[2] = half->z;
+    dir[0] = move->x;
+    dir[1] = move->y;
+    dir[2] = move->z;
+    if (dir[0] == 0.0f && dir[1] == 0.0f && dir[2] == 0.0f) return 0;
+
+    count = find_nodes(map, center, half_size, dir);
+    if (count == -1UL) return 0;
+    for (i = 0; i < count; ++i) {
+        const struct query_node* node = &nodes[i];
+        const struct map_node_geom_shape* shape = &map->geom_shapes[map->nodes[node->node].index];
+        float points[8][3];
+        float node_half = node->size * 0.5f;
+        float t, normal[3];
+        unsigned j;
+        for (j = 0; j < 8; ++j) {
+            points[j][0] = node->pos.x + shape->points[j].x * node_half;
+            points[j][1] = node->pos.y + shape->points[j].y * node_half;
+            points[j][2] = node->pos.z + shape->points[j].z * node_half;
+        }
+        if (!sweep_shape(points, shape_is_cube(shape), center, half_size, dir, &t, normal) || t >= out->t) continue;
+        out->geom = node->node;
+        out->t = t;
+        out->normal.x = normal[0];
+        out->normal.y = normal[1];
+        out->normal.z = normal[2];
+    }
+    return out->geom != -1U;
+}
+
+/*
+    Move a box with its center at 'pos' by 'move', stopping at anything in
+    the way and sliding the rest of the move along it. Returns 1 if it hit
+    anything.
+*/
+unsigned collide_slide(const struct map* map, struct vec3* pos, const struct vec3* half, const struct vec3* move) {
+    struct vec3 left = *move;
+    unsigned hit_any = 0;
+    unsigned i;
+    for (i = 0; i < COLLIDE_MAX_SLIDES; ++i) {
+        struct collide_hit hit;
+        float len, t, into;
+        if (!collide_sweep(map, pos, half, &left, &hit)) {
+            pos->x += left.x;
+            pos->y += left.y;
+            pos->z += left.z;
+            return hit_any;
+        }
+        hit_any = 1;
+        /* Stop a little before the hit */
+        len = vec3_dist_from_zero(&left);
+        t = hit.t - COLLIDE_SKIN / len;
+        if (t > 0.0f) {
+            pos->x += left.x * t;
+            pos->y += left.y * t;
+            pos->z += left.z * t;
+        } else {
+            t = 0.0f;
+        }
+        /* and take out the part of what is left that goes into it */
+        left.x *= 1.0f - t;
+        left.y *= 1.0f - t;
+        left.z *= 1.0f - t;
+        into = left.x * hit.normal.x + left.y * hit.normal.y + left.z * hit.normal.z;
+        if (into < 0.0f) {
+            left.x -= hit.normal.x * into;
+            left.y -= hit.normal.y * into;
+            left.z -= hit.normal.z * into;
+        }
+    }
+    /* Still hitting things, so it is probably in a corner */
+    return hit_any;
+}
+
+void free_collide(void) {
+    free(nodes);
+    nodes = NULL;
+    node_space = 0;
+}
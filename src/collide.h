@@ -0,0 +1,27 @@
+#ifndef OCTEST_COLLIDE_H
+#define OCTEST_COLLIDE_H
+
+#include "util.h"
+#include "map.h"
+
+/*
+    Moves boxes through a map without letting them go into 'geom' nodes.
+    The tree is only used to find the nodes near a move, then the box is
+    swept against the convex hull of each of their shapes. Boxes that start
+    deep inside something are let out instead of being stuck.
+*/
+
+struct collide_hit {
+    unsigned geom;      /* Indexes 'map.nodes' (-1 if nothing was hit) */
+    float t;            /* How much of the move was done before the hit, from 0 to 1 */
+    struct vec3 normal; /* Points out of what was hit */
+};
+
+unsigned collide_sweep(
+    const struct map* map, const struct vec3* pos, const struct vec3* half, const struct vec3* move,
+    struct collide_hit* out
+);
+unsigned collide_slide(const struct map* map, struct vec3* pos, const struct vec3* half, const struct vec3* move);
+void free_collide(void);
+
+#endif
@@ -1,30 +1,130 @@
 #include "compiler.h"
 #include "crc.h"
+#include "pvs.h"
+#include "workers.h"
 
 #include <ctype.h>
+#include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
+/* Nodes are kept with everything worked out while compiling and packed into 'struct map_node' at the end */
+struct compiler_node {
+    enum map_node_type type;
+    struct vec3 pos;
+    float size;
+    union {
+        struct {
+            unsigned children[8];   /* Each indexes 'compiler.nodes' (-1 if there is no child) */
+        } parent;
+        struct {
+            unsigned depth;
+            unsigned child;         /* Indexes 'compiler.nodes' */
+            unsigned first_sibling; /* Indexes 'compiler.vis_sibs' */
+            unsigned sibling_count;
+        } vis;
+        struct {
+            unsigned shape;         /* Indexes 'compiler.unique_shapes' */
+            unsigned char color;    /* Indexes 'compiler.colors' (MAP_COLOR_NONE if it wasn't given one) */
+        } geom;
+    } data;
+};
 struct compiler_shape {
     char name[32];
     unsigned name_crc;
+    unsigned unique;        /* Index of the first shape with the same points in 'compiler.unique_shapes' */
     struct map_node_geom_shape data;
 };
+struct compiler_color {
+    char name[32];
+    unsigned name_crc;
+    struct map_color data;
+};
+/* Open addressing hash table of indices, with linear probing */
+struct compiler_table_slot {
+    unsigned hash;
+    unsigned index;         /* -1 if empty */
+};
+struct compiler_table {
+    struct compiler_table_slot* slots;
+    unsigned long mask;     /* Number of slots - 1 */
+    unsigned long count;
+};
 struct compiler_vis_sib {
-    unsigned index;
+    unsigned index;         /* Indexes 'compiler.vis_nodes' */
     float dist;
 };
+struct compiler_vis_sibs VLB(struct compiler_vis_sib);
+struct compiler_packed_nodes VLB(struct map_node);
+struct compiler_sibs_worker {
+    struct pvs_scratch* pvs;
+    struct pvs_scratch* old_pvs; /* For 'compile_cache.pvs' */
+    struct compiler_vis_sibs sort_data;
+    struct VLB(unsigned) sibs;
+};
+struct compiler_sibs_result {
+    unsigned worker;        /* The worker whose 'sibs' the list is in */
+    unsigned long first;
+    unsigned count;
+};
+struct compiler_sibs_jobs {
+    const struct compiler* state;
+    const struct pvs* pvs;
+    const struct compile_cache* cache; /* NULL if it can't be used */
+    struct compiler_sibs_worker* workers;
+    struct compiler_sibs_result* results; /* One for each 'vis' node */
+};
+struct compile_cache_cell {
+    struct vec3 pos;
+    float size;
+    unsigned hash;          /* See 'hash_node' */
+    unsigned first_sibling; /* Indexes 'compile_cache.sibs' */
+    unsigned sibling_count;
+};
+/*
+    What is kept from the last compile so that the next one only has to redo
+    the 'vis' nodes whose contents changed (and the ones that can see them)
+*/
+struct compile_cache {
+    struct pvs* pvs;        /* NULL if nothing is cached */
+    float max_vis_dist;
+    unsigned cell_count;
+    struct compile_cache_cell* cells; /* One for each 'vis' node */
+    struct VLB(unsigned) sibs; /* Same as 'compiler.vis_sibs' */
+    unsigned used : 1;      /* Set if the last compile reused anything (see 'used_compile_cache') */
+};
+/* The map text is parsed straight out of memory, with the line and column kept track of for errors */
+struct parser {
+    const char* ptr;
+    const char* end;
+    const char* line_start;
+    const char* name;       /* Where the last name read started */
+    unsigned long line;
+};
 struct compiler {
+    struct parser parser;
     float size;
     float min_vis_size;
-    struct VLB(struct map_node) nodes;
+    float max_vis_dist;
+    struct VLB(struct compiler_node) nodes;
     struct VLB(unsigned) vis_nodes;
-    struct VLB(unsigned) vis_sibs;
+    struct VLB(unsigned) vis_sibs;      /* Each indexes 'vis_nodes' */
+    struct compiler_packed_nodes packed_nodes;
+    struct map_vis* packed_vis;         /* One for each of 'vis_nodes' */
     struct VLB(struct compiler_shape) geom_shapes;
+    struct VLB(struct map_node_geom_shape) unique_shapes;
+    struct compiler_table shape_names;  /* Indexes 'geom_shapes' */
+    struct compiler_table shape_points; /* Indexes 'unique_shapes' */
+    struct VLB(struct compiler_color) colors; /* The start of the palette, before the colors of the 'vis' nodes */
+    struct compiler_table color_names;  /* Indexes 'colors' */
+    unsigned vis_colors;                /* How many colors the 'vis' nodes take turns using */
+    struct map_color* palette;
     char text_buf[256];
     unsigned max_vis_depth;
     unsigned size_set : 1;
     unsigned min_vis_size_set : 1;
+    unsigned max_vis_dist_set : 1;
     unsigned tree_set : 1;
 };
 
@@ -34,29 +134,154 @@ struct tree_stack_elem {
 };
 struct tree {
     struct compiler* compiler;
-    FILE* f;
     struct VLB(struct tree_stack_elem) stack;
 };
 
+static unsigned compile_threads = 0; /* 0 to use one for each CPU */
+static unsigned compile_merge_subtrees = 0;
+
 /*static void err_bad_char(char c);*/ /* Unused */
-static void err_want_name(void);
-static void err_want_number(void);
-static void err_want_char(char c);
+static void err_pos(const struct parser* p);
+static void err_name_pos(const struct parser* p);
+static void err_want_name(const struct parser* p);
+static void err_want_number(const struct parser* p);
+static void err_want_char(const struct parser* p, char c);
 static void err_mem(void);
-static unsigned parser_read_whitespace(FILE* f);
-static unsigned parser_read_name(FILE* f, char* buf, unsigned buflen);
-static int parser_read_float(FILE* f, char* buf, unsigned buflen, float* out);
-static void parser_skip_line(FILE* f);
+static unsigned parser_read_whitespace(struct parser* p);
+static unsigned parser_read_char(struct parser* p, char c);
+static unsigned parser_read_name(struct parser* p, char* buf, unsigned buflen);
+static int parser_read_float(struct parser* p, char* buf, unsigned buflen, float* out);
+static void parser_skip_line(struct parser* p);
+
+static unsigned table_init(struct compiler_table* t) {
+    unsigned long i;
+    t->mask = 255;
+    t->count = 0;
+    t->slots = malloc((t->mask + 1) * sizeof(*t->slots));
+    if (!t->slots) return 0;
+    for (i = 0; i <= t->mask; ++i) {
+        t->slots[i].index = -1;
+    }
+    return 1;
+}
+/* Make sure there is room for one more entry, keeping the table at most half full */
+static unsigned table_reserve(struct compiler_table* t) {
+    struct compiler_table_slot* old = t->slots;
+    unsigned long old_mask = t->mask;
+    unsigned long i;
+    if ((t->count + 1) * 2 <= t->mask + 1) return 1;
+    t->mask = t->mask * 2 + 1;
+    t->slots = malloc((t->mask + 1) * sizeof(*t->slots));
+    if (!t->slots) {
+        t->slots = old;
+        t->mask = old_mask;
+        return 0;
+    }
+    for (i = 0; i <= t->mask; ++i) {
+        t->slots[i].index = -1;
+    }
+    for (i = 0; i <= old_mask; ++i) {
+        unsigned long j;
+        if (old[i].index == -1U) continue;
+        for (j = old[i].hash & t->mask; t->slots[j].index != -1U; j = (j + 1) & t->mask);
+        t->slots[j] = old[i];
+    }
+    free(old);
+    return 1;
+}
+
+/* Get the index in 'geom_shapes' of the shape with the given name, or -1 if there isn't one */
+static unsigned find_shape(const struct compiler* state, const char* name) {
+    const struct compiler_table* t = &state->shape_names;
+    unsigned crc = strcasecrc32(name);
+    unsigned long i;
+    for (i = crc & t->mask; t->slots[i].index != -1U; i = (i + 1) & t->mask) {
+        const struct compiler_shape* shape = &state->geom_shapes.data[t->slots[i].index];
+        if (t->slots[i].hash == crc && !strcasecmp(shape->name, name)) return t->slots[i].index;
+    }
+    return -1;
+}
+/*
+    Add the last shape in 'geom_shapes' to the tables. Shapes with the same
+    points share one entry in 'unique_shapes'. If the name is already taken,
+    the first shape with it is the one that is used.
+*/
+static unsigned add_shape(struct compiler* state) {
+    unsigned index = state->geom_shapes.len - 1;
+    struct compiler_shape* shape = &state->geom_shapes.data[index];
+    unsigned hash = crc32(&shape->data, sizeof(shape->data));
+    unsigned long i;
+
+    if (!table_reserve(&state->shape_points) || !table_reserve(&state->shape_names)) {
+        err_mem();
+        return 0;
+    }
+
+    /* Find or add the points */
+    for (i = hash & state->shape_points.mask; state->shape_points.slots[i].index != -1U; i = (i + 1) & state->shape_points.mask) {
+        const struct compiler_table_slot* slot = &state->shape_points.slots[i];
+        if (slot->hash == hash && !memcmp(&state->unique_shapes.data[slot->index], &shape->data, sizeof(shape->data))) break;
+    }
+    if (state->shape_points.slots[i].index == -1U) {
+        state->shape_points.slots[i].hash = hash;
+        state->shape_points.slots[i].index = state->unique_shapes.len;
+        ++state->shape_points.count;
+        VLB_ADD(state->unique_shapes, shape->data, 2, 1, err_mem(); return 0;);
+    }
+    shape->unique = state->shape_points.slots[i].index;
+
+    /* Add the name */
+    for (i = shape->name_crc & state->shape_names.mask; state->shape_names.slots[i].index != -1U; i = (i + 1) & state->shape_names.mask) {
+        const struct compiler_table_slot* slot = &state->shape_names.slots[i];
+        if (slot->hash == shape->name_crc && !strcasecmp(state->geom_shapes.data[slot->index].name, shape->name)) return 1;
+    }
+    state->shape_names.slots[i].hash = shape->name_crc;
+    state->shape_names.slots[i].index = index;
+    ++state->shape_names.count;
+    return 1;
+}
+
+/* Get the index in 'colors' of the color with the given name, or -1 if there isn't one */
+static unsigned find_color(const struct compiler* state, const char* name) {
+    const struct compiler_table* t = &state->color_names;
+    unsigned crc = strcasecrc32(name);
+    unsigned long i;
+    for (i = crc & t->mask; t->slots[i].index != -1U; i = (i + 1) & t->mask) {
+        const struct compiler_color* color = &state->colors.data[t->slots[i].index];
+        if (t->slots[i].hash == crc && !strcasecmp(color->name, name)) return t->slots[i].index;
+    }
+    return -1;
+}
+/* Add the name of the last color in 'colors' to the table. If it is already taken, the first color with it is the one that is used. */
+static unsigned add_color(struct compiler* state) {
+    unsigned index = state->colors.len - 1;
+    const struct compiler_color* color = &state->colors.data[index];
+    unsigned long i;
+
+    if (!table_reserve(&state->color_names)) {
+        err_mem();
+        return 0;
+    }
+    for (i = color->name_crc & state->color_names.mask; state->color_names.slots[i].index != -1U; i = (i + 1) & state->color_names.mask) {
+        const struct compiler_table_slot* slot = &state->color_names.slots[i];
+        if (slot->hash == color->name_crc && !strcasecmp(state->colors.data[slot->index].name, color->name)) return 1;
+    }
+    state->color_names.slots[i].hash = color->name_crc;
+    state->color_names.slots[i].index = index;
+    ++state->color_names.count;
+    return 1;
+}
 
 static unsigned tree_add_vis_node(struct tree* state) {
     unsigned depth = state->stack.len - 1;
     unsigned index = state->compiler->nodes.len;
     struct tree_stack_elem* elem = &state->stack.data[depth];
-    struct map_node* node;
+    struct compiler_node* node;
 
     VLB_NEXTPTR(state->compiler->nodes, node, 2, 1, err_mem(); return -1;);
     VLB_ADD(state->compiler->vis_nodes, index, 2, 1, err_mem(); return -1;);
 
+    memset(node, 0, sizeof(*node));
     node->type = MAP_NODE_VIS;
     node->pos = elem->pos;
     node->size = elem->size;
@@ -67,7 +292,8 @@ static unsigned tree_add_vis_node(struct tree* state) {
 static unsigned tree_read_node(struct tree* state, const char* type) {
     unsigned depth = state->stack.len - 1;
     unsigned index = state->compiler->nodes.len; /* Get the index that the next node will be created at */
-    struct map_node* node;
+    struct parser* parser = &state->compiler->parser;
+    struct compiler_node* node;
 
     /*
         If the max depth for 'vis' nodes has been reached, add one and set the
@@ -89,8 +315,8 @@ static unsigned tree_read_node(struct tree* state, const char* type) {
         /* Used to restore the 'node' pointer after a realloc */
         unsigned node_index;
 
-        if (!parser_read_whitespace(state->f) || fgetc(state->f) != '(') {
-            err_want_char('(');
+        if (!parser_read_whitespace(parser) || !parser_read_char(parser, '(')) {
+            err_want_char(parser, '(');
             return -1;
         }
 
@@ -102,6 +328,7 @@ static unsigned tree_read_node(struct tree* state, const char* type) {
         /* Add this 'parent' node to the node list */
         node_index = state->compiler->nodes.len;
         VLB_NEXTPTR(state->compiler->nodes, node, 2, 1, err_mem(); return -1;);
+        memset(node, 0, sizeof(*node));
         node->type = MAP_NODE_PARENT;
         node->pos = elem->pos;
         node->size = elem->size;
@@ -116,11 +343,11 @@ static unsigned tree_read_node(struct tree* state, const char* type) {
             sub_elem->size = sub_size;
 
             /* Read in the child */
-            if (!parser_read_whitespace(state->f)) {
-                err_want_name();
+            if (!parser_read_whitespace(parser)) {
+                err_want_name(parser);
                 return -1;
             }
-            tmp = parser_read_name(state->f, state->compiler->text_buf, 256);
+            tmp = parser_read_name(parser, state->compiler->text_buf, 256);
             if (tmp == -1U) return -1;
             /* If given 'none' */
             if (!tmp || !strcasecmp(state->compiler->text_buf, "none")) {
@@ -153,47 +380,58 @@ static unsigned tree_read_node(struct tree* state, const char* type) {
                 node->data.parent.children[i] = tmp; /* Write down the index */
             }
 
-            if (i < 7 && (!parser_read_whitespace(state->f) || fgetc(state->f) != ',')) {
-                err_want_char(',');
+            if (i < 7 && (!parser_read_whitespace(parser) || !parser_read_char(parser, ','))) {
+                err_want_char(parser, ',');
                 return -1;
             }
         }
 
-        if (!parser_read_whitespace(state->f) || fgetc(state->f) != ')') {
-            err_want_char(')');
+        if (!parser_read_whitespace(parser) || !parser_read_char(parser, ')')) {
+            err_want_char(parser, ')');
             return -1;
         }
 
         --state->stack.len;
     /* If it is a 'geom' node */
     } else if (!strcasecmp(type, "geom")) {
-        unsigned crc, i, tmp;
+        unsigned i, tmp;
+        unsigned char color = MAP_COLOR_NONE;
         struct tree_stack_elem* elem;
 
-        if (!parser_read_whitespace(state->f) || fgetc(state->f) != '(') {
-            err_want_char('(');
+        if (!parser_read_whitespace(parser) || !parser_read_char(parser, '(')) {
+            err_want_char(parser, '(');
             return -1;
         }
         /* Get the name of the shape */
-        if (!parser_read_whitespace(state->f) || !(tmp = parser_read_name(state->f, state->compiler->text_buf, 32))) {
-            err_want_name();
+        if (!parser_read_whitespace(parser) || !(tmp = parser_read_name(parser, state->compiler->text_buf, 32))) {
+            err_want_name(parser);
             return -1;
         }
         if (tmp == -1U) return -1;
 
-        /* Find the shape in the list */
-        crc = strcasecrc32(state->compiler->text_buf);
-        i = 0;
-        while (1) {
-            struct compiler_shape* shape;
-            if (i == state->compiler->geom_shapes.len) {
-                /* If the end of the list has been reached, the shape could not be found */
-                fprintf(stderr, "Could not find shape '%s'\n", state->compiler->text_buf);
+        /* Find the shape */
+        i = find_shape(state->compiler, state->compiler->text_buf);
+        if (i == -1U) {
+            err_name_pos(parser);
+            fprintf(stderr, "Could not find shape '%s'\n", state->compiler->text_buf);
+            return -1;
+        }
+        i = state->compiler->geom_shapes.data[i].unique;
+
+        /* Get the name of the color if there is one */
+        if (parser_read_whitespace(parser) && parser_read_char(parser, ',')) {
+            if (!parser_read_whitespace(parser) || !(tmp = parser_read_name(parser, state->compiler->text_buf, 32))) {
+                err_want_name(parser);
+                return -1;
+            }
+            if (tmp == -1U) return -1;
+            tmp = find_color(state->compiler, state->compiler->text_buf);
+            if (tmp == -1U) {
+                err_name_pos(parser);
+                fprintf(stderr, "Could not find color '%s'\n", state->compiler->text_buf);
                 return -1;
             }
-            shape = &state->compiler->geom_shapes.data[i];
-            if (shape->name_crc == crc && !strcasecmp(shape->name, state->compiler->text_buf)) break;
-            ++i;
+            color = tmp;
         }
 
         /*
@@ -211,16 +449,19 @@ static unsigned tree_read_node(struct tree* state, const char* type) {
 
         /* Create the 'geom' node */
         VLB_NEXTPTR(state->compiler->nodes, node, 2, 1, err_mem(); return -1;);
+        memset(node, 0, sizeof(*node));
         node->type = MAP_NODE_GEOM;
         node->pos = elem->pos;
         node->size = elem->size;
         node->data.geom.shape = i;
+        node->data.geom.color = color;
 
-        if (!parser_read_whitespace(state->f) || fgetc(state->f) != ')') {
-            err_want_char(')');
+        if (!parser_read_whitespace(parser) || !parser_read_char(parser, ')')) {
+            err_want_char(parser, ')');
             return -1;
         }
     } else {
+        err_name_pos(parser);
         fprintf(stderr, "Unknown node type '%s'\n", type);
         return -1;
     }
@@ -231,25 +472,838 @@ static unsigned tree_read_node(struct tree* state, const char* type) {
 static int sort_vis_sibs(const void* a_ptr, const void* b_ptr) {
     const struct compiler_vis_sib* a = a_ptr;
     const struct compiler_vis_sib* b = b_ptr;
-    return (a->dist > b->dist) - (a->dist < b->dist); /* Sort by low to high */
+    if (a->dist != b->dist) return (a->dist > b->dist) - (a->dist < b->dist); /* Sort by low to high */
+    return (a->index > b->index) - (a->index < b->index); /* Keep the order stable for equal distances */
 }
 
-unsigned compile_map(FILE* f, struct map* map) {
+/* Get the distance between the closest points of two nodes */
+static float node_box_dist(const struct compiler_node* a, const struct compiler_node* b) {
+    float half = (a->size + b->size) * 0.5f;
+    float dx = (float)fabs(a->pos.x - b->pos.x) - half;
+    float dy = (float)fabs(a->pos.y - b->pos.y) - half;
+    float dz = (float)fabs(a->pos.z - b->pos.z) - half;
+    if (dx < 0.0f) dx = 0.0f;
+    if (dy < 0.0f) dy = 0.0f;
+    if (dz < 0.0f) dz = 0.0f;
+    return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+/* Get the position of a 'vis' node in 'vis_nodes' (which is sorted as nodes are only ever appended) */
+static unsigned vis_node_ordinal(const struct compiler* state, unsigned index) {
+    unsigned lo = 0, hi = state->vis_nodes.len;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (state->vis_nodes.data[mid] < index) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+    Add every 'vis' node under 'index' that is within 'max_vis_dist' of the
+    'vis' node 'vis_index' and in its PVS to 'out'.
+    The tree itself is used as the spatial index, so whole branches that are
+    out of range are skipped with one check on the 'parent' node.
+*/
+static unsigned find_vis_sibs(const struct compiler* state, const struct pvs_scratch* pvs, unsigned vis_index, unsigned index, struct compiler_vis_sibs* out) {
+    const struct compiler_node* vis_node = &state->nodes.data[vis_index];
+    const struct compiler_node* node = &state->nodes.data[index];
+
+    if (state->max_vis_dist_set && node_box_dist(vis_node, node) > state->max_vis_dist) return 1;
+
+    if (node->type == MAP_NODE_PARENT) {
+        unsigned i;
+        for (i = 0; i < 8; ++i) {
+            unsigned child = node->data.parent.children[i];
+            if (child == -1U) continue;
+            if (!find_vis_sibs(state, pvs, vis_index, child, out)) return 0;
+        }
+    } else if (node->type == MAP_NODE_VIS) {
+        struct compiler_vis_sib* sib;
+        unsigned ordinal;
+        if (index == vis_index) return 1; /* Make it so the 'vis' node doesn't list itself as a sibling */
+        ordinal = vis_node_ordinal(state, index);
+        if (!pvs_is_visible(pvs, ordinal)) return 1; /* Skip it if it can't be seen */
+
+        VLB_NEXTPTR(*out, sib, 2, 1, err_mem(); return 0;);
+        sib->index = ordinal;
+        sib->dist = vec3_dist(&vis_node->pos, &node->pos);
+    }
+    /* 'vis' nodes are never nested so anything else is not looked at */
+    return 1;
+}
+
+static float vec3_axis(const struct vec3* v, unsigned axis) {
+    return (axis == 0) ? v->x : (axis == 1) ? v->y : v->z;
+}
+static void vec3_set_axis(struct vec3* v, unsigned axis, float value) {
+    if (axis == 0) v->x = value;
+    else if (axis == 1) v->y = value;
+    else v->z = value;
+}
+static void node_box(const struct compiler_node* node, struct vec3* min, struct vec3* max) {
+    float offset = node->size * 0.5f;
+    min->x = node->pos.x - offset;
+    min->y = node->pos.y - offset;
+    min->z = node->pos.z - offset;
+    max->x = node->pos.x + offset;
+    max->y = node->pos.y + offset;
+    max->z = node->pos.z + offset;
+}
+/* Check if a box overlaps a rectangle on the two axes other than 'axis' */
+static unsigned box_overlaps_rect(const struct vec3* min, const struct vec3* max, unsigned axis, const struct vec3* rmin, const struct vec3* rmax) {
+    unsigned i;
+    for (i = 0; i < 3; ++i) {
+        if (i == axis) continue;
+        if (vec3_axis(rmin, i) >= vec3_axis(max, i) - 1e-4f || vec3_axis(rmax, i) <= vec3_axis(min, i) + 1e-4f) return 0;
+    }
+    return 1;
+}
+
+/* Check if every point of a shape's face on the given side is at its corner of the cube */
+static unsigned shape_face_is_full(const struct map_node_geom_shape* shape, unsigned axis, unsigned positive) {
+    /* Index bit for each axis (see 'struct map_node_parent') */
+    static const unsigned axis_bits[3] = {1, 4, 2};
+    unsigned i;
+    for (i = 0; i < 8; ++i) {
+        struct vec3 corner;
+        if ((!(i & axis_bits[axis])) != positive) continue;
+        corner.x = (!(i & 1)) ? 1.0f : -1.0f;
+        corner.y = (!(i & 4)) ? 1.0f : -1.0f;
+        corner.z = (!(i & 2)) ? 1.0f : -1.0f;
+        if (shape->points[i].x != corner.x || shape->points[i].y != corner.y || shape->points[i].z != corner.z) return 0;
+    }
+    return 1;
+}
+
+/*
+    Check if the part of the face of a node on the given side that is inside
+    the rectangle is completely covered by solid faces.
+    Anything that is not a full face (wedges, empty space) counts as open.
+*/
+static unsigned node_covers_face(const struct compiler* state, unsigned index, unsigned axis, unsigned positive, const struct vec3* rmin, const struct vec3* rmax) {
+    static const unsigned axis_bits[3] = {1, 4, 2};
+    const struct compiler_node* node;
+    if (index == -1U) return 0;
+    node = &state->nodes.data[index];
+    switch (node->type) {
+        case MAP_NODE_VIS:
+            return node_covers_face(state, node->data.vis.child, axis, positive, rmin, rmax);
+        case MAP_NODE_GEOM:
+            return shape_face_is_full(&state->unique_shapes.data[node->data.geom.shape], axis, positive);
+        case MAP_NODE_PARENT: {
+            unsigned i;
+            for (i = 0; i < 8; ++i) {
+                struct vec3 min, max;
+                unsigned child = node->data.parent.children[i];
+                if ((!(i & axis_bits[axis])) != positive) continue; /* Not on that side */
+                /* Get the box of the child */
+                min = node->pos;
+                min.x += node->size * ((!(i & 1)) ? 0.0f : -0.5f);
+                min.y += node->size * ((!(i & 4)) ? 0.0f : -0.5f);
+                min.z += node->size * ((!(i & 2)) ? 0.0f : -0.5f);
+                max.x = min.x + node->size * 0.5f;
+                max.y = min.y + node->size * 0.5f;
+                max.z = min.z + node->size * 0.5f;
+                if (!box_overlaps_rect(&min, &max, axis, rmin, rmax)) continue;
+                if (!node_covers_face(state, child, axis, positive, rmin, rmax)) return 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Add a portal between the 'vis' node 'vis_index' and each 'vis' node under
+    'index' touching its positive face on 'axis'.
+*/
+static unsigned add_vis_portals(const struct compiler* state, struct pvs* pvs, unsigned vis_index, unsigned axis, unsigned index) {
+    const struct compiler_node* vis_node = &state->nodes.data[vis_index];
+    const struct compiler_node* node = &state->nodes.data[index];
+    struct vec3 vmin, vmax, min, max;
+    float plane;
+
+    node_box(vis_node, &vmin, &vmax);
+    node_box(node, &min, &max);
+    plane = vec3_axis(&vmax, axis);
+
+    /* Skip anything that does not reach past the face or is beside it */
+    if (vec3_axis(&min, axis) > plane + 1e-4f || vec3_axis(&max, axis) <= plane + 1e-4f) return 1;
+    if (!box_overlaps_rect(&min, &max, axis, &vmin, &vmax)) return 1;
+
+    if (node->type == MAP_NODE_PARENT) {
+        unsigned i;
+        for (i = 0; i < 8; ++i) {
+            unsigned child = node->data.parent.children[i];
+            if (child == -1U) continue;
+            if (!add_vis_portals(state, pvs, vis_index, axis, child)) return 0;
+        }
+    } else if (node->type == MAP_NODE_VIS) {
+        struct vec3 rmin, rmax;
+        unsigned flags = 0;
+        if ((float)fabs(vec3_axis(&min, axis) - plane) > 1e-4f) return 1; /* Not touching */
+
+        /* The portal is where the two faces overlap */
+        rmin.x = (vmin.x > min.x) ? vmin.x : min.x;
+        rmin.y = (vmin.y > min.y) ? vmin.y : min.y;
+        rmin.z = (vmin.z > min.z) ? vmin.z : min.z;
+        rmax.x = (vmax.x < max.x) ? vmax.x : max.x;
+        rmax.y = (vmax.y < max.y) ? vmax.y : max.y;
+        rmax.z = (vmax.z < max.z) ? vmax.z : max.z;
+        vec3_set_axis(&rmin, axis, plane);
+        vec3_set_axis(&rmax, axis, plane);
+
+        if (node_covers_face(state, vis_node->data.vis.child, axis, 1, &rmin, &rmax)) flags |= PVS_PORTAL_BLOCKED_A;
+        if (node_covers_face(state, node->data.vis.child, axis, 0, &rmin, &rmax)) flags |= PVS_PORTAL_BLOCKED_B;
+        if (!pvs_add_portal(pvs, vis_node_ordinal(state, vis_index), vis_node_ordinal(state, index), axis, &rmin, &rmax, flags)) {
+            err_mem();
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    Find the portals between all of the 'vis' nodes and solve the PVS.
+    If 'old_pvs' is not NULL, the results of any portals that could not have
+    been affected by the 'vis' nodes in 'changed' are copied from it.
+*/
+static struct pvs* build_pvs(const struct compiler* state, unsigned thread_count, const struct pvs* old_pvs, const unsigned char* changed) {
+    struct pvs* pvs = pvs_new(state->vis_nodes.len, (state->max_vis_dist_set) ? state->max_vis_dist : 0.0f);
+    unsigned i;
+    if (!pvs) {
+        err_mem();
+        return NULL;
+    }
+    for (i = 0; i < state->vis_nodes.len; ++i) {
+        unsigned index = state->vis_nodes.data[i];
+        struct vec3 min, max;
+        unsigned axis;
+        node_box(&state->nodes.data[index], &min, &max);
+        pvs_set_cell(pvs, i, &min, &max);
+        /* Only look in the positive direction as the portals go both ways */
+        for (axis = 0; axis < 3; ++axis) {
+            if (!add_vis_portals(state, pvs, index, axis, 0)) {
+                pvs_free(pvs);
+                return NULL;
+            }
+        }
+    }
+    if (!pvs_prepare(pvs) || (old_pvs && !pvs_reuse(pvs, old_pvs, changed)) || !pvs_solve(pvs, thread_count)) {
+        err_mem();
+        pvs_free(pvs);
+        return NULL;
+    }
+    return pvs;
+}
+
+/* Find the sorted sibling list of one 'vis' node and put it at the end of the worker's 'sibs' */
+static unsigned build_vis_sibs_job(void* data, unsigned worker, unsigned long job) {
+    struct compiler_sibs_jobs* jobs = data;
+    struct compiler_sibs_worker* w = &jobs->workers[worker];
+    struct compiler_sibs_result* result = &jobs->results[job];
+    unsigned index = jobs->state->vis_nodes.data[job];
+    unsigned i;
+
+    /* Find the 'vis' nodes that can be seen from this one */
+    pvs_find(jobs->pvs, w->pvs, job);
+
+    /* If the same ones could be seen last time, the list is the same too */
+    if (jobs->cache) {
+        const struct compile_cache_cell* cell = &jobs->cache->cells[job];
+        pvs_find(jobs->cache->pvs, w->old_pvs, job);
+        if (pvs_find_equal(jobs->pvs, w->pvs, w->old_pvs)) {
+            result->worker = worker;
+            result->first = w->sibs.len;
+            result->count = cell->sibling_count;
+            VLB_EXPANDBY(w->sibs, cell->sibling_count, 2, 1, err_mem(); return 0;);
+            memcpy(w->sibs.data + result->first, jobs->cache->sibs.data + cell->first_sibling, cell->sibling_count * sizeof(*w->sibs.data));
+            return 1;
+        }
+    }
+
+    /* Prepare for sorting by populating the sort data with the indices and distances of the visible 'vis' nodes in range */
+    w->sort_data.len = 0;
+    if (!find_vis_sibs(jobs->state, w->pvs, index, 0, &w->sort_data)) return 0;
+
+    /* Sort from near to far */
+    qsort(w->sort_data.data, w->sort_data.len, sizeof(*w->sort_data.data), sort_vis_sibs);
+
+    /* Copy out the sorted indices */
+    result->worker = worker;
+    result->first = w->sibs.len;
+    result->count = w->sort_data.len;
+    VLB_EXPANDBY(w->sibs, w->sort_data.len, 2, 1, err_mem(); return 0;);
+    for (i = 0; i < w->sort_data.len; ++i) {
+        w->sibs.data[result->first + i] = w->sort_data.data[i].index;
+    }
+    return 1;
+}
+
+/* Hash everything under a node that can change what is seen through it */
+static unsigned hash_node(const struct compiler* state, unsigned index, unsigned crc) {
+    const struct compiler_node* node;
+    unsigned char type;
+    if (index == -1U) return ccrc32(crc, "-", 1);
+    node = &state->nodes.data[index];
+    type = node->type;
+    crc = ccrc32(crc, &type, 1);
+    switch (node->type) {
+        case MAP_NODE_VIS:
+            return hash_node(state, node->data.vis.child, crc);
+        case MAP_NODE_GEOM:
+            return ccrc32(crc, &state->unique_shapes.data[node->data.geom.shape], sizeof(*state->unique_shapes.data));
+        case MAP_NODE_PARENT: {
+            unsigned i;
+            for (i = 0; i < 8; ++i) {
+                crc = hash_node(state, node->data.parent.children[i], crc);
+            }
+            return crc;
+        }
+    }
+    return crc;
+}
+
+/* Check if the 'vis' nodes are laid out the same as when the cache was filled */
+static unsigned cache_matches(const struct compiler* state, const struct compile_cache* cache) {
+    unsigned i;
+    if (!cache->pvs || cache->cell_count != state->vis_nodes.len) return 0;
+    if (cache->max_vis_dist != ((state->max_vis_dist_set) ? state->max_vis_dist : 0.0f)) return 0;
+    for (i = 0; i < state->vis_nodes.len; ++i) {
+        const struct compiler_node* node = &state->nodes.data[state->vis_nodes.data[i]];
+        const struct compile_cache_cell* cell = &cache->cells[i];
+        if (node->pos.x != cell->pos.x || node->pos.y != cell->pos.y || node->pos.z != cell->pos.z || node->size != cell->size) return 0;
+    }
+    return 1;
+}
+
+/* Replace what is in the cache with the results of this compile, taking ownership of 'pvs' */
+static unsigned update_cache(const struct compiler* state, struct compile_cache* cache, struct pvs* pvs, const unsigned* hashes) {
+    struct compile_cache_cell* cells;
+    unsigned i;
+
+    cells = malloc((state->vis_nodes.len + 1) * sizeof(*cells));
+    if (!cells) return 0;
+    cache->sibs.len = 0;
+    VLB_EXPANDBY(cache->sibs, state->vis_sibs.len, 2, 1, free(cells); return 0;);
+    for (i = 0; i < state->vis_nodes.len; ++i) {
+        const struct compiler_node* node = &state->nodes.data[state->vis_nodes.data[i]];
+        cells[i].pos = node->pos;
+        cells[i].size = node->size;
+        cells[i].hash = hashes[i];
+        cells[i].first_sibling = node->data.vis.first_sibling;
+        cells[i].sibling_count = node->data.vis.sibling_count;
+    }
+    memcpy(cache->sibs.data, state->vis_sibs.data, state->vis_sibs.len * sizeof(*cache->sibs.data));
+
+    if (cache->pvs) pvs_free(cache->pvs);
+    free(cache->cells);
+    cache->pvs = pvs;
+    cache->max_vis_dist = (state->max_vis_dist_set) ? state->max_vis_dist : 0.0f;
+    cache->cell_count = state->vis_nodes.len;
+    cache->cells = cells;
+    return 1;
+}
+
+/*
+    Generate the sibling list for each 'vis' node.
+    Siblings must be sorted from near to far to eliminate overdraw.
+    The lists are built on several threads, then copied out in the order of
+    the 'vis' nodes so the result is the same no matter how many are used.
+    If there is a cache from the last compile with the same 'vis' nodes, only
+    the portals and lists that could have been changed by the nodes whose
+    contents differ are redone.
+*/
+static unsigned build_vis_sibs(struct compiler* state, struct compile_cache* cache) {
+    unsigned retval = 0;
+    unsigned thread_count = (compile_threads) ? compile_threads : get_cpu_count();
+    struct compiler_sibs_jobs jobs = {0};
+    struct pvs* pvs = NULL;
+    unsigned* hashes = NULL;
+    unsigned char* changed = NULL;
+    unsigned i;
+
+    if (!state->vis_nodes.len) return 1;
+
+    /* Find which 'vis' nodes are different since last time */
+    if (cache) {
+        hashes = malloc(state->vis_nodes.len * sizeof(*hashes));
+        if (!hashes) {
+            err_mem();
+            return 0;
+        }
+        for (i = 0; i < state->vis_nodes.len; ++i) {
+            hashes[i] = hash_node(state, state->vis_nodes.data[i], 0);
+        }
+        if (cache_matches(state, cache)) {
+            changed = malloc(state->vis_nodes.len);
+            if (!changed) {
+                err_mem();
+                goto ret;
+            }
+            for (i = 0; i < state->vis_nodes.len; ++i) {
+                changed[i] = (hashes[i] != cache->cells[i].hash);
+            }
+            jobs.cache = cache;
+            cache->used = 1;
+        }
+    }
+
+    pvs = build_pvs(state, thread_count, (jobs.cache) ? cache->pvs : NULL, changed);
+    if (!pvs) goto ret;
+    jobs.state = state;
+    jobs.pvs = pvs;
+    jobs.workers = calloc(thread_count, sizeof(*jobs.workers));
+    jobs.results = malloc(state->vis_nodes.len * sizeof(*jobs.results));
+    if (!jobs.workers || !jobs.results) {
+        err_mem();
+        goto ret;
+    }
+    for (i = 0; i < thread_count; ++i) {
+        struct compiler_sibs_worker* w = &jobs.workers[i];
+        w->pvs = pvs_new_scratch(pvs);
+        if (!w->pvs) {
+            err_mem();
+            goto ret;
+        }
+        if (jobs.cache) {
+            w->old_pvs = pvs_new_scratch(cache->pvs);
+            if (!w->old_pvs) {
+                err_mem();
+                goto ret;
+            }
+        }
+        VLB_INIT(w->sort_data, 256, err_mem(); goto ret;);
+        VLB_INIT(w->sibs, 1024, err_mem(); goto ret;);
+    }
+
+    if (!run_workers(thread_count, state->vis_nodes.len, build_vis_sibs_job, &jobs)) goto ret;
+
+    /* Merge the lists */
+    for (i = 0; i < state->vis_nodes.len; ++i) {
+        const struct compiler_sibs_result* result = &jobs.results[i];
+        struct compiler_node* node = &state->nodes.data[state->vis_nodes.data[i]];
+        node->data.vis.first_sibling = state->vis_sibs.len;
+        node->data.vis.sibling_count = result->count;
+        VLB_EXPANDBY(state->vis_sibs, result->count, 2, 1, err_mem(); goto ret;);
+        memcpy(
+            state->vis_sibs.data + node->data.vis.first_sibling,
+            jobs.workers[result->worker].sibs.data + result->first,
+            result->count * sizeof(*state->vis_sibs.data)
+        );
+    }
+
+    /* Keep the results for next time */
+    if (cache) {
+        if (!update_cache(state, cache, pvs, hashes)) {
+            err_mem();
+            goto ret;
+        }
+        pvs = NULL;
+    }
+    retval = 1;
+
+    ret:
+    if (jobs.workers) {
+        for (i = 0; i < thread_count; ++i) {
+            struct compiler_sibs_worker* w = &jobs.workers[i];
+            if (w->pvs) pvs_free_scratch(w->pvs);
+            if (w->old_pvs) pvs_free_scratch(w->old_pvs);
+            VLB_FREE(w->sort_data);
+            VLB_FREE(w->sibs);
+        }
+        free(jobs.workers);
+    }
+    free(jobs.results);
+    free(hashes);
+    free(changed);
+    if (pvs) pvs_free(pvs);
+    return retval;
+}
+
+/*
+    Check if the rectangle on a face is completely covered by the faces of the
+    nodes on the other side of it ('positive' is the side of the face, so the
+    nodes looked at are on that side of the plane). 'pos' and 'size' are the
+    box of the node at 'index', which may be -1 for empty space.
+*/
+static unsigned neighbor_covers_face(const struct compiler* state, unsigned index, const struct vec3* pos, float size, unsigned axis, unsigned positive, const struct vec3* rmin, const struct vec3* rmax) {
+    const struct compiler_node* node;
+    float plane = vec3_axis(rmin, axis);
+    float near, far;
+    struct vec3 min, max;
+
+    min.x = pos->x - size * 0.5f;
+    min.y = pos->y - size * 0.5f;
+    min.z = pos->z - size * 0.5f;
+    max.x = pos->x + size * 0.5f;
+    max.y = pos->y + size * 0.5f;
+    max.z = pos->z + size * 0.5f;
+    /* The side of the box closest to the face and the side furthest from it */
+    near = vec3_axis(positive ? &min : &max, axis);
+    far = vec3_axis(positive ? &max : &min, axis);
+
+    /* Skip anything beside the face, behind it or not touching it */
+    if (!box_overlaps_rect(&min, &max, axis, rmin, rmax)) return 1;
+    if (positive ? (far <= plane + 1e-4f || near > plane + 1e-4f) : (far >= plane - 1e-4f || near < plane - 1e-4f)) return 1;
+
+    if (index == -1U) return 0;
+    node = &state->nodes.data[index];
+    /* If the node starts right at the face, its own face has to cover it */
+    if ((float)fabs(near - plane) <= 1e-4f) return node_covers_face(state, index, axis, !positive, rmin, rmax);
+    /* Otherwise the face goes through the node, so look further down */
+    switch (node->type) {
+        case MAP_NODE_VIS:
+            return neighbor_covers_face(state, node->data.vis.child, pos, size, axis, positive, rmin, rmax);
+        case MAP_NODE_PARENT: {
+            unsigned i;
+            for (i = 0; i < 8; ++i) {
+                struct vec3 child_pos;
+                MAP_NODE_CHILD_POS(*pos, size, i, child_pos);
+                if (!neighbor_covers_face(state, node->data.parent.children[i], &child_pos, size * 0.5f, axis, positive, rmin, rmax)) return 0;
+            }
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+/*
+    Work out which faces of the 'geom' node at 'index' can be seen.
+    A face is dropped if it has no area, or if it is flat against the side of
+    the node and every node touching it from the other side has a full face
+    there. Faces of wedges that are not flat against the side are kept, and so
+    are faces on the outside of the map.
+*/
+static unsigned char geom_face_mask(const struct compiler* state, unsigned index) {
+    /* Points of each face in the order the renderer draws them (see 'enum map_face') */
+    static const unsigned char face_points[6][4] = {
+        {0, 2, 6, 4},
+        {1, 5, 7, 3},
+        {0, 1, 3, 2},
+        {4, 6, 7, 5},
+        {0, 4, 5, 1},
+        {2, 3, 7, 6}
+    };
+    const struct compiler_node* node = &state->nodes.data[index];
+    const struct compiler_node* root = &state->nodes.data[0];
+    const struct map_node_geom_shape* shape = &state->unique_shapes.data[node->data.geom.shape];
+    unsigned char mask = 0;
+    unsigned face;
+
+    for (face = 0; face < 6; ++face) {
+        unsigned axis = face >> 1;
+        unsigned positive = !(face & 1);
+        float side = positive ? 1.0f : -1.0f;
+        struct vec3 p[4];
+        struct vec3 rmin, rmax;
+        unsigned flat = 1;
+        unsigned i;
+
+        for (i = 0; i < 4; ++i) {
+            p[i] = shape->points[face_points[face][i]];
+            if (vec3_axis(&p[i], axis) != side) flat = 0;
+        }
+
+        /* Quads are drawn as the triangles (0, 1, 2) and (0, 2, 3), so the face has no area if neither does */
+        {
+            unsigned has_area = 0;
+            for (i = 1; i < 3; ++i) {
+                struct vec3 a, b, c;
+                a.x = p[i].x - p[0].x; a.y = p[i].y - p[0].y; a.z = p[i].z - p[0].z;
+                b.x = p[i + 1].x - p[0].x; b.y = p[i + 1].y - p[0].y; b.z = p[i + 1].z - p[0].z;
+                c.x = a.y * b.z - a.z * b.y;
+                c.y = a.z * b.x - a.x * b.z;
+                c.z = a.x * b.y - a.y * b.x;
+                if (c.x * c.x + c.y * c.y + c.z * c.z > 1e-8f) has_area = 1;
+            }
+            if (!has_area) continue;
+        }
+
+        if (flat) {
+            float plane = vec3_axis(&node->pos, axis) + side * node->size * 0.5f;
+            float edge = vec3_axis(&root->pos, axis) + side * root->size * 0.5f;
+            /* Nothing covers the outside of the map */
+            if ((float)fabs(plane - edge) > 1e-4f) {
+                node_box(node, &rmin, &rmax);
+                vec3_set_axis(&rmin, axis, plane);
+                vec3_set_axis(&rmax, axis, plane);
+                if (neighbor_covers_face(state, 0, &root->pos, root->size, axis, positive, &rmin, &rmax)) continue;
+            }
+        }
+
+        mask |= 1 << face;
+    }
+    return mask;
+}
+
+/*
+    Write the node at 'index' into slot 'slot' of 'packed_nodes' in the layout
+    of 'struct map_node'. The children of a 'parent' node get a run of slots
+    at the end for the caller to fill in. The child of a 'vis' node is left
+    for 'pack_nodes'.
+*/
+static unsigned pack_node(struct compiler* state, unsigned index, unsigned slot) {
+    const struct compiler_node* node = &state->nodes.data[index];
+    struct map_node* out = &state->packed_nodes.data[slot];
+
+    memset(out, 0, sizeof(*out)); /* Don't leave garbage in the unused bytes written to map files */
+    out->type = node->type;
+    switch (node->type) {
+        case MAP_NODE_PARENT: {
+            unsigned count = 0;
+            unsigned i;
+            for (i = 0; i < 8; ++i) {
+                if (node->data.parent.children[i] == -1U) continue;
+                out->child_mask |= 1 << i;
+                ++count;
+            }
+            out->index = state->packed_nodes.len;
+            VLB_EXPANDBY(state->packed_nodes, count, 2, 1, err_mem(); return 0;);
+        } break;
+        case MAP_NODE_VIS: {
+            unsigned ordinal = vis_node_ordinal(state, index);
+            struct map_vis* v = &state->packed_vis[ordinal];
+            out->index = ordinal;
+            memset(v, 0, sizeof(*v));
+            v->pos = node->pos;
+            v->size = node->size;
+            v->child = -1;
+            v->first_sibling = node->data.vis.first_sibling;
+            v->sibling_count = node->data.vis.sibling_count;
+            /* Each one gets a color from after the ones in the map, so the geometry in it stands out from its neighbors */
+            v->color = state->colors.len + ordinal % state->vis_colors;
+        } break;
+        case MAP_NODE_GEOM:
+            out->face_mask = geom_face_mask(state, index);
+            out->color = node->data.geom.color;
+            out->index = node->data.geom.shape;
+            break;
+    }
+    return 1;
+}
+
+/* Pack the tree under a 'vis' node depth first, which is the order it is drawn in */
+static unsigned pack_subtree(struct compiler* state, unsigned index, unsigned slot) {
+    const struct compiler_node* node = &state->nodes.data[index];
+    if (!pack_node(state, index, slot)) return 0;
+    if (node->type == MAP_NODE_PARENT) {
+        unsigned first = state->packed_nodes.data[slot].index;
+        unsigned i;
+        for (i = 0; i < 8; ++i) {
+            unsigned child = node->data.parent.children[i];
+            if (child == -1U) continue;
+            if (!pack_subtree(state, child, first++)) return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    Lay the nodes out for the renderer.
+    The nodes down to and including the 'vis' nodes come first, breadth first,
+    so finding the 'vis' node at a point goes through a few cache lines at the
+    front that stay hot. After them, the tree under each 'vis' node is in one
+    block of its own in the order of the 'vis' nodes, which is a Morton order
+    as children are ordered by their octant.
+*/
+static unsigned pack_nodes(struct compiler* state) {
+    unsigned retval = 0;
+    struct VLB(unsigned) order; /* The index in 'nodes' of each slot in the top of the tree */
+    unsigned long slot;
+    unsigned i;
+
+    if (!state->nodes.len) return 1;
+    VLB_INIT(order, 256, err_mem(); return 0;);
+    VLB_ADD(order, 0, 2, 1, err_mem(); goto ret;);
+    state->packed_nodes.len = 1;
+    for (slot = 0; slot < order.len; ++slot) {
+        const struct compiler_node* node = &state->nodes.data[order.data[slot]];
+        if (!pack_node(state, order.data[slot], slot)) goto ret;
+        if (node->type == MAP_NODE_PARENT) {
+            for (i = 0; i < 8; ++i) {
+                unsigned child = node->data.parent.children[i];
+                if (child == -1U) continue;
+                VLB_ADD(order, child, 2, 1, err_mem(); goto ret;);
+            }
+        }
+    }
+    for (i = 0; i < state->vis_nodes.len; ++i) {
+        unsigned child = state->nodes.data[state->vis_nodes.data[i]].data.vis.child;
+        if (child == -1U) continue;
+        state->packed_vis[i].child = state->packed_nodes.len;
+        VLB_EXPANDBY(state->packed_nodes, 1, 2, 1, err_mem(); goto ret;);
+        if (!pack_subtree(state, child, state->packed_vis[i].child)) goto ret;
+    }
+    retval = 1;
+
+    ret:
+    VLB_FREE(order);
+    return retval;
+}
+
+/* Bits of 'struct map_node' are compared as a whole, which works as 'pack_node' zeroes the padding */
+static unsigned hash_packed_nodes(const struct map_node* nodes, unsigned count) {
+    return ccrc32(count, nodes, count * sizeof(*nodes));
+}
+
+/* Find an earlier run of nodes the same as the 'count' nodes at 'first', or return -1 */
+static unsigned find_packed_nodes(const struct compiler* state, const struct compiler_table* groups, const unsigned char* lens, unsigned first, unsigned count) {
+    const struct map_node* nodes = &state->packed_nodes.data[first];
+    unsigned hash = hash_packed_nodes(nodes, count);
+    unsigned long i;
+    for (i = hash & groups->mask; groups->slots[i].index != -1U; i = (i + 1) & groups->mask) {
+        const struct compiler_table_slot* slot = &groups->slots[i];
+        if (
+            slot->hash == hash && lens[slot->index] == count &&
+            !memcmp(&state->packed_nodes.data[slot->index], nodes, count * sizeof(*nodes))
+        ) return slot->index;
+    }
+    return -1;
+}
+static unsigned add_packed_nodes(struct compiler* state, struct compiler_table* groups, unsigned char* lens, unsigned first, unsigned count) {
+    unsigned hash = hash_packed_nodes(&state->packed_nodes.data[first], count);
+    unsigned long i;
+    if (!table_reserve(groups)) {
+        err_mem();
+        return 0;
+    }
+    for (i = hash & groups->mask; groups->slots[i].index != -1U; i = (i + 1) & groups->mask);
+    groups->slots[i].hash = hash;
+    groups->slots[i].index = first;
+    ++groups->count;
+    lens[first] = count;
+    return 1;
+}
+
+/*
+    Point the node at 'slot' and everything under it at the first copy of
+    each identical run of children, bottom up. 'lens' is filled in with the
+    length of each run that is kept.
+*/
+static unsigned merge_node(struct compiler* state, unsigned slot, struct compiler_table* groups, unsigned char* lens) {
+    struct map_node* node = &state->packed_nodes.data[slot];
+    if (node->type == MAP_NODE_VIS) {
+        struct map_vis* v = &state->packed_vis[node->index];
+        unsigned found;
+        if (v->child == -1U) return 1;
+        if (!merge_node(state, v->child, groups, lens)) return 0;
+        /* The child of a 'vis' node is a run of 1 */
+        found = find_packed_nodes(state, groups, lens, v->child, 1);
+        if (found == -1U) return add_packed_nodes(state, groups, lens, v->child, 1);
+        v->child = found;
+    } else if (node->type == MAP_NODE_PARENT) {
+        unsigned first = node->index;
+        unsigned count = 0;
+        unsigned found;
+        unsigned i;
+        for (i = 0; i < 8; ++i) {
+            if (node->child_mask & (1 << i)) ++count;
+        }
+        for (i = 0; i < count; ++i) {
+            if (!merge_node(state, first + i, groups, lens)) return 0;
+        }
+        node = &state->packed_nodes.data[slot];
+        found = find_packed_nodes(state, groups, lens, first, count);
+        if (found == -1U) return add_packed_nodes(state, groups, lens, first, count);
+        node->index = found;
+    }
+    return 1;
+}
+
+/*
+    Turn the tree into a DAG by sharing identical subtrees, then drop the
+    nodes that are no longer used. Nothing is stored in a node that depends
+    on where it is, so any two subtrees with the same contents can be one.
+    'vis' nodes each have their own 'map.vis' entry, so only the nodes under
+    them end up shared.
+*/
+static unsigned merge_subtrees(struct compiler* state) {
+    unsigned retval = 0;
+    struct compiler_table groups = {0};
+    unsigned char* lens;
+    unsigned* remap = NULL;
+    unsigned count = state->packed_nodes.len;
+    unsigned i, j;
+
+    if (!count) return 1;
+    lens = calloc(count, 1);
+    if (!lens || !table_init(&groups)) {
+        err_mem();
+        goto ret;
+    }
+    if (!merge_node(state, 0, &groups, lens)) goto ret;
+
+    /* Mark the nodes that are still used (the root and each run that was kept), and move them down */
+    remap = malloc(count * sizeof(*remap));
+    if (!remap) {
+        err_mem();
+        goto ret;
+    }
+    lens[0] = 1;
+    for (i = 0; i < count;) {
+        unsigned len = lens[i];
+        if (!len) {
+            remap[i++] = -1;
+            continue;
+        }
+        for (; len; --len, ++i) remap[i] = i;
+    }
+    for (i = 0, j = 0; i < count; ++i) {
+        if (remap[i] == -1U) continue;
+        remap[i] = j;
+        state->packed_nodes.data[j++] = state->packed_nodes.data[i];
+    }
+    state->packed_nodes.len = j;
+    for (i = 0; i < j; ++i) {
+        struct map_node* node = &state->packed_nodes.data[i];
+        if (node->type == MAP_NODE_PARENT) node->index = remap[node->index];
+    }
+    for (i = 0; i < state->vis_nodes.len; ++i) {
+        struct map_vis* v = &state->packed_vis[i];
+        if (v->child != -1U) v->child = remap[v->child];
+    }
+    VLB_SHRINK(state->packed_nodes, VLB_OOM_NOP);
+    retval = 1;
+
+    ret:
+    free(lens);
+    free(remap);
+    free(groups.slots);
+    return retval;
+}
+
+unsigned compile_map_cached(const char* data, unsigned long len, struct compile_cache* cache, struct map* map) {
     unsigned retval = 1;
     struct compiler state = {0};
+    unsigned i;
+    if (cache) cache->used = 0;
     VLB_INIT(state.nodes, 256, err_mem(); goto reterr;);
     VLB_INIT(state.vis_nodes, 256, err_mem(); goto reterr;);
     VLB_INIT(state.vis_sibs, 1024, err_mem(); goto reterr;);
     VLB_INIT(state.geom_shapes, 256, err_mem(); goto reterr;);
+    VLB_INIT(state.unique_shapes, 256, err_mem(); goto reterr;);
+    VLB_INIT(state.colors, 16, err_mem(); goto reterr;);
+    if (!table_init(&state.shape_names) || !table_init(&state.shape_points) || !table_init(&state.color_names)) {
+        err_mem();
+        goto reterr;
+    }
     state.min_vis_size = 8;
+    state.parser.ptr = data;
+    state.parser.end = data + len;
+    state.parser.line_start = data;
+    state.parser.name = data;
+    state.parser.line = 1;
 
     /* Evaluate the map file */
     while (1) {
         unsigned namelen;
-        if (!parser_read_whitespace(f)) break; /* EOF */
-        namelen = parser_read_name(f, state.text_buf, 256);
+        if (!parser_read_whitespace(&state.parser)) break; /* EOF */
+        namelen = parser_read_name(&state.parser, state.text_buf, 256);
         if (!namelen) {
-            err_want_name();
+            err_want_name(&state.parser);
             goto reterr;
         }
         if (!strcasecmp(state.text_buf, "size")) {
@@ -258,18 +1312,20 @@ unsigned compile_map(FILE* f, struct map* map) {
             float size;
 
             if (state.size_set) {
+                err_pos(&state.parser);
                 fputs("There can only be one 'size' directive\n", stderr);
                 goto reterr;
             }
-            if (!parser_read_whitespace(f) || parser_read_float(f, state.text_buf, 256, &size) != 1) {
-                err_want_number();
+            if (!parser_read_whitespace(&state.parser) || parser_read_float(&state.parser, state.text_buf, 256, &size) != 1) {
+                err_want_number(&state.parser);
                 goto reterr;
             }
-            if (!parser_read_whitespace(f) || fgetc(f) != ';') {
-                err_want_char(';');
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, ';')) {
+                err_want_char(&state.parser, ';');
                 goto reterr;
             }
             if (size <= 0.0f) {
+                err_pos(&state.parser);
                 fputs("Value for 'size' directive must be greater than 0\n", stderr);
                 goto reterr;
             }
@@ -291,23 +1347,26 @@ unsigned compile_map(FILE* f, struct map* map) {
             /* Set the minimum size of 'vis' nodes */
 
             if (state.min_vis_size_set) {
+                err_pos(&state.parser);
                 fputs("There can only be one 'min_vis_size' directive\n", stderr);
                 goto reterr;
             }
             if (state.size_set) {
+                err_pos(&state.parser);
                 fputs("The 'min_vis_size' directive cannot be used after the 'size' directive\n", stderr);
                 goto reterr;
             }
             if (state.tree_set) {
+                err_pos(&state.parser);
                 fputs("The 'min_vis_size' directive cannot be used after the 'tree' directive\n", stderr);
                 goto reterr;
             }
-            if (!parser_read_whitespace(f) || parser_read_float(f, state.text_buf, 256, &state.min_vis_size) != 1) {
-                err_want_number();
+            if (!parser_read_whitespace(&state.parser) || parser_read_float(&state.parser, state.text_buf, 256, &state.min_vis_size) != 1) {
+                err_want_number(&state.parser);
                 goto reterr;
             }
-            if (!parser_read_whitespace(f) || fgetc(f) != ';') {
-                err_want_char(';');
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, ';')) {
+                err_want_char(&state.parser, ';');
                 goto reterr;
             }
             /*
@@ -315,11 +1374,35 @@ unsigned compile_map(FILE* f, struct map* map) {
                 cause problems when figuring out the max depth
             */
             if (state.min_vis_size <= 1.0f) {
+                err_pos(&state.parser);
                 fputs("Value for 'min_vis_size' directive must be greater than 1\n", stderr);
                 goto reterr;
             }
 
             state.min_vis_size_set = 1;
+        } else if (!strcasecmp(state.text_buf, "max_vis_dist")) {
+            /* Set how far apart 'vis' nodes can be and still list each other as siblings */
+
+            if (state.max_vis_dist_set) {
+                err_pos(&state.parser);
+                fputs("There can only be one 'max_vis_dist' directive\n", stderr);
+                goto reterr;
+            }
+            if (!parser_read_whitespace(&state.parser) || parser_read_float(&state.parser, state.text_buf, 256, &state.max_vis_dist) != 1) {
+                err_want_number(&state.parser);
+                goto reterr;
+            }
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, ';')) {
+                err_want_char(&state.parser, ';');
+                goto reterr;
+            }
+            if (state.max_vis_dist <= 0.0f) {
+                err_pos(&state.parser);
+                fputs("Value for 'max_vis_dist' directive must be greater than 0\n", stderr);
+                goto reterr;
+            }
+
+            state.max_vis_dist_set = 1;
         } else if (!strcasecmp(state.text_buf, "shape")) {
             /* Read in a shape */
             /* It takes in 3 numbers (an X, Y, and Z coordinate) 8 times (for the 8 points of the hull) */
@@ -327,14 +1410,14 @@ unsigned compile_map(FILE* f, struct map* map) {
             unsigned i;
             struct compiler_shape* shape;
 
-            if (!parser_read_whitespace(f) || !(i = parser_read_name(f, state.text_buf, 32))) {
-                err_want_name();
+            if (!parser_read_whitespace(&state.parser) || !(i = parser_read_name(&state.parser, state.text_buf, 32))) {
+                err_want_name(&state.parser);
                 goto reterr;
             }
             if (i == -1U) goto reterr;
 
-            if (!parser_read_whitespace(f) || fgetc(f) != '{') {
-                err_want_char('{');
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, '{')) {
+                err_want_char(&state.parser, '{');
                 goto reterr;
             }
 
@@ -349,45 +1432,114 @@ unsigned compile_map(FILE* f, struct map* map) {
             }
             for (i = 0; i < 8; ++i) {
                 /* Read X */
-                if (!parser_read_whitespace(f)) {
-                    err_want_number();
+                if (!parser_read_whitespace(&state.parser)) {
+                    err_want_number(&state.parser);
                     goto reterr;
                 }
-                if (parser_read_float(f, state.text_buf, 256, &shape->data.points[i].x) == -1) goto reterr;
-                if (!parser_read_whitespace(f) || fgetc(f) != ',') {
-                    err_want_char(',');
+                if (parser_read_float(&state.parser, state.text_buf, 256, &shape->data.points[i].x) == -1) goto reterr;
+                if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, ',')) {
+                    err_want_char(&state.parser, ',');
                     goto reterr;
                 }
                 /* Read Y */
-                if (!parser_read_whitespace(f)) {
-                    err_want_number();
+                if (!parser_read_whitespace(&state.parser)) {
+                    err_want_number(&state.parser);
                     goto reterr;
                 }
-                if (parser_read_float(f, state.text_buf, 256, &shape->data.points[i].y) == -1) goto reterr;
-                if (!parser_read_whitespace(f) || fgetc(f) != ',') {
-                    err_want_char(',');
+                if (parser_read_float(&state.parser, state.text_buf, 256, &shape->data.points[i].y) == -1) goto reterr;
+                if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, ',')) {
+                    err_want_char(&state.parser, ',');
                     goto reterr;
                 }
                 /* Read Z */
-                if (!parser_read_whitespace(f)) {
-                    err_want_number();
+                if (!parser_read_whitespace(&state.parser)) {
+                    err_want_number(&state.parser);
+                    goto reterr;
+                }
+                if (parser_read_float(&state.parser, state.text_buf, 256, &shape->data.points[i].z) == -1) goto reterr;
+                if (i < 7 && (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, ','))) {
+                    err_want_char(&state.parser, ',');
+                    goto reterr;
+                }
+            }
+
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, '}')) {
+                err_want_char(&state.parser, '}');
+                goto reterr;
+            }
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, ';')) {
+                err_want_char(&state.parser, ';');
+                goto reterr;
+            }
+
+            if (!add_shape(&state)) goto reterr;
+        } else if (!strcasecmp(state.text_buf, "color")) {
+            /* Read in a color that 'geom' nodes can be given */
+            /* It takes in a red, green, and blue value from 0 to 255 */
+
+            unsigned i;
+            struct compiler_color* color;
+            unsigned char* rgb[3];
+
+            if (!parser_read_whitespace(&state.parser) || !(i = parser_read_name(&state.parser, state.text_buf, 32))) {
+                err_want_name(&state.parser);
+                goto reterr;
+            }
+            if (i == -1U) goto reterr;
+            if (state.colors.len >= MAP_MAX_COLORS - 1) {
+                /* At least one has to be left for the 'vis' nodes */
+                err_name_pos(&state.parser);
+                fprintf(stderr, "There can only be %u colors\n", MAP_MAX_COLORS - 1);
+                goto reterr;
+            }
+
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, '{')) {
+                err_want_char(&state.parser, '{');
+                goto reterr;
+            }
+
+            /* Add the color to the list */
+            VLB_NEXTPTR(state.colors, color, 2, 1, err_mem(); goto reterr;);
+            strcpy(color->name, state.text_buf);
+            color->name_crc = strcasecrc32(state.text_buf);
+            rgb[0] = &color->data.r;
+            rgb[1] = &color->data.g;
+            rgb[2] = &color->data.b;
+            for (i = 0; i < 3; ++i) {
+                float value;
+                int got;
+                if (!parser_read_whitespace(&state.parser)) {
+                    err_want_number(&state.parser);
+                    goto reterr;
+                }
+                got = parser_read_float(&state.parser, state.text_buf, 256, &value);
+                if (got == -1) goto reterr;
+                if (!got) {
+                    err_want_number(&state.parser);
                     goto reterr;
                 }
-                if (parser_read_float(f, state.text_buf, 256, &shape->data.points[i].z) == -1) goto reterr;
-                if (i < 7 && (!parser_read_whitespace(f) || fgetc(f) != ',')) {
-                    err_want_char(',');
+                if (value < 0.0f || value > 255.0f) {
+                    err_pos(&state.parser);
+                    fputs("Color values must be from 0 to 255\n", stderr);
+                    goto reterr;
+                }
+                *rgb[i] = value + 0.5f;
+                if (i < 2 && (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, ','))) {
+                    err_want_char(&state.parser, ',');
                     goto reterr;
                 }
             }
 
-            if (!parser_read_whitespace(f) || fgetc(f) != '}') {
-                err_want_char('}');
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, '}')) {
+                err_want_char(&state.parser, '}');
                 goto reterr;
             }
-            if (!parser_read_whitespace(f) || fgetc(f) != ';') {
-                err_want_char(';');
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, ';')) {
+                err_want_char(&state.parser, ';');
                 goto reterr;
             }
+
+            if (!add_color(&state)) goto reterr;
         } else if (!strcasecmp(state.text_buf, "tree")) {
             /* Read in the node tree */
 
@@ -399,28 +1551,29 @@ unsigned compile_map(FILE* f, struct map* map) {
             initelem.size = state.size;
 
             if (!state.size_set) {
+                err_pos(&state.parser);
                 fputs("There needs to be one 'size' directive\n", stderr);
                 goto reterr;
             }
             if (state.tree_set) {
+                err_pos(&state.parser);
                 fputs("There can only be one 'tree' directive\n", stderr);
                 goto reterr;
             }
-            if (!parser_read_whitespace(f) || fgetc(f) != '{') {
-                err_want_char('{');
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, '{')) {
+                err_want_char(&state.parser, '{');
                 goto reterr;
             }
 
             /* Init the tree reader state */
             tree.compiler = &state;
-            tree.f = f;
             VLB_INIT(tree.stack, 256, err_mem(); goto reterr;);
             VLB_NEXTPTR(tree.stack, elem, 2, 1, VLB_FREE(tree.stack); err_mem(); goto reterr;);
             *elem = initelem;
 
             /* Read in the root (first) node */
-            if (!parser_read_whitespace(f) || !(tree_ret = parser_read_name(f, state.text_buf, 32))) {
-                err_want_name();
+            if (!parser_read_whitespace(&state.parser) || !(tree_ret = parser_read_name(&state.parser, state.text_buf, 32))) {
+                err_want_name(&state.parser);
                 goto reterr;
             }
             if (tree_ret == -1U) goto reterr;
@@ -430,106 +1583,167 @@ unsigned compile_map(FILE* f, struct map* map) {
             VLB_FREE(tree.stack);
             if (tree_ret == -1U) goto reterr;
 
-            if (!parser_read_whitespace(f) || fgetc(f) != '}') {
-                err_want_char('}');
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, '}')) {
+                err_want_char(&state.parser, '}');
                 goto reterr;
             }
-            if (!parser_read_whitespace(f) || fgetc(f) != ';') {
-                err_want_char(';');
+            if (!parser_read_whitespace(&state.parser) || !parser_read_char(&state.parser, ';')) {
+                err_want_char(&state.parser, ';');
                 goto reterr;
             }
 
             state.tree_set = 1;
         } else {
+            err_name_pos(&state.parser);
             fprintf(stderr, "Unknown directive '%s'\n", state.text_buf);
             goto reterr;
         }
     }
 
-    /*
-        Generate the sibling list for each 'vis' node.
-        Siblings must be sorted from near to far to eliminate overdraw.
-    */
-    {
-        unsigned i;
-        struct compiler_vis_sib* sib_sort_data = malloc((state.vis_nodes.len - 1) * sizeof(*sib_sort_data));
-
-        /* For each 'vis' node */
-        for (i = 0; i < state.vis_nodes.len; ++i) {
-            unsigned index = state.vis_nodes.data[i];
-            struct map_node* node = &state.nodes.data[index];
-            unsigned j;
-
-            /* Prepare for sorting by populating the sort data with the indices and distances of all the other 'vis' nodes */
-            {
-                struct compiler_vis_sib* sib_sort_cur = sib_sort_data;
-                for (j = 0; j < state.vis_nodes.len; ++j) {
-                    unsigned sub_index = state.vis_nodes.data[j];
-                    struct map_node* sub_node = &state.nodes.data[sub_index];
-
-                    if (sub_index == index) continue; /* Make it so the 'vis' node doesn't list itself as a sibling */
-
-                    /*
-                        TODO: Occlusion culling
-                        If there is a node completely obstructing the view to
-                        nodes behind it, those obstructed nodes should be
-                        skipped and not added to the sibling list.
-                    */
-
-                    sib_sort_cur->index = sub_index;
-                    sib_sort_cur->dist = vec3_dist(&node->pos, &sub_node->pos);
-                    ++sib_sort_cur;
-                }
-            }
-
-            /* Sort from near to far */
-            qsort(sib_sort_data, state.vis_nodes.len - 1, sizeof(sib_sort_data), sort_vis_sibs);
+    if (!build_vis_sibs(&state, cache)) goto reterr;
 
-            /* Copy out the sorted indices */
-            node->data.vis.first_sibling = state.vis_sibs.len;
-            node->data.vis.sibling_count = state.vis_nodes.len - 1;
-            VLB_EXPANDBY(state.vis_sibs, state.vis_nodes.len - 1, 2, 1, err_mem(); free(sib_sort_data); goto reterr;);
-            {
-                unsigned* first_sib_ptr = state.vis_sibs.data + node->data.vis.first_sibling;
-                for (j = 0; j < state.vis_nodes.len - 1; ++j) {
-                    first_sib_ptr[j] = sib_sort_data[j].index;
-                }
-            }
-        }
+    /* Bake the palette, which is the colors from the map and then the ones the 'vis' nodes use */
+    state.vis_colors = MAP_MAX_COLORS - state.colors.len;
+    if (state.vis_colors > state.vis_nodes.len) state.vis_colors = state.vis_nodes.len;
+    if (!state.vis_colors) state.vis_colors = 1;
+    state.palette = malloc((state.colors.len + state.vis_colors) * sizeof(*state.palette));
+    if (!state.palette) {
+        err_mem();
+        goto reterr;
+    }
+    for (i = 0; i < state.colors.len; ++i) state.palette[i] = state.colors.data[i].data;
+    for (i = 0; i < state.vis_colors; ++i) {
+        /* Pick one off of the index, so that the faces in a 'vis' node can still be merged */
+        struct map_color* color = &state.palette[state.colors.len + i];
+        unsigned hash = crc32(&i, sizeof(i));
+        color->r = ((hash >> 16) & 255) | 64;
+        color->g = ((hash >> 8) & 255) | 64;
+        color->b = (hash & 255) | 64;
+    }
 
-        free(sib_sort_data);
+    /* Pack the nodes into their final layout */
+    VLB_INIT(state.packed_nodes, state.nodes.len, err_mem(); goto reterr;);
+    state.packed_vis = malloc((state.vis_nodes.len + 1) * sizeof(*state.packed_vis));
+    if (!state.packed_vis) {
+        err_mem();
+        goto reterr;
     }
+    if (!pack_nodes(&state)) goto reterr;
+    if (compile_merge_subtrees && !merge_subtrees(&state)) goto reterr;
 
     /* Write out the map data */
     map->size = state.size;
-    VLB_SHRINK(state.nodes, VLB_OOM_NOP);
-    map->nodes = state.nodes.data;
+    map->max_vis_dist = (state.max_vis_dist_set) ? state.max_vis_dist : 0.0f;
+    map->nodes = state.packed_nodes.data;
+    map->node_count = state.packed_nodes.len;
+    map->vis = state.packed_vis;
+    map->vis_count = state.vis_nodes.len;
     VLB_SHRINK(state.vis_sibs, VLB_OOM_NOP);
     map->vis_sibs = state.vis_sibs.data;
-    {
-        unsigned i;
-        map->geom_shapes = malloc(state.geom_shapes.len * sizeof(*map->geom_shapes));
-        for (i = 0; i < state.geom_shapes.len; ++i) {
-            map->geom_shapes[i] = state.geom_shapes.data[i].data;
-        }
-    }
+    map->vis_sib_count = state.vis_sibs.len;
+    VLB_SHRINK(state.unique_shapes, VLB_OOM_NOP);
+    map->geom_shapes = state.unique_shapes.data;
+    map->geom_shape_count = state.unique_shapes.len;
+    map->palette = state.palette;
+    map->palette_count = state.colors.len + state.vis_colors;
+    map->file_data = NULL;
+    map->file_size = 0;
 
     ret_no_set:
+    VLB_FREE(state.nodes);
     VLB_FREE(state.vis_nodes);
     VLB_FREE(state.geom_shapes);
+    VLB_FREE(state.colors);
+    free(state.shape_names.slots);
+    free(state.shape_points.slots);
+    free(state.color_names.slots);
     return retval;
 
     reterr:
     retval = 0;
-    VLB_FREE(state.nodes);
+    VLB_FREE(state.packed_nodes);
+    free(state.packed_vis);
     VLB_FREE(state.vis_sibs);
+    VLB_FREE(state.unique_shapes);
+    free(state.palette);
     goto ret_no_set;
 }
 
+unsigned compile_map_buffer(const char* data, unsigned long len, struct map* map) {
+    return compile_map_cached(data, len, NULL, map);
+}
+
+unsigned compile_map(FILE* f, struct map* map) {
+    struct VLB(char) buf;
+    unsigned retval;
+    /* Read the whole thing into memory */
+    VLB_INIT(buf, 65536, err_mem(); return 0;);
+    while (1) {
+        unsigned long len = buf.len;
+        unsigned long got;
+        VLB_EXPANDBY(buf, 65536, 2, 1, VLB_FREE(buf); err_mem(); return 0;);
+        got = fread(buf.data + len, 1, 65536, f);
+        buf.len = len + got;
+        if (got < 65536) break;
+    }
+    if (ferror(f)) {
+        fputs("Failed to read map\n", stderr);
+        VLB_FREE(buf);
+        return 0;
+    }
+    retval = compile_map_buffer(buf.data, buf.len, map);
+    VLB_FREE(buf);
+    return retval;
+}
+
+struct compile_cache* new_compile_cache(void) {
+    struct compile_cache* cache = calloc(1, sizeof(*cache));
+    if (!cache) return NULL;
+    VLB_INIT(cache->sibs, 1024, free(cache); return NULL;);
+    return cache;
+}
+
+void free_compile_cache(struct compile_cache* cache) {
+    if (cache->pvs) pvs_free(cache->pvs);
+    free(cache->cells);
+    VLB_FREE(cache->sibs);
+    free(cache);
+}
+
+/*
+    Check if the last compile done with 'cache' reused any results. The
+    portal flow isn't exact, so reused results can differ a little from what
+    a full compile would give.
+*/
+unsigned used_compile_cache(const struct compile_cache* cache) {
+    return cache->used;
+}
+
+void set_compile_threads(unsigned count) {
+    compile_threads = count;
+}
+
+void set_compile_merge_subtrees(unsigned merge) {
+    compile_merge_subtrees = merge;
+}
+
+/* Mix the settings that change the compiled map into a hash of its source */
+unsigned hash_compile_options(unsigned crc) {
+    unsigned char options = compile_merge_subtrees;
+    return ccrc32(crc, &options, 1);
+}
+
 void free_map(struct map* map) {
+    if (map->file_data) {
+        /* The arrays point into a mapped map file (see 'mapfile.c') */
+        munmap(map->file_data, map->file_size);
+        return;
+    }
     free(map->nodes);
+    free(map->vis);
     free(map->vis_sibs);
     free(map->geom_shapes);
+    free(map->palette);
 }
 
 #if 0 /* Unused */
@@ -543,104 +1757,143 @@ static void err_bad_char(char c) {
     }
 }
 #endif
-static void err_want_name(void) {
+static void err_pos(const struct parser* p) {
+    fprintf(stderr, "%lu:%lu: ", p->line, (unsigned long)(p->ptr - p->line_start) + 1);
+}
+static void err_name_pos(const struct parser* p) {
+    fprintf(stderr, "%lu:%lu: ", p->line, (unsigned long)(p->name - p->line_start) + 1);
+}
+static void err_want_name(const struct parser* p) {
+    err_pos(p);
     fputs("Expected a name\n", stderr);
 }
-static void err_want_number(void) {
+static void err_want_number(const struct parser* p) {
+    err_pos(p);
     fputs("Expected a number\n", stderr);
 }
-static void err_want_char(char c) {
+static void err_want_char(const struct parser* p, char c) {
+    err_pos(p);
     fprintf(stderr, "Expected '%c'\n", c);
 }
 static void err_mem(void) {
     fputs("Memory error\n", stderr);
 }
 
-static unsigned parser_read_whitespace_simple(FILE* f) {
-    int c = fgetc(f);
-    if (c != ' ' && c != '\t' && c != '\n') {
-        ungetc(c, f);
-        return 0;
-    }
-    do {
-        c = fgetc(f);
-    } while (c == ' ' || c == '\t' || c == '\n');
-    ungetc(c, f);
-    return 1;
-}
-static unsigned parser_read_whitespace(FILE* f) {
-    while (1) {
-        int c;
-        parser_read_whitespace_simple(f);
-        c = fgetc(f);
-        if (c == EOF) return 0;
-        if (c == '#') {
-            parser_skip_line(f);
+/* Returns 0 if the end of the input was reached */
+static unsigned parser_read_whitespace(struct parser* p) {
+    while (p->ptr != p->end) {
+        char c = *p->ptr;
+        if (c == '\n') {
+            ++p->ptr;
+            ++p->line;
+            p->line_start = p->ptr;
+        } else if (c == ' ' || c == '\t') {
+            ++p->ptr;
+        } else if (c == '#') {
+            parser_skip_line(p);
         } else {
-            ungetc(c, f);
             return 1;
         }
     }
+    return 0;
 }
-static unsigned parser_read_name(FILE* f, char* buf, unsigned buflen) {
-    unsigned oldbuflen = buflen;
-    while (1) {
-        int c = fgetc(f);
-        if (!isalnum(c) && c != '_') {
-            ungetc(c, f);
-            break;
-        }
-        if (buflen == 1) {
-            fputs("Name too long\n", stderr);
-            return -1;
-        }
-        *buf++ = c;
-        --buflen;
+/* Only moves past 'c' if it is next */
+static unsigned parser_read_char(struct parser* p, char c) {
+    if (p->ptr == p->end || *p->ptr != c) return 0;
+    ++p->ptr;
+    return 1;
+}
+static unsigned parser_read_name(struct parser* p, char* buf, unsigned buflen) {
+    const char* start = p->ptr;
+    unsigned len;
+    p->name = start;
+    while (p->ptr != p->end && (isalnum((unsigned char)*p->ptr) || *p->ptr == '_')) {
+        ++p->ptr;
     }
-    *buf = '\0';
-    return oldbuflen - buflen;
+    len = p->ptr - start;
+    if (len >= buflen) {
+        p->ptr = start;
+        err_pos(p);
+        fputs("Name too long\n", stderr);
+        return -1;
+    }
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+    return len;
 }
-static int parser_read_float(FILE* f, char* buf, unsigned buflen, float* out) {
+/*
+    Read a number made of an optional '-', digits, and at most one '.'.
+    Numbers with up to 15 significant digits and 22 digits after the '.' are
+    converted directly, which is exact as both parts fit in a double without
+    rounding. Anything else is copied to 'buf' and given to strtod().
+*/
+static int parser_read_float(struct parser* p, char* buf, unsigned buflen, float* out) {
+    static const double pow10[23] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char* start = p->ptr;
+    const char* ptr = p->ptr;
+    unsigned long mant = 0;
+    unsigned digits = 0;    /* Significant digits in 'mant' */
+    unsigned frac = 0;      /* Digits in 'mant' after the '.' */
     unsigned decpt = 0;
-    char* oldptr = buf;
-    int c = fgetc(f);
-    if (isdigit(c) || c == '-') {
-        goto is_valid;
-    } else if (c == '.') {
-        decpt = 1;
-        goto is_valid;
-    }
-    ungetc(c, f);
-    return 0;
-    while (1) {
-        c = fgetc(f);
-        if (!isdigit(c)) {
-            if (c == '.') {
-                if (decpt) {
-                    fputs("Too many '.' in number\n", stderr);
-                    return -1;
-                }
-                decpt = 1;
-            } else {
-                ungetc(c, f);
-                break;
+    unsigned any_digits = 0;
+    unsigned exact = 1;
+    unsigned neg = 0;
+
+    if (ptr == p->end) return 0;
+    if (*ptr == '-') {
+        neg = 1;
+        ++ptr;
+    } else if (*ptr != '.' && (*ptr < '0' || *ptr > '9')) {
+        return 0;
+    }
+    for (; ptr != p->end; ++ptr) {
+        char c = *ptr;
+        if (c >= '0' && c <= '9') {
+            any_digits = 1;
+            if (digits == 15) {
+                exact = 0;
+                continue;
+            }
+            mant = mant * 10 + (c - '0');
+            if (mant) ++digits;
+            if (decpt) ++frac;
+        } else if (c == '.') {
+            if (decpt) {
+                p->ptr = ptr;
+                err_pos(p);
+                fputs("Too many '.' in number\n", stderr);
+                return -1;
             }
+            decpt = 1;
+        } else {
+            break;
         }
-        is_valid:
-        if (buflen == 1) {
+    }
+    p->ptr = ptr;
+
+    if (!any_digits) {
+        *out = 0.0f;
+    } else if (exact && frac < sizeof(pow10) / sizeof(*pow10)) {
+        double value = (double)mant / pow10[frac];
+        *out = (neg) ? -value : value;
+    } else {
+        unsigned len = ptr - start;
+        if (len >= buflen) {
+            p->ptr = start;
+            err_pos(p);
             fputs("Number too long\n", stderr);
             return -1;
         }
-        *buf++ = c;
-        --buflen;
+        memcpy(buf, start, len);
+        buf[len] = '\0';
+        *out = strtod(buf, NULL);
     }
-    *buf = '\0';
-    *out = atof(oldptr);
     return 1;
 }
-static void parser_skip_line(FILE* f) {
-    int c;
-    do {
-        c = fgetc(f);
-    } while (c != '\n' && c != EOF);
+static void parser_skip_line(struct parser* p) {
+    const char* nl = memchr(p->ptr, '\n', p->end - p->ptr);
+    p->ptr = (nl) ? nl : p->end;
 }
@@ -5,7 +5,17 @@
 
 #include <stdio.h>
 
+struct compile_cache;
+
 unsigned compile_map(FILE* in, struct map* out);
+unsigned compile_map_buffer(const char* data, unsigned long len, struct map* out);
+unsigned compile_map_cached(const char* data, unsigned long len, struct compile_cache* cache, struct map* out);
+struct compile_cache* new_compile_cache(void);
+void free_compile_cache(struct compile_cache* cache);
+unsigned used_compile_cache(const struct compile_cache* cache);
 void free_map(struct map* map);
+void set_compile_threads(unsigned count);
+void set_compile_merge_subtrees(unsigned merge);
+unsigned hash_compile_options(unsigned crc);
 
 #endif
@@ -0,0 +1,74 @@
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "glrender.h"
+
+static enum render_mode mode;
+
+static unsigned gl_resize(const struct uvec2* size) {
+    glViewport(0, 0, size->x, size->y);
+    return 1;
+}
+
+static void gl_begin_frame(enum render_mode in_mode, const float* projmat, const float* viewmat) {
+    mode = in_mode;
+
+    glEnable(GL_CULL_FACE);
+    switch (mode) {
+        case RENDER_MODE_NORMAL:
+            glClearColor(0.0f, 0.0f, 0.1f, 1.0f);
+            glEnable(GL_DEPTH_TEST);
+            glDisable(GL_BLEND);
+            break;
+        case RENDER_MODE_OVERDRAW:
+            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+            glEnable(GL_DEPTH_TEST);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+            break;
+        case RENDER_MODE_OVERDRAW_NO_DEPTH:
+            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+            glDisable(GL_DEPTH_TEST);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+            break;
+    }
+
+    glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(projmat);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadMatrixf(viewmat);
+}
+
+static void gl_set_vertices(const struct render_vertex* vertices) {
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(*vertices), vertices->pos);
+    if (mode == RENDER_MODE_NORMAL) {
+        glEnableClientState(GL_COLOR_ARRAY);
+        glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(*vertices), vertices->color);
+    } else {
+        glColor4f(1.0f, 0.0f, 0.0f, 0.05f);
+    }
+}
+
+static void gl_draw_quads(unsigned long first, unsigned long count) {
+    glDrawArrays(GL_QUADS, first, count);
+}
+
+static unsigned gl_end_frame(void) {
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glFlush();
+    return 1;
+}
+
+const struct render_backend gl_render_backend = {
+    gl_resize,
+    gl_begin_frame,
+    gl_set_vertices,
+    gl_draw_quads,
+    gl_end_frame
+};
@@ -0,0 +1,9 @@
+#ifndef OCTEST_GLRENDER_H
+#define OCTEST_GLRENDER_H
+
+#include "renderer.h"
+
+/* Draws with OpenGL 1.1 into the current context (the default backend) */
+extern const struct render_backend gl_render_backend;
+
+#endif
@@ -7,11 +7,18 @@
 #include "util.h"
 #include "renderer.h"
 #include "compiler.h"
+#include "mapfile.h"
+#include "reload.h"
+#include "softrender.h"
+#include "bench.h"
+#include "collide.h"
+#include "workers.h"
 
 #include <math.h>
 #include <stdio.h>
-#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static SDL_Window* window;
 static struct uvec2 window_size = {800, 600};
@@ -20,10 +27,18 @@ static SDL_GLContext gl_ctx;
 static float fov = 90.0f;
 static float nearplane = 0.1f;
 static float farplane = 100.0f;
+static const float default_farplane = 100.0f;
+
+static const struct vec3 camera_half = {0.25f, 0.25f, 0.25f}; /* Size of the box kept out of walls around the camera */
+
+static const unsigned long bench_frames = 1000; /* Length of the path made up for a benchmark if none is given */
 
 static struct map map;
 
+static void put_usage_text(const char* argv0);
 static void put_controls_text(void);
+static void put_render_stats(void);
+static void update_farplane(void);
 
 int main(int argc, char** argv) {
     int retval = 0;
@@ -36,32 +51,142 @@ int main(int argc, char** argv) {
         unsigned move_down      : 1;
         unsigned run            : 1;
         unsigned release_mouse  : 1;
+        unsigned noclip         : 1;
     } actions = {0};
     static const float mouse_sensitivity = 15.0f / 100.0f;
     struct vec3 camera_pos = {0};
     struct vec3 camera_rot = {0};
     long unsigned last_frame_timestamp = gettime_us();
-    const char* map_filename = (argc <= 1) ? "map.txt" : argv[1];
+    const char* map_filename = "map.txt";
+    char* bin_filename = NULL;
+    const char* image_filename = NULL;
+    const char* bench_filename = NULL;
+    const char* path_filename = NULL;
+    const char* record_filename = NULL;
+    struct camera_path camera_path;
+    unsigned compile_only = 0;
+    unsigned ray_bench = 0;
+    unsigned watch_map = 0;
+    enum reload_status reload_status = RELOAD_IDLE;
 
-    /* Compile map */
+    /* Parse args */
     {
-        FILE* f = fopen(map_filename, "r");
-        int ok;
-        if (!f) {
-            fprintf(stderr, "Failed to open '%s': %s\n", map_filename, strerror(errno));
+        int opt;
+        char* end;
+        long threads;
+        while ((opt = getopt(argc, argv, "b:cdo:j:p:qr:s:w")) != -1) {
+            switch (opt) {
+                case 'b': bench_filename = optarg; break;
+                case 'c': compile_only = 1;      break;
+                case 'd': set_compile_merge_subtrees(1); break;
+                case 'o': bin_filename = optarg; break;
+                case 'j':
+                    threads = strtol(optarg, &end, 10);
+                    if (!*optarg || *end || threads < 0) {
+                        fprintf(stderr, "Invalid thread count '%s'\n", optarg);
+                        return 1;
+                    }
+                    set_compile_threads(threads);
+                    set_soft_render_threads(threads);
+                    set_render_threads(threads);
+                    break;
+                case 'p': path_filename = optarg; break;
+                case 'q': ray_bench = 1; break;
+                case 'r': record_filename = optarg; break;
+                case 's': image_filename = optarg; break;
+                case 'w': watch_map = 1; break;
+                default: put_usage_text(argv[0]); return 1;
+            }
+        }
+        if (optind < argc) map_filename = argv[optind++];
+        if (optind < argc) {
+            put_usage_text(argv[0]);
             return 1;
         }
-        ok = compile_map(f, &map);
-        fclose(f);
-        if (!ok) {
-            fputs("Failed to compile map\n", stderr);
+    }
+    /* Default to putting the compiled map next to the text map */
+    if (!bin_filename) {
+        static char default_bin_filename[4096];
+        if (strlen(map_filename) + 5 > sizeof(default_bin_filename)) {
+            fputs("Map filename is too long\n", stderr);
+            return 1;
+        }
+        strcpy(default_bin_filename, map_filename);
+        strcat(default_bin_filename, ".bin");
+        bin_filename = default_bin_filename;
+    }
+
+    /* Only compile the map if asked to */
+    if (compile_only) {
+        if (!build_map_file(map_filename, bin_filename)) {
+            free_workers();
             return 1;
         }
+        free_workers();
+        printf("Compiled '%s' to '%s'\n", map_filename, bin_filename);
+        return 0;
+    }
+
+    /* Load map */
+    if (!load_map(map_filename, bin_filename, NULL, &map)) {
+        fputs("Failed to load map\n", stderr);
+        free_workers();
+        return 1;
+    }
+
+    update_farplane();
+
+    init_camera_path(&camera_path);
+
+    /* Time casting rays along a camera path if asked to */
+    if (ray_bench) {
+        if (
+            !((path_filename) ? read_camera_path(path_filename, &camera_path) : make_camera_path(&map, bench_frames, &camera_path)) ||
+            !run_ray_benchmark(&map, &camera_path, fov)
+        ) {
+            retval = 1;
+        }
+        free_camera_path(&camera_path);
+        if (retval || !(image_filename || bench_filename)) {
+            free_map(&map);
+            free_workers();
+            return retval;
+        }
+    }
+
+    /* Render on the CPU without opening a window if asked to */
+    if (image_filename || bench_filename) {
+        set_render_backend(&soft_render_backend);
+        if (!recalc_proj(&window_size, fov, nearplane, farplane) || !set_map(&map)) {
+            retval = 1;
+        } else if (image_filename) {
+            if (!render(&camera_pos, &camera_rot) || !write_soft_render_image(image_filename)) {
+                retval = 1;
+            } else {
+                printf("Rendered '%s' to '%s'\n", map_filename, image_filename);
+            }
+        }
+        /* Play back a camera path (or one that goes through the map) as fast as possible */
+        if (!retval && bench_filename) {
+            if (
+                !((path_filename) ? read_camera_path(path_filename, &camera_path) : make_camera_path(&map, bench_frames, &camera_path)) ||
+                !run_benchmark(&camera_path, bench_filename)
+            ) {
+                retval = 1;
+            }
+            free_camera_path(&camera_path);
+        }
+        set_map(NULL);
+        free_soft_render();
+        free_map(&map);
+        free_workers();
+        return retval;
     }
 
     /* Init SDL2 */
     if (SDL_Init(SDL_INIT_VIDEO)) {
         fprintf(stderr, "Failed to init SDL: %s\n", SDL_GetError());
+        free_workers();
         return 1;
     }
 
@@ -106,7 +231,16 @@ int main(int argc, char** argv) {
     );
     put_controls_text();
 
-    set_map(&map);
+    if (!set_map(&map)) {
+        fputs("Failed to prepare map for rendering\n", stderr);
+        retval = 1;
+        goto longbreak_only_deletecontext;
+    }
+    /* Start the thread that reloads the map in the background */
+    if (!reload_init(map_filename, bin_filename, watch_map)) {
+        retval = 1;
+        goto longbreak_only_deletecontext;
+    }
 
     /* Set up some SDL attribs */
     SDL_SetRelativeMouseMode(1);
@@ -151,24 +285,32 @@ int main(int argc, char** argv) {
                         case SDL_SCANCODE_LSHIFT: actions.move_down = 1; break;
                         case SDL_SCANCODE_LCTRL: actions.run = 1;        break;
                         case SDL_SCANCODE_R: {
-                            struct map new_map;
-                            FILE* f;
-                            int ok;
                             if (event.key.repeat) break;
-                            f = fopen(map_filename, "r");
-                            if (!f) {
-                                fprintf(stderr, "Failed to open '%s': %s\n", map_filename, strerror(errno));
-                                break;
-                            }
-                            ok = compile_map(f, &new_map);
-                            fclose(f);
-                            if (!ok) {
-                                fputs("Failed to compile map\n", stderr);
-                                break;
-                            }
-                            free_map(&map);
-                            map = new_map;
-                            set_map(&map);
+                            reload_start();
+                        } break;
+                        case SDL_SCANCODE_N: {
+                            if (event.key.repeat) break;
+                            actions.noclip = !actions.noclip;
+                            printf("Noclip %s\n", (actions.noclip) ? "on" : "off");
+                        } break;
+                        case SDL_SCANCODE_O: {
+                            if (event.key.repeat) break;
+                            set_occlusion_culling(!get_occlusion_culling());
+                            printf("Occlusion culling %s\n", (get_occlusion_culling()) ? "on" : "off");
+                        } break;
+                        case SDL_SCANCODE_C: {
+                            struct render_stats stats;
+                            if (event.key.repeat) break;
+                            if (!get_render_stats(0, &stats)) break;
+                            printf(
+                                "Culled %u of %u cells (%u outside the view, %u hidden)\n",
+                                stats.frustum_culled + stats.occlusion_culled, stats.cells,
+                                stats.frustum_culled, stats.occlusion_culled
+                            );
+                        } break;
+                        case SDL_SCANCODE_T: {
+                            if (event.key.repeat) break;
+                            put_render_stats();
                         } break;
                         case SDL_SCANCODE_1: set_render_mode(RENDER_MODE_NORMAL);            break;
                         case SDL_SCANCODE_2: set_render_mode(RENDER_MODE_OVERDRAW);          break;
@@ -202,6 +344,7 @@ int main(int argc, char** argv) {
                         case SDL_WINDOWEVENT_RESIZED: {
                             window_size.x = event.window.data1;
                             window_size.y = event.window.data2;
+                            update_farplane();
                             recalc_proj(&window_size, fov, nearplane, farplane);
                         } break;
                         default: break;
@@ -212,6 +355,34 @@ int main(int argc, char** argv) {
             }
         }
 
+        /* Swap in the reloaded map if there is one, and free the old one in the background */
+        {
+            struct map new_map;
+            if (reload_take_map(&new_map)) {
+                reload_free_map(&map);
+                map = new_map;
+                if (!set_map(&map)) {
+                    fputs("Failed to prepare map for rendering\n", stderr);
+                    retval = 1;
+                    goto longbreak;
+                }
+                update_farplane();
+                recalc_proj(&window_size, fov, nearplane, farplane);
+            }
+        }
+        /* Show when a reload is going on or has failed */
+        {
+            enum reload_status status = reload_get_status();
+            if (status != reload_status) {
+                switch (status) {
+                    case RELOAD_BUSY: SDL_SetWindowTitle(window, "Octree Test (reloading map...)"); break;
+                    case RELOAD_FAILED: SDL_SetWindowTitle(window, "Octree Test (failed to reload map)"); break;
+                    default: SDL_SetWindowTitle(window, "Octree Test"); break;
+                }
+                reload_status = status;
+            }
+        }
+
         /* Handle movement */
         if (actions.move_forwards) camera_movement.z += 1.0f;
         if (actions.move_backwards) camera_movement.z -= 1.0f;
@@ -227,9 +398,16 @@ int main(int argc, char** argv) {
             camera_movement.x = tmp;
         }
         move_speed = ((!actions.run) ? walk_speed : run_speed) * delta;
-        camera_pos.x += camera_movement.x * move_speed;
-        camera_pos.y += camera_movement.y * move_speed;
-        camera_pos.z += camera_movement.z * move_speed;
+        camera_movement.x *= move_speed;
+        camera_movement.y *= move_speed;
+        camera_movement.z *= move_speed;
+        if (!actions.noclip) {
+            collide_slide(&map, &camera_pos, &camera_half, &camera_movement);
+        } else {
+            camera_pos.x += camera_movement.x;
+            camera_pos.y += camera_movement.y;
+            camera_pos.z += camera_movement.z;
+        }
 
         #if 0
         printf(
@@ -242,6 +420,12 @@ int main(int argc, char** argv) {
         );
         #endif
 
+        /* Keep where the camera is so the path can be played back later */
+        if (record_filename && !add_camera_path_frame(&camera_path, &camera_pos, &camera_rot)) {
+            retval = 1;
+            goto longbreak;
+        }
+
         /* Render */
         if (!render(&camera_pos, &camera_rot)) {
             fputs("Rendering error\n", stderr);
@@ -256,15 +440,46 @@ int main(int argc, char** argv) {
 
     SDL_SetRelativeMouseMode(0);
 
+    if (record_filename) {
+        if (write_camera_path(record_filename, &camera_path)) {
+            printf("Recorded %lu frames to '%s'\n", camera_path.len, record_filename);
+        } else {
+            retval = 1;
+        }
+    }
+
+    reload_quit();
+
+    longbreak_only_deletecontext:
     SDL_GL_DeleteContext(gl_ctx);
     longbreak_only_destroywindow:
     SDL_DestroyWindow(window);
     longbreak_only_quit:
     SDL_Quit();
 
+    set_map(NULL);
+    free_map(&map);
+    free_camera_path(&camera_path);
+    free_collide();
+    free_workers();
+
     return retval;
 }
 
+static void put_usage_text(const char* argv0) {
+    fprintf(stderr, "Usage: %s [-c] [-d] [-w] [-o BINFILE] [-j THREADS] [-s IMAGE] [-b CSVFILE] [-q] [-p PATHFILE] [-r PATHFILE] [MAPFILE]\n", argv0);
+    fputs("    -c          - Compile MAPFILE to BINFILE and exit\n", stderr);
+    fputs("    -d          - Share identical subtrees when compiling\n", stderr);
+    fputs("    -o BINFILE  - Compiled map to use (default: MAPFILE.bin)\n", stderr);
+    fputs("    -j THREADS  - Threads to compile, cull and software render with (default: 0, one per CPU)\n", stderr);
+    fputs("    -s IMAGE    - Render a frame on the CPU to IMAGE (a PPM file) and exit\n", stderr);
+    fputs("    -b CSVFILE  - Time rendering along a camera path on the CPU, write each frame to CSVFILE and exit\n", stderr);
+    fputs("    -q          - Time casting rays along a camera path and exit\n", stderr);
+    fputs("    -p PATHFILE - Camera path to use with -b and -q (default: one made up from the map)\n", stderr);
+    fputs("    -r PATHFILE - Record the camera path to PATHFILE\n", stderr);
+    fputs("    -w          - Reload the map when MAPFILE changes\n", stderr);
+}
+
 static void put_controls_text(void) {
     puts("CONTROLS:");
     puts("    Esc    - Exit");
@@ -276,8 +491,78 @@ static void put_controls_text(void) {
     puts("    LShift - Move downwards");
     puts("    LCtrl  - Move faster");
     puts("    M      - Toggle mouse grab");
-    puts("    R      - Reload map");
+    puts("    N      - Toggle noclip (flying through walls)");
+    puts("    R      - Reload map (in the background)");
+    puts("    O      - Toggle occlusion culling");
+    puts("    C      - Print how many cells were culled last frame");
+    puts("    T      - Print what the renderer did over the last frames");
     puts("    1      - Render normal");
     puts("    2      - Render overdraw heatmap");
     puts("    3      - Render overdraw heatmap with depth test disabled");
 }
+
+/*
+    Don't draw past the distance the map's sibling lists were built for.
+    Siblings are dropped by how far away they are in a straight line, but
+    the far plane cuts by depth, so it is pulled in until the corners of the
+    frustum are no further away than that.
+*/
+static void update_farplane(void) {
+    float tan_y, tan_diag;
+    if (map.max_vis_dist <= 0.0f) {
+        farplane = default_farplane;
+        return;
+    }
+    tan_y = (float)tan(DEGTORAD_FLT(fov) * 0.5f);
+    tan_diag = tan_y * (float)sqrt(1.0f + ((float)window_size.x * window_size.x) / ((float)window_size.y * window_size.y));
+    farplane = map.max_vis_dist / (float)sqrt(1.0f + tan_diag * tan_diag);
+}
+
+/* Print the average and worst of what the renderer kept the stats of */
+static void put_render_stats(void) {
+    static const char* const names[] = {
+        "find_us", "cull_us", "draw_us", "finish_us",
+        "parent_nodes", "vis_nodes", "geom_nodes",
+        "cells", "frustum_culled", "occlusion_culled", "cells_drawn", "quads"
+    };
+    #define PUT_RENDER_STATS_COUNT (sizeof(names) / sizeof(*names))
+    unsigned long last[PUT_RENDER_STATS_COUNT];
+    unsigned long sum[PUT_RENDER_STATS_COUNT] = {0};
+    unsigned long max[PUT_RENDER_STATS_COUNT] = {0};
+    unsigned long vis_changes = 0;
+    struct render_stats stats;
+    unsigned frames, i;
+
+    for (frames = 0; get_render_stats(frames, &stats); ++frames) {
+        unsigned long values[PUT_RENDER_STATS_COUNT];
+        values[0] = stats.find_us;
+        values[1] = stats.cull_us;
+        values[2] = stats.draw_us;
+        values[3] = stats.finish_us;
+        values[4] = stats.parent_nodes;
+        values[5] = stats.vis_nodes;
+        values[6] = stats.geom_nodes;
+        values[7] = stats.cells;
+        values[8] = stats.frustum_culled;
+        values[9] = stats.occlusion_culled;
+        values[10] = stats.cells_drawn;
+        values[11] = stats.quads;
+        for (i = 0; i < PUT_RENDER_STATS_COUNT; ++i) {
+            if (!frames) last[i] = values[i];
+            sum[i] += values[i];
+            if (values[i] > max[i]) max[i] = values[i];
+        }
+        vis_changes += stats.vis_changed;
+    }
+    if (!frames) {
+        puts("No render stats (they are not kept if built with OCTEST_NO_RENDER_STATS)");
+        return;
+    }
+
+    printf("Render stats of the last %u frames (the camera changed 'vis' node %lu times):\n", frames, vis_changes);
+    printf("    %-16s %10s %10s %10s\n", "", "last", "average", "max");
+    for (i = 0; i < PUT_RENDER_STATS_COUNT; ++i) {
+        printf("    %-16s %10lu %10.1f %10lu\n", names[i], last[i], (double)sum[i] / frames, max[i]);
+    }
+    #undef PUT_RENDER_STATS_COUNT
+}
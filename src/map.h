@@ -9,9 +9,40 @@ enum map_node_type {
     MAP_NODE_VIS,
     MAP_NODE_GEOM
 };
-struct map_node_parent {
-    unsigned children[8];
+/* Bits of 'map_node.face_mask' */
+enum map_face {
+    MAP_FACE_RIGHT,  /* +X */
+    MAP_FACE_LEFT,   /* -X */
+    MAP_FACE_TOP,    /* +Y */
+    MAP_FACE_BOTTOM, /* -Y */
+    MAP_FACE_FRONT,  /* +Z */
+    MAP_FACE_BACK    /* -Z */
+};
+/* 'map.palette' can't be longer than this, so a color index fits in a byte */
+#define MAP_MAX_COLORS 255
+/* The 'map_node.color' of 'geom' nodes that use the color of the 'vis' node they are in */
+#define MAP_COLOR_NONE 255
+/*
+    Nodes only store what can't be worked out while walking down the tree.
+    The root is 'map.nodes[0]' at (0, 0, 0) with a size of 'map.size', and
+    each child is half the size of its parent and offset by a quarter of it
+    (see 'MAP_NODE_CHILD_POS'). Identical subtrees may be stored once and
+    shared (see 'set_compile_merge_subtrees').
+*/
+struct map_node {
+    unsigned char type;       /* An 'enum map_node_type' */
+    unsigned char child_mask; /* For 'parent' nodes, bit N is set if there is a child N */
+    unsigned char face_mask;
+    /*
+        For 'geom' nodes, bit N is set if face N (an 'enum map_face') can be
+        seen. Faces that have no area, or are flat against a full face of a
+        neighboring node, are left out.
+    */
+    unsigned char color;      /* For 'geom' nodes, indexes 'map.palette' (or is MAP_COLOR_NONE) */
+    unsigned index;
     /*
+        For 'parent' nodes, indexes 'map.nodes' at the first child, with the
+        rest right after it in order.
         Children are ordered by:
         (+X, +Y, +Z),
         (-X, +Y, +Z),
@@ -21,34 +52,22 @@ struct map_node_parent {
         (-X, -Y, +Z),
         (+X, -Y, -Z),
         (-X, -Y, -Z).
-        Each child indexes 'map.nodes'.
+        For 'vis' nodes, indexes 'map.vis'.
+        For 'geom' nodes, indexes 'map.geom_shapes'.
     */
 };
-struct map_node_vis {
-    unsigned depth;
-    unsigned child;         /* Indexes 'map.nodes' */
+struct map_vis {
+    struct vec3 pos;
+    float size;
+    unsigned child;         /* Indexes 'map.nodes' (-1 if the space is empty) */
     unsigned first_sibling; /* Indexes 'map.vis_sibs' */
     unsigned sibling_count;
+    unsigned char color;    /* Indexes 'map.palette' */
 };
-struct map_node_geom {
-    unsigned shape; /* Indexes 'map.geom_shapes' */
-    #if 0
-    struct {
-        unsigned char r;
-        unsigned char g;
-        unsigned char b;
-    } color;
-    #endif
-};
-struct map_node {
-    enum map_node_type type;
-    struct vec3 pos;
-    float size;
-    union {
-        struct map_node_parent parent;
-        struct map_node_vis vis;
-        struct map_node_geom geom;
-    } data;
+struct map_color {
+    unsigned char r;
+    unsigned char g;
+    unsigned char b;
 };
 struct map_node_geom_shape {
     struct vec3 points[8];
@@ -66,9 +85,42 @@ struct map_node_geom_shape {
 };
 struct map {
     float size;
+    float max_vis_dist; /* 0 if there is no limit */
     struct map_node* nodes;
-    unsigned* vis_sibs;
+    struct map_vis* vis;
+    unsigned* vis_sibs;     /* Each indexes 'map.vis' */
     struct map_node_geom_shape* geom_shapes;
+    struct map_color* palette;
+    unsigned node_count;
+    unsigned vis_count;
+    unsigned vis_sib_count;
+    unsigned geom_shape_count;
+    unsigned palette_count;
+    /*
+        If the map was loaded from a map file, the arrays above point into
+        this mapping instead of being allocated separately.
+    */
+    void* file_data;
+    unsigned long file_size;
 };
 
+/*
+    Fill 'out' with the index in 'map.nodes' of each child of the 'parent'
+    node 'node', or -1 where there is no child
+*/
+#define MAP_NODE_GET_CHILDREN(node, out) do {\
+    unsigned MAP__next = (node)->index;\
+    unsigned MAP__i;\
+    for (MAP__i = 0; MAP__i < 8; ++MAP__i) {\
+        (out)[MAP__i] = ((node)->child_mask & (1U << MAP__i)) ? MAP__next++ : -1U;\
+    }\
+} while (0)
+/* Find the center of child 'i' of a node at 'pos' with a size of 'size' */
+#define MAP_NODE_CHILD_POS(pos, size, i, out) do {\
+    float MAP__sub_size = (size) * 0.5f;\
+    (out).x = (pos).x + MAP__sub_size * ((!((i) & 1)) ? 0.5f : -0.5f);\
+    (out).y = (pos).y + MAP__sub_size * ((!((i) & 4)) ? 0.5f : -0.5f);\
+    (out).z = (pos).z + MAP__sub_size * ((!((i) & 2)) ? 0.5f : -0.5f);\
+} while (0)
+
 #endif
@@ -0,0 +1,313 @@
+#include "mapfile.h"
+#include "compiler.h"
+#include "crc.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+    A map file is a 'struct mapfile_header' followed by the arrays of
+    'struct map' exactly as they are laid out in memory, so loading one is a
+    single mmap() with the pointers aimed into the mapping. It is only meant
+    as a cache for the machine that wrote it, so the byte order and struct
+    sizes are recorded and checked instead of being converted.
+*/
+
+#define MAPFILE_ALIGN 16
+
+static const char mapfile_magic[8] = {'O', 'C', 'T', 'M', 'A', 'P', '\0', '\0'};
+
+struct mapfile_header {
+    char magic[8];
+    unsigned version;
+    unsigned byte_order;  /* 0x01020304 in the writer's byte order */
+    unsigned header_size;
+    unsigned node_size;
+    unsigned vis_size;
+    unsigned shape_size;
+    unsigned color_size;
+    unsigned src_crc;     /* 'ccrc32' of the text map the file was compiled from */
+    float size;
+    float max_vis_dist;
+    unsigned node_count;
+    unsigned vis_count;
+    unsigned vis_sib_count;
+    unsigned geom_shape_count;
+    unsigned palette_count;
+    unsigned long nodes_offset;
+    unsigned long vis_offset;
+    unsigned long vis_sibs_offset;
+    unsigned long geom_shapes_offset;
+    unsigned long palette_offset;
+    unsigned long file_size;
+};
+
+static unsigned long mapfile_align(unsigned long offset) {
+    return (offset + (MAPFILE_ALIGN - 1)) & ~(unsigned long)(MAPFILE_ALIGN - 1);
+}
+
+static void mapfile_fill_header(const struct map* map, unsigned src_crc, struct mapfile_header* h) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, mapfile_magic, sizeof(h->magic));
+    h->version = MAPFILE_VERSION;
+    h->byte_order = 0x01020304;
+    h->header_size = sizeof(*h);
+    h->node_size = sizeof(*map->nodes);
+    h->vis_size = sizeof(*map->vis);
+    h->shape_size = sizeof(*map->geom_shapes);
+    h->color_size = sizeof(*map->palette);
+    h->src_crc = src_crc;
+    h->size = map->size;
+    h->max_vis_dist = map->max_vis_dist;
+    h->node_count = map->node_count;
+    h->vis_count = map->vis_count;
+    h->vis_sib_count = map->vis_sib_count;
+    h->geom_shape_count = map->geom_shape_count;
+    h->palette_count = map->palette_count;
+    h->nodes_offset = mapfile_align(sizeof(*h));
+    h->vis_offset = mapfile_align(h->nodes_offset + (unsigned long)h->node_count * h->node_size);
+    h->vis_sibs_offset = mapfile_align(h->vis_offset + (unsigned long)h->vis_count * h->vis_size);
+    h->geom_shapes_offset = mapfile_align(h->vis_sibs_offset + (unsigned long)h->vis_sib_count * sizeof(*map->vis_sibs));
+    h->palette_offset = mapfile_align(h->geom_shapes_offset + (unsigned long)h->geom_shape_count * h->shape_size);
+    h->file_size = h->palette_offset + (unsigned long)h->palette_count * h->color_size;
+}
+
+unsigned hash_map_source(const char* data, unsigned long len) {
+    return hash_compile_options(ccrc32(0, data, len));
+}
+
+static unsigned mapfile_write_at(FILE* f, unsigned long* pos, unsigned long offset, const void* data, unsigned long len) {
+    static const char zeros[MAPFILE_ALIGN] = {0};
+    /* Pad up to the aligned offset */
+    if (offset - *pos && fwrite(zeros, 1, offset - *pos, f) != offset - *pos) return 0;
+    if (len && fwrite(data, 1, len, f) != len) return 0;
+    *pos = offset + len;
+    return 1;
+}
+
+unsigned write_map_file(const char* path, const struct map* map, unsigned src_crc) {
+    struct mapfile_header h;
+    unsigned long pos = 0;
+    char* tmp_path;
+    FILE* f;
+
+    mapfile_fill_header(map, src_crc, &h);
+
+    /* Write to a temporary file and rename it over the old one so a reader never sees a partial file */
+    tmp_path = malloc(strlen(path) + 5);
+    if (!tmp_path) {
+        fputs("Memory error\n", stderr);
+        return 0;
+    }
+    strcpy(tmp_path, path);
+    strcat(tmp_path, ".tmp");
+    f = fopen(tmp_path, "wb");
+    if (!f) {
+        fprintf(stderr, "Failed to open '%s': %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return 0;
+    }
+    if (
+        !mapfile_write_at(f, &pos, 0, &h, sizeof(h)) ||
+        !mapfile_write_at(f, &pos, h.nodes_offset, map->nodes, (unsigned long)h.node_count * h.node_size) ||
+        !mapfile_write_at(f, &pos, h.vis_offset, map->vis, (unsigned long)h.vis_count * h.vis_size) ||
+        !mapfile_write_at(f, &pos, h.vis_sibs_offset, map->vis_sibs, (unsigned long)h.vis_sib_count * sizeof(*map->vis_sibs)) ||
+        !mapfile_write_at(f, &pos, h.geom_shapes_offset, map->geom_shapes, (unsigned long)h.geom_shape_count * h.shape_size) ||
+        !mapfile_write_at(f, &pos, h.palette_offset, map->palette, (unsigned long)h.palette_count * h.color_size)
+    ) {
+        fprintf(stderr, "Failed to write '%s': %s\n", tmp_path, strerror(errno));
+        fclose(f);
+        remove(tmp_path);
+        free(tmp_path);
+        return 0;
+    }
+    if (fclose(f) || rename(tmp_path, path)) {
+        fprintf(stderr, "Failed to write '%s': %s\n", path, strerror(errno));
+        remove(tmp_path);
+        free(tmp_path);
+        return 0;
+    }
+    free(tmp_path);
+    return 1;
+}
+
+unsigned read_map_file(const char* path, unsigned src_crc, struct map* map) {
+    struct mapfile_header expected;
+    const struct mapfile_header* h;
+    struct stat st;
+    void* data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) || (unsigned long)st.st_size < sizeof(*h)) {
+        close(fd);
+        return 0;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    h = data;
+
+    /*
+        Rebuild the header that would be written for a map with the same
+        counts, and require an exact match. This checks the version, layout,
+        source hash and that the arrays fit in the file in one go.
+    */
+    {
+        struct map tmp;
+        tmp.size = h->size;
+        tmp.max_vis_dist = h->max_vis_dist;
+        tmp.node_count = h->node_count;
+        tmp.vis_count = h->vis_count;
+        tmp.vis_sib_count = h->vis_sib_count;
+        tmp.geom_shape_count = h->geom_shape_count;
+        tmp.palette_count = h->palette_count;
+        mapfile_fill_header(&tmp, src_crc, &expected);
+    }
+    if (memcmp(h, &expected, sizeof(expected)) || h->file_size != (unsigned long)st.st_size) {
+        munmap(data, st.st_size);
+        return 0;
+    }
+
+    map->size = h->size;
+    map->max_vis_dist = h->max_vis_dist;
+    map->nodes = (struct map_node*)((char*)data + h->nodes_offset);
+    map->node_count = h->node_count;
+    map->vis = (struct map_vis*)((char*)data + h->vis_offset);
+    map->vis_count = h->vis_count;
+    map->vis_sibs = (unsigned*)((char*)data + h->vis_sibs_offset);
+    map->vis_sib_count = h->vis_sib_count;
+    map->geom_shapes = (struct map_node_geom_shape*)((char*)data + h->geom_shapes_offset);
+    map->geom_shape_count = h->geom_shape_count;
+    map->palette = (struct map_color*)((char*)data + h->palette_offset);
+    map->palette_count = h->palette_count;
+    map->file_data = data;
+    map->file_size = st.st_size;
+    return 1;
+}
+
+/* The text of a map, mapped into memory if possible */
+struct mapfile_source {
+    const char* path;
+    char* data;
+    unsigned long len;
+    unsigned mapped : 1;
+};
+
+static unsigned mapfile_open_source(const char* path, struct mapfile_source* src) {
+    struct stat st;
+    int fd;
+
+    src->path = path;
+    src->data = NULL;
+    src->len = 0;
+    src->mapped = 0;
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "Failed to open '%s': %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            close(fd);
+            src->data = data;
+            src->len = st.st_size;
+            src->mapped = 1;
+            return 1;
+        }
+    }
+    /* Not something that can be mapped, so read it in */
+    while (1) {
+        char* tmp;
+        long got;
+        tmp = realloc(src->data, src->len + 65536);
+        if (!tmp) {
+            fputs("Memory error\n", stderr);
+            break;
+        }
+        src->data = tmp;
+        got = read(fd, src->data + src->len, 65536);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to read '%s': %s\n", path, strerror(errno));
+            break;
+        }
+        if (!got) {
+            close(fd);
+            return 1;
+        }
+        src->len += got;
+    }
+    close(fd);
+    free(src->data);
+    return 0;
+}
+static void mapfile_close_source(struct mapfile_source* src) {
+    if (src->mapped) munmap(src->data, src->len);
+    else free(src->data);
+}
+static unsigned mapfile_compile_source(const struct mapfile_source* src, struct compile_cache* cache, struct map* map) {
+    unsigned ok = compile_map_cached(src->data, src->len, cache, map);
+    if (!ok) fprintf(stderr, "Failed to compile '%s'\n", src->path);
+    return ok;
+}
+
+/*
+    Load the map at 'src_path', going through the compiled map at 'bin_path'
+    if it is not NULL. If 'cache' is not NULL, it is used to only recompile
+    what changed since the last map compiled with it.
+*/
+unsigned load_map(const char* src_path, const char* bin_path, struct compile_cache* cache, struct map* map) {
+    struct mapfile_source src;
+    unsigned src_crc;
+    unsigned ok;
+
+    if (!mapfile_open_source(src_path, &src)) return 0;
+    src_crc = hash_map_source(src.data, src.len);
+
+    /* Use the compiled map if it was built from the same source */
+    if (bin_path && read_map_file(bin_path, src_crc, map)) {
+        mapfile_close_source(&src);
+        return 1;
+    }
+
+    ok = mapfile_compile_source(&src, cache, map);
+    mapfile_close_source(&src);
+    if (!ok) return 0;
+
+    /*
+        Refresh the compiled map for next time (not fatal if it fails). It
+        has to be the same as what 'build_map_file' would make from the same
+        source, so a map that reused cached results is left for the next full
+        compile to write out.
+    */
+    if (bin_path && !(cache && used_compile_cache(cache)) && !write_map_file(bin_path, map, src_crc)) {
+        fprintf(stderr, "Failed to update '%s'\n", bin_path);
+    }
+    return 1;
+}
+
+unsigned build_map_file(const char* src_path, const char* bin_path) {
+    struct mapfile_source src;
+    unsigned src_crc;
+    unsigned ok;
+    struct map map;
+
+    if (!mapfile_open_source(src_path, &src)) return 0;
+    src_crc = hash_map_source(src.data, src.len);
+    ok = mapfile_compile_source(&src, NULL, &map);
+    mapfile_close_source(&src);
+    if (!ok) return 0;
+
+    ok = write_map_file(bin_path, &map, src_crc);
+    free_map(&map);
+    return ok;
+}
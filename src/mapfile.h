@@ -0,0 +1,16 @@
+#ifndef OCTEST_MAPFILE_H
+#define OCTEST_MAPFILE_H
+
+#include "compiler.h"
+#include "map.h"
+
+/* Bump whenever the layout of 'struct map' or anything it points to changes */
+#define MAPFILE_VERSION 5
+
+unsigned hash_map_source(const char* data, unsigned long len);
+unsigned write_map_file(const char* path, const struct map* map, unsigned src_crc);
+unsigned read_map_file(const char* path, unsigned src_crc, struct map* out);
+unsigned load_map(const char* src_path, const char* bin_path, struct compile_cache* cache, struct map* out);
+unsigned build_map_file(const char* src_path, const char* bin_path);
+
+#endif
@@ -0,0 +1,659 @@
+#include "pvs.h"
+#include "vlb.h"
+#include "workers.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define PVS_MAX_POINTS 32
+#define PVS_EPSILON 1e-4f
+#define PVS_FLOW_BUDGET 1024 /* How many portals the flow out of a portal can clip against (see 'pvs_flow_portal') */
+#define PVS_SOLVE_BATCH 256 /* Must not depend on the thread count (see 'pvs_solve') */
+
+#define PVS_WORD_BITS (sizeof(unsigned) * 8)
+#define PVS_BIT_GET(b, i) ((b)[(i) / PVS_WORD_BITS] & (1U << ((i) % PVS_WORD_BITS)))
+#define PVS_BIT_SET(b, i) ((b)[(i) / PVS_WORD_BITS] |= (1U << ((i) % PVS_WORD_BITS)))
+
+struct pvs_plane {
+    struct vec3 normal;
+    float dist;
+};
+struct pvs_winding {
+    unsigned count;
+    struct vec3 points[PVS_MAX_POINTS];
+};
+struct pvs_portal {
+    unsigned from;
+    unsigned to;
+    unsigned pass : 1;      /* If 0, 'to' can be seen but not seen through */
+    struct pvs_plane plane; /* The normal points from 'from' into 'to' */
+    struct vec3 min;
+    struct vec3 max;
+    struct vec3 points[4];
+    unsigned long might;    /* Offset into 'pvs.might' of the cells that could be seen through this portal */
+    unsigned long vis;      /* Offset into 'pvs.vis' of the cells that can be seen through this portal */
+    unsigned might_count;
+    unsigned char done;     /* If 1, 'vis' is filled in */
+};
+struct pvs_cell {
+    struct vec3 min;
+    struct vec3 max;
+    unsigned first_portal;  /* Indexes 'pvs.portals' */
+    unsigned portal_count;
+};
+struct pvs {
+    unsigned cell_count;
+    unsigned words;         /* Number of words in a bitset of cells */
+    float max_dist;         /* 0 if there is no limit */
+    struct pvs_cell* cells;
+    struct VLB(struct pvs_portal) portals;
+    unsigned* might;
+    unsigned* vis;
+};
+
+struct pvs_stack {
+    struct pvs_winding source;
+    struct pvs_winding pass;
+    struct pvs_plane plane;
+    unsigned level;         /* Index of the might-see bitset in 'pvs_scratch.might' */
+};
+struct pvs_scratch {
+    unsigned* vis;
+    struct VLB(unsigned) might;
+    const struct pvs_portal* base;
+    unsigned long budget;   /* How many more portals the flow can clip against before giving up */
+};
+
+static float pvs_dot(const struct vec3* a, const struct vec3* b) {
+    return a->x * b->x + a->y * b->y + a->z * b->z;
+}
+static float pvs_box_dist(const struct vec3* amin, const struct vec3* amax, const struct vec3* bmin, const struct vec3* bmax) {
+    float dx = 0.0f, dy = 0.0f, dz = 0.0f;
+    if (bmin->x > amax->x) dx = bmin->x - amax->x; else if (amin->x > bmax->x) dx = amin->x - bmax->x;
+    if (bmin->y > amax->y) dy = bmin->y - amax->y; else if (amin->y > bmax->y) dy = amin->y - bmax->y;
+    if (bmin->z > amax->z) dz = bmin->z - amax->z; else if (amin->z > bmax->z) dz = amin->z - bmax->z;
+    return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+/* Cut away the part of 'w' that is behind 'plane'. Returns 0 if nothing is left. */
+static unsigned pvs_chop_winding(struct pvs_winding* w, const struct pvs_plane* plane) {
+    float dists[PVS_MAX_POINTS + 1];
+    int sides[PVS_MAX_POINTS + 1];
+    unsigned counts[3] = {0, 0, 0}; /* Front, back, on */
+    struct pvs_winding out;
+    unsigned i;
+
+    for (i = 0; i < w->count; ++i) {
+        float d = pvs_dot(&w->points[i], &plane->normal) - plane->dist;
+        dists[i] = d;
+        if (d > PVS_EPSILON) sides[i] = 0;
+        else if (d < -PVS_EPSILON) sides[i] = 1;
+        else sides[i] = 2;
+        ++counts[sides[i]];
+    }
+    if (!counts[1]) return 1; /* Completely in front */
+    if (!counts[0]) return 0; /* Completely behind */
+    dists[i] = dists[0];
+    sides[i] = sides[0];
+
+    out.count = 0;
+    for (i = 0; i < w->count; ++i) {
+        const struct vec3* p1 = &w->points[i];
+        const struct vec3* p2;
+        struct vec3* mid;
+        float t;
+
+        /* Keep the original if the clipped winding would be too big. It only makes the result less tight. */
+        if (out.count + 2 > PVS_MAX_POINTS) return 1;
+
+        if (sides[i] == 2) {
+            out.points[out.count++] = *p1;
+            continue;
+        }
+        if (sides[i] == 0) out.points[out.count++] = *p1;
+        if (sides[i + 1] == 2 || sides[i + 1] == sides[i]) continue;
+
+        /* Add the point where the edge crosses the plane */
+        p2 = &w->points[(i + 1) % w->count];
+        t = dists[i] / (dists[i] - dists[i + 1]);
+        mid = &out.points[out.count++];
+        mid->x = (plane->normal.x == 1.0f) ? plane->dist : (plane->normal.x == -1.0f) ? -plane->dist : p1->x + t * (p2->x - p1->x);
+        mid->y = (plane->normal.y == 1.0f) ? plane->dist : (plane->normal.y == -1.0f) ? -plane->dist : p1->y + t * (p2->y - p1->y);
+        mid->z = (plane->normal.z == 1.0f) ? plane->dist : (plane->normal.z == -1.0f) ? -plane->dist : p1->z + t * (p2->z - p1->z);
+    }
+    *w = out;
+    return out.count != 0;
+}
+
+/*
+    Clip 'target' to the planes that separate 'source' and 'pass', leaving
+    only the part that can be seen from 'source' through 'pass'. Returns 0 if
+    nothing is left.
+*/
+static unsigned pvs_clip_to_separators(const struct pvs_winding* source, const struct pvs_winding* pass, struct pvs_winding* target, unsigned flip) {
+    unsigned i, j, k;
+    for (i = 0; i < source->count; ++i) {
+        unsigned l = (i + 1) % source->count;
+        struct vec3 v1;
+        v1.x = source->points[l].x - source->points[i].x;
+        v1.y = source->points[l].y - source->points[i].y;
+        v1.z = source->points[l].z - source->points[i].z;
+
+        for (j = 0; j < pass->count; ++j) {
+            struct pvs_plane plane;
+            struct vec3 v2;
+            float len;
+            unsigned fliptest = 0;
+            unsigned front = 0;
+
+            /* Make a plane from the source edge and the pass point */
+            v2.x = pass->points[j].x - source->points[i].x;
+            v2.y = pass->points[j].y - source->points[i].y;
+            v2.z = pass->points[j].z - source->points[i].z;
+            plane.normal.x = v1.y * v2.z - v1.z * v2.y;
+            plane.normal.y = v1.z * v2.x - v1.x * v2.z;
+            plane.normal.z = v1.x * v2.y - v1.y * v2.x;
+            len = pvs_dot(&plane.normal, &plane.normal);
+            if (len < PVS_EPSILON) continue;
+            len = 1.0f / (float)sqrt(len);
+            plane.normal.x *= len;
+            plane.normal.y *= len;
+            plane.normal.z *= len;
+            plane.dist = pvs_dot(&pass->points[j], &plane.normal);
+
+            /* Find which side of the plane the source is on */
+            for (k = 0; k < source->count; ++k) {
+                float d;
+                if (k == i || k == l) continue;
+                d = pvs_dot(&source->points[k], &plane.normal) - plane.dist;
+                if (d < -PVS_EPSILON) {
+                    fliptest = 0;
+                    break;
+                } else if (d > PVS_EPSILON) {
+                    fliptest = 1;
+                    break;
+                }
+            }
+            if (k == source->count) continue; /* Planar with the source */
+            if (fliptest) {
+                plane.normal.x = -plane.normal.x;
+                plane.normal.y = -plane.normal.y;
+                plane.normal.z = -plane.normal.z;
+                plane.dist = -plane.dist;
+            }
+
+            /* It only separates if all of the pass points are on the front side */
+            for (k = 0; k < pass->count; ++k) {
+                float d;
+                if (k == j) continue;
+                d = pvs_dot(&pass->points[k], &plane.normal) - plane.dist;
+                if (d < -PVS_EPSILON) break;
+                if (d > PVS_EPSILON) ++front;
+            }
+            if (k != pass->count || !front) continue;
+
+            if (flip) {
+                plane.normal.x = -plane.normal.x;
+                plane.normal.y = -plane.normal.y;
+                plane.normal.z = -plane.normal.z;
+                plane.dist = -plane.dist;
+            }
+            if (!pvs_chop_winding(target, &plane)) return 0;
+        }
+    }
+    return 1;
+}
+
+static void pvs_portal_winding(const struct pvs_portal* p, struct pvs_winding* w) {
+    w->count = 4;
+    memcpy(w->points, p->points, sizeof(p->points));
+}
+
+struct pvs* pvs_new(unsigned cell_count, float max_dist) {
+    struct pvs* pvs = malloc(sizeof(*pvs));
+    if (!pvs) return NULL;
+    pvs->cell_count = cell_count;
+    pvs->words = (cell_count + PVS_WORD_BITS - 1) / PVS_WORD_BITS;
+    pvs->max_dist = max_dist;
+    pvs->might = NULL;
+    pvs->vis = NULL;
+    pvs->cells = calloc(cell_count + 1, sizeof(*pvs->cells));
+    if (!pvs->cells) {
+        free(pvs);
+        return NULL;
+    }
+    VLB_INIT(pvs->portals, 256, free(pvs->cells); free(pvs); return NULL;);
+    return pvs;
+}
+
+void pvs_free(struct pvs* pvs) {
+    free(pvs->cells);
+    VLB_FREE(pvs->portals);
+    free(pvs->might);
+    free(pvs->vis);
+    free(pvs);
+}
+
+void pvs_set_cell(struct pvs* pvs, unsigned cell, const struct vec3* min, const struct vec3* max) {
+    pvs->cells[cell].min = *min;
+    pvs->cells[cell].max = *max;
+}
+
+static unsigned pvs_add_directed_portal(struct pvs* pvs, unsigned from, unsigned to, unsigned axis, float sign, const struct vec3* min, const struct vec3* max, unsigned pass) {
+    struct pvs_portal* p;
+    VLB_NEXTPTR(pvs->portals, p, 2, 1, return 0;);
+    p->from = from;
+    p->to = to;
+    p->pass = pass;
+    p->plane.normal.x = (axis == 0) ? sign : 0.0f;
+    p->plane.normal.y = (axis == 1) ? sign : 0.0f;
+    p->plane.normal.z = (axis == 2) ? sign : 0.0f;
+    p->plane.dist = pvs_dot(min, &p->plane.normal);
+    p->min = *min;
+    p->max = *max;
+    p->might = 0;
+    p->vis = 0;
+    p->might_count = 0;
+    p->done = 0;
+    /* Go around the rectangle */
+    p->points[0] = *min;
+    p->points[2] = *max;
+    p->points[1] = *min;
+    p->points[3] = *min;
+    switch (axis) {
+        case 0:
+            p->points[1].y = max->y;
+            p->points[3].z = max->z;
+            break;
+        case 1:
+            p->points[1].z = max->z;
+            p->points[3].x = max->x;
+            break;
+        default:
+            p->points[1].x = max->x;
+            p->points[3].y = max->y;
+            break;
+    }
+    return 1;
+}
+
+unsigned pvs_add_portal(struct pvs* pvs, unsigned a, unsigned b, unsigned axis, const struct vec3* min, const struct vec3* max, unsigned flags) {
+    unsigned pass = !(flags & (PVS_PORTAL_BLOCKED_A | PVS_PORTAL_BLOCKED_B));
+    /* If a side is blocked, the other side can't be seen from it at all, so it doesn't need a portal */
+    if (!(flags & PVS_PORTAL_BLOCKED_A) && !pvs_add_directed_portal(pvs, a, b, axis, 1.0f, min, max, pass)) return 0;
+    if (!(flags & PVS_PORTAL_BLOCKED_B) && !pvs_add_directed_portal(pvs, b, a, axis, -1.0f, min, max, pass)) return 0;
+    return 1;
+}
+
+static int pvs_sort_portals(const void* a_ptr, const void* b_ptr) {
+    const struct pvs_portal* a = a_ptr;
+    const struct pvs_portal* b = b_ptr;
+    if (a->from != b->from) return (a->from > b->from) - (a->from < b->from);
+    return (a->to > b->to) - (a->to < b->to);
+}
+
+/* Check if anything in 'q' could be seen from anything in 'p' (both in front of 'p' and 'p' behind 'q') */
+static unsigned pvs_portal_front(const struct pvs_portal* p, const struct pvs_portal* q) {
+    unsigned i;
+    for (i = 0; i < 4; ++i) {
+        if (pvs_dot(&q->points[i], &p->plane.normal) - p->plane.dist > PVS_EPSILON) break;
+    }
+    if (i == 4) return 0;
+    for (i = 0; i < 4; ++i) {
+        if (pvs_dot(&p->points[i], &q->plane.normal) - q->plane.dist < -PVS_EPSILON) break;
+    }
+    return i != 4;
+}
+
+unsigned pvs_prepare(struct pvs* pvs) {
+    unsigned long might_count = 0;
+    unsigned i;
+    unsigned* stack;
+    unsigned* queued;
+
+    /* Group the portals by the cell they lead out of */
+    qsort(pvs->portals.data, pvs->portals.len, sizeof(*pvs->portals.data), pvs_sort_portals);
+    for (i = 0; i < pvs->cell_count; ++i) {
+        pvs->cells[i].first_portal = 0;
+        pvs->cells[i].portal_count = 0;
+    }
+    for (i = pvs->portals.len; i-- > 0;) {
+        struct pvs_cell* cell = &pvs->cells[pvs->portals.data[i].from];
+        cell->first_portal = i;
+        ++cell->portal_count;
+    }
+
+    /* Only portals that can be seen through need a might-see set */
+    for (i = 0; i < pvs->portals.len; ++i) {
+        if (pvs->portals.data[i].pass) {
+            pvs->portals.data[i].might = might_count * pvs->words;
+            pvs->portals.data[i].vis = might_count * pvs->words;
+            ++might_count;
+        }
+    }
+    pvs->might = calloc(might_count * pvs->words + 1, sizeof(*pvs->might));
+    pvs->vis = calloc(might_count * pvs->words + 1, sizeof(*pvs->vis));
+    stack = malloc((pvs->cell_count + 1) * sizeof(*stack));
+    queued = malloc((pvs->words + 1) * sizeof(*queued));
+    if (!pvs->might || !pvs->vis || !stack || !queued) {
+        free(stack);
+        free(queued);
+        return 0;
+    }
+
+    /*
+        Flood out from each portal through every portal that is in front of
+        it to get a rough set of the cells that could be seen through it. This
+        is what keeps the real flow from trying every path through open areas.
+    */
+    for (i = 0; i < pvs->portals.len; ++i) {
+        struct pvs_portal* p = &pvs->portals.data[i];
+        unsigned* might;
+        unsigned stack_len = 0;
+        if (!p->pass) continue;
+        might = pvs->might + p->might;
+
+        /*
+            A cell can be marked through a portal that can't be seen through
+            before one that can is found, so which cells have been flooded
+            into is tracked separately.
+        */
+        memset(queued, 0, pvs->words * sizeof(*queued));
+        PVS_BIT_SET(might, p->to);
+        PVS_BIT_SET(queued, p->to);
+        stack[stack_len++] = p->to;
+        while (stack_len) {
+            struct pvs_cell* cell = &pvs->cells[stack[--stack_len]];
+            unsigned j;
+            for (j = 0; j < cell->portal_count; ++j) {
+                struct pvs_portal* q = &pvs->portals.data[cell->first_portal + j];
+                if (PVS_BIT_GET(queued, q->to) || (!q->pass && PVS_BIT_GET(might, q->to))) continue;
+                if (!pvs_portal_front(p, q)) continue;
+                /* Nothing past the max distance from the portal can be seen through it */
+                if (pvs->max_dist > 0.0f && pvs_box_dist(&p->min, &p->max, &pvs->cells[q->to].min, &pvs->cells[q->to].max) > pvs->max_dist) continue;
+                if (!PVS_BIT_GET(might, q->to)) {
+                    PVS_BIT_SET(might, q->to);
+                    ++p->might_count;
+                }
+                if (q->pass) {
+                    PVS_BIT_SET(queued, q->to);
+                    stack[stack_len++] = q->to;
+                }
+            }
+        }
+    }
+
+    free(stack);
+    free(queued);
+    return 1;
+}
+
+struct pvs_scratch* pvs_new_scratch(const struct pvs* pvs) {
+    struct pvs_scratch* scratch = malloc(sizeof(*scratch));
+    unsigned long might_size = (pvs->words + 1) * 16; /* Room for a few levels of flow to start with */
+    if (!scratch) return NULL;
+    scratch->vis = malloc((pvs->words + 1) * sizeof(*scratch->vis));
+    if (!scratch->vis) {
+        free(scratch);
+        return NULL;
+    }
+    VLB_INIT(scratch->might, might_size, free(scratch->vis); free(scratch); return NULL;);
+    return scratch;
+}
+
+void pvs_free_scratch(struct pvs_scratch* scratch) {
+    free(scratch->vis);
+    VLB_FREE(scratch->might);
+    free(scratch);
+}
+
+unsigned pvs_is_visible(const struct pvs_scratch* scratch, unsigned cell) {
+    return PVS_BIT_GET(scratch->vis, cell) != 0;
+}
+
+/* Flow through the portals of 'cell', which was entered through the pass winding in 'prev' */
+static unsigned pvs_flow(const struct pvs* pvs, struct pvs_scratch* scratch, unsigned cell, const struct pvs_stack* prev) {
+    const struct pvs_cell* c = &pvs->cells[cell];
+    const struct pvs_portal* base = scratch->base;
+    struct pvs_stack stack;
+    unsigned i;
+
+    stack.level = prev->level + 1;
+    /* Make room for the might-see set of this level */
+    VLB_EXPANDTO(scratch->might, (stack.level + 1) * pvs->words, 2, 1, return 0;);
+
+    for (i = 0; i < c->portal_count; ++i) {
+        const struct pvs_portal* q = &pvs->portals.data[c->first_portal + i];
+        const unsigned* prev_might = scratch->might.data + prev->level * pvs->words;
+        unsigned* might = scratch->might.data + stack.level * pvs->words;
+        struct pvs_plane back;
+        unsigned more = 0;
+
+        if (!PVS_BIT_GET(prev_might, q->to)) continue; /* Can't possibly see it */
+
+        /*
+            Skip the portal if it can't lead to anything that hasn't been seen
+            yet. If the portal's own flow is done, what it can really see is a
+            much tighter limit than what it might see.
+        */
+        if (q->pass) {
+            const unsigned* test = (q->done) ? pvs->vis + q->vis : pvs->might + q->might;
+            unsigned j;
+            for (j = 0; j < pvs->words; ++j) {
+                might[j] = prev_might[j] & test[j];
+                more |= might[j] & ~scratch->vis[j];
+            }
+        } else {
+            more = !PVS_BIT_GET(scratch->vis, q->to);
+        }
+        if (!more) continue;
+
+        /* Out of work, so the caller won't use what was found */
+        if (!scratch->budget) return 1;
+        --scratch->budget;
+
+        /* Can't go back out the face that was come in through */
+        if (
+            q->plane.normal.x == -prev->plane.normal.x &&
+            q->plane.normal.y == -prev->plane.normal.y &&
+            q->plane.normal.z == -prev->plane.normal.z
+        ) continue;
+
+        /* Nothing past the max distance from the base portal can be seen through it */
+        if (pvs->max_dist > 0.0f && pvs_box_dist(&base->min, &base->max, &q->min, &q->max) > pvs->max_dist) continue;
+
+        /* The part of the portal past the base portal */
+        pvs_portal_winding(q, &stack.pass);
+        if (!pvs_chop_winding(&stack.pass, &base->plane)) continue;
+        /* The part of the source behind the portal */
+        back.normal.x = -q->plane.normal.x;
+        back.normal.y = -q->plane.normal.y;
+        back.normal.z = -q->plane.normal.z;
+        back.dist = -q->plane.dist;
+        stack.source = prev->source;
+        if (!pvs_chop_winding(&stack.source, &back)) continue;
+
+        /* The cell right past the base portal can see through all of its other portals */
+        if (prev->level) {
+            if (!pvs_chop_winding(&stack.pass, &prev->plane)) continue;
+            if (!pvs_clip_to_separators(&stack.source, &prev->pass, &stack.pass, 0)) continue;
+            if (!pvs_clip_to_separators(&prev->pass, &stack.source, &stack.pass, 1)) continue;
+        }
+
+        PVS_BIT_SET(scratch->vis, q->to);
+        if (q->pass) {
+            stack.plane = q->plane;
+            if (!pvs_flow(pvs, scratch, q->to, &stack)) return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Find the cells that can be seen through a portal from the cell it leads out of */
+static unsigned pvs_flow_portal(struct pvs* pvs, struct pvs_scratch* scratch, struct pvs_portal* p) {
+    struct pvs_stack head;
+
+    memset(scratch->vis, 0, pvs->words * sizeof(*scratch->vis));
+    PVS_BIT_SET(scratch->vis, p->to);
+    scratch->base = p;
+    scratch->budget = PVS_FLOW_BUDGET;
+
+    pvs_portal_winding(p, &head.source);
+    head.pass.count = 0;
+    head.plane = p->plane;
+    head.level = 0;
+    VLB_EXPANDTO(scratch->might, pvs->words, 2, 1, return 0;);
+    memcpy(scratch->might.data, pvs->might + p->might, pvs->words * sizeof(*scratch->might.data));
+    if (!pvs_flow(pvs, scratch, p->to, &head)) return 0;
+
+    /*
+        The number of paths through open areas can grow exponentially, so
+        the flow gives up after a fixed amount of work and the portal falls
+        back to its might-see set, which is conservative but looser.
+    */
+    if (scratch->budget) {
+        memcpy(pvs->vis + p->vis, scratch->vis, pvs->words * sizeof(*pvs->vis));
+    } else {
+        memcpy(pvs->vis + p->vis, pvs->might + p->might, pvs->words * sizeof(*pvs->vis));
+    }
+    return 1;
+}
+
+static int pvs_sort_by_might(const void* a_ptr, const void* b_ptr) {
+    const struct pvs_portal* a = *(const struct pvs_portal* const*)a_ptr;
+    const struct pvs_portal* b = *(const struct pvs_portal* const*)b_ptr;
+    if (a->might_count != b->might_count) return (a->might_count > b->might_count) - (a->might_count < b->might_count);
+    return (a > b) - (a < b);
+}
+
+struct pvs_solve_batch {
+    struct pvs* pvs;
+    struct pvs_scratch** scratch; /* One for each thread */
+    struct pvs_portal** portals;
+};
+static unsigned pvs_solve_job(void* data, unsigned worker, unsigned long job) {
+    struct pvs_solve_batch* batch = data;
+    return pvs_flow_portal(batch->pvs, batch->scratch[worker], batch->portals[job]);
+}
+
+unsigned pvs_solve(struct pvs* pvs, unsigned thread_count) {
+    unsigned retval = 0;
+    struct pvs_portal** order;
+    struct pvs_solve_batch batch;
+    unsigned long count = 0;
+    unsigned long i;
+
+    if (!thread_count) thread_count = 1;
+    order = malloc((pvs->portals.len + 1) * sizeof(*order));
+    batch.scratch = calloc(thread_count, sizeof(*batch.scratch));
+    if (!order || !batch.scratch) goto ret;
+    for (i = 0; i < thread_count; ++i) {
+        batch.scratch[i] = pvs_new_scratch(pvs);
+        if (!batch.scratch[i]) goto ret;
+    }
+    batch.pvs = pvs;
+
+    /*
+        Do the portals that might see the least first so that the ones that
+        might see more can use their results to skip paths early.
+        The portals are done in batches, and the results of a batch are only
+        used once all of it is done, so threads never look at results that
+        are still being written. Skipping paths with the results of other
+        portals can make the result tighter (the flow is not exact), so the
+        batches are a fixed size to get the same output with any number of
+        threads. Portals that were copied by 'pvs_reuse' are left alone.
+    */
+    for (i = 0; i < pvs->portals.len; ++i) {
+        if (pvs->portals.data[i].pass && !pvs->portals.data[i].done) order[count++] = &pvs->portals.data[i];
+    }
+    qsort(order, count, sizeof(*order), pvs_sort_by_might);
+    for (i = 0; i < count; i += PVS_SOLVE_BATCH) {
+        unsigned long size = (count - i < PVS_SOLVE_BATCH) ? count - i : PVS_SOLVE_BATCH;
+        unsigned long j;
+        batch.portals = order + i;
+        if (!run_workers(thread_count, size, pvs_solve_job, &batch)) goto ret;
+        for (j = 0; j < size; ++j) {
+            batch.portals[j]->done = 1;
+        }
+    }
+    retval = 1;
+
+    ret:
+    if (batch.scratch) {
+        for (i = 0; i < thread_count; ++i) {
+            if (batch.scratch[i]) pvs_free_scratch(batch.scratch[i]);
+        }
+        free(batch.scratch);
+    }
+    free(order);
+    return retval;
+}
+
+/* Check if two bitsets have any cells in common */
+static unsigned pvs_bits_intersect(const struct pvs* pvs, const unsigned* a, const unsigned* b) {
+    unsigned i;
+    for (i = 0; i < pvs->words; ++i) {
+        if (a[i] & b[i]) return 1;
+    }
+    return 0;
+}
+
+/*
+    Copy over the results of the portals in 'old' that can't have changed, so
+    'pvs_solve' only has to do the rest. 'old' must have been solved for the
+    same cells, and 'changed' has a nonzero entry for each cell whose contents
+    are different. Anything that can be seen through a portal is seen through
+    a chain of cells that could be seen before, so if none of the changed
+    cells could be seen through the portal before, it sees the same now.
+*/
+unsigned pvs_reuse(struct pvs* pvs, const struct pvs* old, const unsigned char* changed) {
+    unsigned* changed_bits;
+    unsigned long i;
+    if (old->cell_count != pvs->cell_count || old->max_dist != pvs->max_dist) return 1;
+    changed_bits = calloc(pvs->words + 1, sizeof(*changed_bits));
+    if (!changed_bits) return 0;
+    for (i = 0; i < pvs->cell_count; ++i) {
+        if (changed[i]) PVS_BIT_SET(changed_bits, i);
+    }
+    for (i = 0; i < pvs->portals.len; ++i) {
+        struct pvs_portal* p = &pvs->portals.data[i];
+        const struct pvs_portal* q;
+        if (!p->pass || changed[p->from] || changed[p->to]) continue;
+        /* Both lists are sorted by 'from' then 'to' */
+        q = bsearch(p, old->portals.data, old->portals.len, sizeof(*old->portals.data), pvs_sort_portals);
+        if (!q || !q->pass || !q->done) continue;
+        if (pvs_bits_intersect(pvs, old->vis + q->vis, changed_bits)) continue;
+        memcpy(pvs->vis + p->vis, old->vis + q->vis, pvs->words * sizeof(*pvs->vis));
+        p->done = 1;
+    }
+    free(changed_bits);
+    return 1;
+}
+
+unsigned pvs_find(const struct pvs* pvs, struct pvs_scratch* scratch, unsigned cell) {
+    const struct pvs_cell* c = &pvs->cells[cell];
+    unsigned i, j;
+
+    memset(scratch->vis, 0, pvs->words * sizeof(*scratch->vis));
+    PVS_BIT_SET(scratch->vis, cell);
+
+    /* Merge what can be seen through each portal of the cell */
+    for (i = 0; i < c->portal_count; ++i) {
+        const struct pvs_portal* p = &pvs->portals.data[c->first_portal + i];
+        /* Neighbors can always be seen */
+        PVS_BIT_SET(scratch->vis, p->to);
+        if (!p->pass) continue;
+        for (j = 0; j < pvs->words; ++j) {
+            scratch->vis[j] |= pvs->vis[p->vis + j];
+        }
+    }
+
+    return 1;
+}
+
+unsigned pvs_find_equal(const struct pvs* pvs, const struct pvs_scratch* a, const struct pvs_scratch* b) {
+    return !memcmp(a->vis, b->vis, pvs->words * sizeof(*a->vis));
+}
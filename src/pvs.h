@@ -0,0 +1,36 @@
+#ifndef OCTEST_PVS_H
+#define OCTEST_PVS_H
+
+#include "util.h"
+
+/*
+    Potentially visible set solver.
+    Cells are axis aligned boxes and portals are the rectangles where two
+    cells touch. Visibility is flowed through the portals the same way Quake's
+    'vis' tool does it, so the result is conservative: a cell is only left out
+    if no line of sight from the source cell can reach it. The flow through
+    each portal is capped, and portals that hit the cap just use the rougher
+    set of cells that are in front of them.
+*/
+
+#define PVS_PORTAL_BLOCKED_A (1 << 0) /* Cell A can't see into cell B through the portal */
+#define PVS_PORTAL_BLOCKED_B (1 << 1) /* Cell B can't see into cell A through the portal */
+
+struct pvs;
+struct pvs_scratch;
+
+struct pvs* pvs_new(unsigned cell_count, float max_dist);
+void pvs_free(struct pvs* pvs);
+void pvs_set_cell(struct pvs* pvs, unsigned cell, const struct vec3* min, const struct vec3* max);
+unsigned pvs_add_portal(struct pvs* pvs, unsigned a, unsigned b, unsigned axis, const struct vec3* min, const struct vec3* max, unsigned flags);
+unsigned pvs_prepare(struct pvs* pvs);
+unsigned pvs_reuse(struct pvs* pvs, const struct pvs* old, const unsigned char* changed);
+unsigned pvs_solve(struct pvs* pvs, unsigned thread_count);
+
+struct pvs_scratch* pvs_new_scratch(const struct pvs* pvs);
+void pvs_free_scratch(struct pvs_scratch* scratch);
+unsigned pvs_find(const struct pvs* pvs, struct pvs_scratch* scratch, unsigned cell);
+unsigned pvs_is_visible(const struct pvs_scratch* scratch, unsigned cell);
+unsigned pvs_find_equal(const struct pvs* pvs, const struct pvs_scratch* a, const struct pvs_scratch* b);
+
+#endif
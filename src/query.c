@@ -0,0 +1,536 @@
+#include "query.h"
+
+#include <float.h>
+#include <stdio.h>
+
+/* How many bits are set in each byte */
+static const unsigned char popcount8[256] = {
+    #define QUERY__B2(n) n, n + 1, n + 1, n + 2
+    #define QUERY__B4(n) QUERY__B2(n), QUERY__B2(n + 1), QUERY__B2(n + 1), QUERY__B2(n + 2)
+    #define QUERY__B6(n) QUERY__B4(n), QUERY__B4(n + 1), QUERY__B4(n + 1), QUERY__B4(n + 2)
+    QUERY__B6(0), QUERY__B6(1), QUERY__B6(1), QUERY__B6(2)
+    #undef QUERY__B2
+    #undef QUERY__B4
+    #undef QUERY__B6
+};
+/* How far child 'i' of a 'parent' node is from its first child */
+#define CHILD_OFFSET(child_mask, i) (popcount8[(child_mask) & ((1U << (i)) - 1)])
+
+/*
+    Find the node each point is in.
+    Each point is walked down the tree on its own. Walking 8 at a time in
+    lanes was tried, but every step is a load that depends on the last one,
+    so the lanes only added work. Points that are close together in the
+    batch walk the same nodes, so they stay in the cache.
+*/
+void query_points(const struct map* map, const struct vec3* points, unsigned long count, struct query_point_hit* out) {
+    const struct map_node* nodes = map->nodes;
+    float half = map->size * 0.5f;
+    unsigned long p;
+    for (p = 0; p < count; ++p) {
+        float x = points[p].x, y = points[p].y, z = points[p].z;
+        float cx = 0.0f, cy = 0.0f, cz = 0.0f;
+        float size = map->size;
+        unsigned node = 0, vis = -1U, geom = -1U;
+        unsigned depth;
+        for (depth = 0; depth < QUERY_MAX_DEPTH; ++depth) {
+            const struct map_node* n = &nodes[node];
+            unsigned child;
+            float quarter;
+            if (n->type != MAP_NODE_PARENT) {
+                /* A 'vis' node covers the same space as its child, so go straight through it */
+                if (n->type == MAP_NODE_VIS) {
+                    vis = n->index;
+                    node = map->vis[vis].child;
+                    if (node == -1U) break;
+                    n = &nodes[node];
+                }
+                if (n->type == MAP_NODE_GEOM) {
+                    geom = node;
+                    break;
+                }
+                /* Broken map (a 'vis' node inside another one, or an unknown type) */
+                if (n->type != MAP_NODE_PARENT) {
+                    vis = -1U;
+                    break;
+                }
+            }
+            /* Follow the child the point is in (or closest to, if it is outside the map) */
+            child = (x < cx) | ((y < cy) << 2) | ((z < cz) << 1);
+            quarter = size * 0.25f;
+            cx += (child & 1) ? -quarter : quarter;
+            cy += (child & 4) ? -quarter : quarter;
+            cz += (child & 2) ? -quarter : quarter;
+            size *= 0.5f;
+            if (!(n->child_mask & (1U << child))) break;
+            node = n->index + CHILD_OFFSET(n->child_mask, child);
+        }
+        /* Anything that went too deep is from a broken map too */
+        if (depth == QUERY_MAX_DEPTH) vis = geom = -1U;
+        /* Points outside the map were only walked down to find the closest 'vis' node */
+        if (x < -half || x > half || y < -half || y > half || z < -half || z > half) geom = -1U;
+        out[p].vis = vis;
+        out[p].geom = geom;
+        out[p].pos.x = cx;
+        out[p].pos.y = cy;
+        out[p].pos.z = cz;
+        out[p].size = size;
+    }
+}
+
+struct query_stack_elem {
+    unsigned node;
+    unsigned depth;
+    struct vec3 pos;
+    float size;
+};
+
+/* Find the 'geom' nodes that overlap a box, returns -1 if the map is broken */
+static unsigned long query_box(
+    const struct map* map, const struct query_box* box,
+    struct query_node* nodes, unsigned long max_nodes, unsigned long found
+) {
+    /* Each level can leave at most 7 children waiting */
+    struct query_stack_elem stack[QUERY_MAX_DEPTH * 7 + 1];
+    unsigned stack_len = 1;
+    unsigned long retval = 0;
+
+    /* Boxes outside the map can't overlap anything */
+    {
+        float half = map->size * 0.5f;
+        if (
+            box->max.x <= -half || box->min.x >= half ||
+            box->max.y <= -half || box->min.y >= half ||
+            box->max.z <= -half || box->min.z >= half
+        ) return 0;
+    }
+
+    stack[0].node = 0;
+    stack[0].depth = 0;
+    stack[0].pos.x = stack[0].pos.y = stack[0].pos.z = 0.0f;
+    stack[0].size = map->size;
+    while (stack_len) {
+        struct query_stack_elem elem = stack[--stack_len];
+        const struct map_node* node = &map->nodes[elem.node];
+        if (node->type == MAP_NODE_VIS) {
+            elem.node = map->vis[node->index].child;
+            if (elem.node == -1U) continue;
+            node = &map->nodes[elem.node];
+        }
+        if (node->type == MAP_NODE_GEOM) {
+            if (found + retval < max_nodes) {
+                struct query_node* out = &nodes[found + retval];
+                out->node = elem.node;
+                out->pos = elem.pos;
+                out->size = elem.size;
+            }
+            ++retval;
+        } else if (node->type == MAP_NODE_PARENT && elem.depth < QUERY_MAX_DEPTH) {
+            /* Test all 8 children against the box at once, split up by axis */
+            float x[8], y[8], z[8];
+            float quarter = elem.size * 0.25f;
+            unsigned overlap = 0;
+            unsigned next = node->index;
+            unsigned i;
+            for (i = 0; i < 8; ++i) {
+                x[i] = elem.pos.x + ((i & 1) ? -quarter : quarter);
+                y[i] = elem.pos.y + ((i & 4) ? -quarter : quarter);
+                z[i] = elem.pos.z + ((i & 2) ? -quarter : quarter);
+            }
+            for (i = 0; i < 8; ++i) {
+                overlap |= (unsigned)(
+                    (x[i] - quarter < box->max.x) & (x[i] + quarter > box->min.x) &
+                    (y[i] - quarter < box->max.y) & (y[i] + quarter > box->min.y) &
+                    (z[i] - quarter < box->max.z) & (z[i] + quarter > box->min.z)
+                ) << i;
+            }
+            overlap &= node->child_mask;
+            /* Push in reverse so the children come out in order */
+            for (i = 8; i-- > 0;) {
+                struct query_stack_elem* sub;
+                if (!(overlap & (1U << i))) continue;
+                sub = &stack[stack_len++];
+                sub->node = next + CHILD_OFFSET(node->child_mask, i);
+                sub->depth = elem.depth + 1;
+                sub->pos.x = x[i];
+                sub->pos.y = y[i];
+                sub->pos.z = z[i];
+                sub->size = elem.size * 0.5f;
+            }
+        } else {
+            return -1UL;
+        }
+    }
+    return retval;
+}
+
+/*
+    Find the 'geom' nodes that overlap each box (just touching does not
+    count). They are written to 'nodes' one box after the other, and the
+    nodes of box N end at 'ends[N]'. Returns how many were found in all, or
+    -1 if the map is broken. If that is more than 'max_nodes', the nodes past
+    it were left out, but 'ends' is still filled in as if they were there, so
+    the query can be run again with a big enough buffer.
+*/
+unsigned long query_boxes(
+    const struct map* map, const struct query_box* boxes, unsigned long count,
+    struct query_node* nodes, unsigned long max_nodes, unsigned long* ends
+) {
+    unsigned long found = 0;
+    unsigned long i;
+    for (i = 0; i < count; ++i) {
+        unsigned long tmp = query_box(map, &boxes[i], nodes, max_nodes, found);
+        if (tmp == -1UL) {
+            fputs("Expected node type of PARENT, VIS or GEOM\n", stderr);
+            return -1UL;
+        }
+        found += tmp;
+        ends[i] = found;
+    }
+    return found;
+}
+
+/* Points of each face of a shape, in the same order the renderer draws them in (see 'enum map_face') */
+static const unsigned char face_points[6][4] = {
+    {0, 2, 6, 4},
+    {1, 5, 7, 3},
+    {0, 1, 3, 2},
+    {4, 6, 7, 5},
+    {0, 4, 5, 1},
+    {2, 3, 7, 6}
+};
+/* Bit of a child index for each axis */
+static const unsigned axis_bits[3] = {1, 4, 2};
+
+/* A ray set up for walking the tree */
+struct query_ray_state {
+    float origin[3];
+    float dir[3];
+    float inv_dir[3];   /* 0 where 'dir' is 0 (see 'ray_box') */
+    float max_dist;
+    struct query_ray_hit* hit;
+};
+
+static void ray_setup(const struct query_ray* ray, struct query_ray_hit* hit, struct query_ray_state* out) {
+    unsigned a;
+    out->origin[0] = ray->origin.x;
+    out->origin[1] = ray->origin.y;
+    out->origin[2] = ray->origin.z;
+    out->dir[0] = ray->dir.x;
+    out->dir[1] = ray->dir.y;
+    out->dir[2] = ray->dir.z;
+    for (a = 0; a < 3; ++a) out->inv_dir[a] = (out->dir[a] != 0.0f) ? 1.0f / out->dir[a] : 0.0f;
+    out->max_dist = ray->max_dist;
+    out->hit = hit;
+    hit->geom = -1U;
+    hit->face = 0;
+    hit->dist = ray->max_dist;
+    hit->pos.x = hit->pos.y = hit->pos.z = 0.0f;
+    hit->size = 0.0f;
+}
+
+/* Work out where a ray goes in and out of a box, returns 0 if it misses */
+static unsigned ray_box(const struct query_ray_state* ray, const float* center, float half, float* t0, float* t1) {
+    float enter = 0.0f, leave = ray->max_dist;
+    unsigned a;
+    for (a = 0; a < 3; ++a) {
+        if (ray->dir[a] != 0.0f) {
+            float ta = (center[a] - half - ray->origin[a]) * ray->inv_dir[a];
+            float tb = (center[a] + half - ray->origin[a]) * ray->inv_dir[a];
+            if (ta > tb) {
+                float tmp = ta;
+                ta = tb;
+                tb = tmp;
+            }
+            if (ta > enter) enter = ta;
+            if (tb < leave) leave = tb;
+        } else if (ray->origin[a] < center[a] - half || ray->origin[a] > center[a] + half) {
+            return 0;
+        }
+    }
+    *t0 = enter;
+    *t1 = leave;
+    return enter <= leave;
+}
+
+/* Work out where the points of a 'geom' node's shape are */
+static void get_shape_points(const struct map* map, unsigned node, const float* center, float size, float points[8][3]) {
+    const struct map_node_geom_shape* shape = &map->geom_shapes[map->nodes[node].index];
+    float half = size * 0.5f;
+    unsigned i;
+    for (i = 0; i < 8; ++i) {
+        points[i][0] = center[0] + shape->points[i].x * half;
+        points[i][1] = center[1] + shape->points[i].y * half;
+        points[i][2] = center[2] + shape->points[i].z * half;
+    }
+}
+
+/*
+    Test a ray against the faces of a shape, split into triangles the same
+    way they are drawn. Faces are hit from either side. Returns 1 and fills
+    in the hit if one is closer than 'hit.dist'.
+*/
+static unsigned ray_shape(const struct query_ray_state* ray, float points[8][3], unsigned node, const float* center, float size, struct query_ray_hit* hit) {
+    unsigned found = 0;
+    unsigned i, face;
+    for (face = 0; face < 6; ++face) {
+        for (i = 0; i < 2; ++i) {
+            /* Moller-Trumbore */
+            const float* p0 = points[face_points[face][0]];
+            const float* p1 = points[face_points[face][i + 1]];
+            const float* p2 = points[face_points[face][i + 2]];
+            float e1[3], e2[3], pv[3], tv[3], qv[3];
+            float det, inv_det, u, v, t;
+            unsigned a;
+            for (a = 0; a < 3; ++a) {
+                e1[a] = p1[a] - p0[a];
+                e2[a] = p2[a] - p0[a];
+                tv[a] = ray->origin[a] - p0[a];
+            }
+            pv[0] = ray->dir[1] * e2[2] - ray->dir[2] * e2[1];
+            pv[1] = ray->dir[2] * e2[0] - ray->dir[0] * e2[2];
+            pv[2] = ray->dir[0] * e2[1] - ray->dir[1] * e2[0];
+            det = e1[0] * pv[0] + e1[1] * pv[1] + e1[2] * pv[2];
+            if (det == 0.0f) continue; /* Parallel, or a triangle with no area */
+            inv_det = 1.0f / det;
+            u = (tv[0] * pv[0] + tv[1] * pv[1] + tv[2] * pv[2]) * inv_det;
+            if (u < 0.0f || u > 1.0f) continue;
+            qv[0] = tv[1] * e1[2] - tv[2] * e1[1];
+            qv[1] = tv[2] * e1[0] - tv[0] * e1[2];
+            qv[2] = tv[0] * e1[1] - tv[1] * e1[0];
+            v = (ray->dir[0] * qv[0] + ray->dir[1] * qv[1] + ray->dir[2] * qv[2]) * inv_det;
+            if (v < 0.0f || u + v > 1.0f) continue;
+            t = (e2[0] * qv[0] + e2[1] * qv[1] + e2[2] * qv[2]) * inv_det;
+            /* A ray starting on a face doesn't hit it, so it makes no difference which side of a node it starts on */
+            if (t <= 0.0f || t > hit->dist) continue;
+            hit->geom = node;
+            hit->face = face;
+            hit->dist = t;
+            hit->pos.x = center[0];
+            hit->pos.y = center[1];
+            hit->pos.z = center[2];
+            hit->size = size;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+/*
+    Walk a ray through a node from 't0' to 't1', returns 1 once something is
+    hit, or -1 if the map is broken.
+    Children are visited in the order the ray goes through them: it starts in
+    the child it goes in through, and at each of the node's middle planes the
+    ray crosses, the bit for that axis in the child index flips.
+*/
+static unsigned ray_node(const struct map* map, const struct query_ray_state* ray, unsigned node, const float* center, float size, float t0, float t1, unsigned depth) {
+    const struct map_node* n = &map->nodes[node];
+    float mid[3];
+    float quarter;
+    unsigned child = 0;
+    unsigned a;
+
+    if (n->type == MAP_NODE_VIS) {
+        node = map->vis[n->index].child;
+        if (node == -1U) return 0;
+        n = &map->nodes[node];
+    }
+    if (n->type == MAP_NODE_GEOM) {
+        float points[8][3];
+        get_shape_points(map, node, center, size, points);
+        return ray_shape(ray, points, node, center, size, ray->hit);
+    }
+    if (n->type != MAP_NODE_PARENT || depth >= QUERY_MAX_DEPTH) return -1U;
+
+    /* When the ray crosses the middle plane on each axis, and which side it starts on */
+    for (a = 0; a < 3; ++a) {
+        if (ray->dir[a] != 0.0f) {
+            mid[a] = (center[a] - ray->origin[a]) * ray->inv_dir[a];
+            if ((ray->dir[a] > 0.0f) ? t0 < mid[a] : t0 >= mid[a]) child |= axis_bits[a];
+        } else {
+            mid[a] = FLT_MAX;
+            if (ray->origin[a] < center[a]) child |= axis_bits[a];
+        }
+    }
+    quarter = size * 0.25f;
+    while (1) {
+        float t = t1;
+        if (n->child_mask & (1U << child)) {
+            float child_center[3];
+            unsigned tmp;
+            for (a = 0; a < 3; ++a) child_center[a] = center[a] + ((child & axis_bits[a]) ? -quarter : quarter);
+            for (a = 0; a < 3; ++a) {
+                if (mid[a] > t0 && mid[a] < t) t = mid[a];
+            }
+            tmp = ray_node(map, ray, n->index + CHILD_OFFSET(n->child_mask, child), child_center, size * 0.5f, t0, t, depth + 1);
+            if (tmp) return tmp;
+        } else {
+            for (a = 0; a < 3; ++a) {
+                if (mid[a] > t0 && mid[a] < t) t = mid[a];
+            }
+        }
+        if (t >= t1) return 0;
+        /* Cross into the next child (more than one axis at once if it goes through an edge) */
+        for (a = 0; a < 3; ++a) {
+            if (mid[a] == t) child ^= axis_bits[a];
+        }
+        t0 = t;
+    }
+}
+
+/* Find the first 'geom' node each ray hits, and how far along the ray it is */
+void query_rays(const struct map* map, const struct query_ray* rays, unsigned long count, struct query_ray_hit* out) {
+    static const float root_center[3] = {0.0f, 0.0f, 0.0f};
+    unsigned long i;
+    for (i = 0; i < count; ++i) {
+        struct query_ray_state ray;
+        float t0, t1;
+        ray_setup(&rays[i], &out[i], &ray);
+        if (!ray_box(&ray, root_center, map->size * 0.5f, &t0, &t1)) continue;
+        if (ray_node(map, &ray, 0, root_center, map->size, t0, t1, 0) == -1U) {
+            /* Broken map, so count it as a miss */
+            out[i].geom = -1U;
+            out[i].dist = rays[i].max_dist;
+        }
+    }
+}
+
+struct query_packet_elem {
+    unsigned node;
+    unsigned depth;
+    unsigned rays;      /* Bit N is set if ray N could hit something in the node */
+    float center[3];
+    float size;
+};
+
+/*
+    Walk up to QUERY_PACKET_RAYS rays down the tree together. Each node is
+    tested against all of the rays at once, and only the rays that go
+    through it (and have not hit anything closer yet) go on to its children.
+    Once only one ray is left in a node, the rest of the node is walked with
+    'ray_node'.
+    Children are visited front to back for the direction of the first ray.
+    Rays going other ways still get the right hit, since a hit is only kept
+    if it is the closest yet, they just get less out of the early outs.
+*/
+static void ray_packet(const struct map* map, const struct query_ray* rays, unsigned count, struct query_ray_hit* out) {
+    struct query_ray_state ray[QUERY_PACKET_RAYS];
+    /*
+        The rays split up by axis, so the box tests are straight loops over
+        every lane. Unused lanes get a 'best' of -1 so they never go into a
+        node.
+    */
+    float origin[3][QUERY_PACKET_RAYS], inv_dir[3][QUERY_PACKET_RAYS];
+    float best[QUERY_PACKET_RAYS];
+    struct query_packet_elem stack[QUERY_MAX_DEPTH * 7 + 1];
+    unsigned stack_len = 1;
+    unsigned order = 0;     /* XORed with 0 to 7 to get the children from front to back */
+    unsigned i, a;
+
+    for (i = 0; i < count; ++i) ray_setup(&rays[i], &out[i], &ray[i]);
+    for (a = 0; a < 3; ++a) {
+        for (i = 0; i < QUERY_PACKET_RAYS; ++i) {
+            origin[a][i] = (i < count) ? ray[i].origin[a] : 0.0f;
+            /*
+                Not moving on an axis is treated like moving very slowly, which
+                puts the slab either all along the ray or nowhere on it
+            */
+            inv_dir[a][i] = (i < count && ray[i].dir[a] != 0.0f) ? ray[i].inv_dir[a] : 1e30f;
+        }
+        if (ray[0].dir[a] >= 0.0f) order |= axis_bits[a];
+    }
+    for (i = 0; i < QUERY_PACKET_RAYS; ++i) best[i] = (i < count) ? ray[i].max_dist : -1.0f;
+
+    stack[0].node = 0;
+    stack[0].depth = 0;
+    stack[0].rays = (count < 32) ? (1U << count) - 1 : -1U;
+    stack[0].center[0] = stack[0].center[1] = stack[0].center[2] = 0.0f;
+    stack[0].size = map->size;
+    while (stack_len) {
+        struct query_packet_elem elem = stack[--stack_len];
+        const struct map_node* node;
+        float half = elem.size * 0.5f;
+        float enter[QUERY_PACKET_RAYS], leave[QUERY_PACKET_RAYS];
+        unsigned hit_rays = 0;
+
+        /* Test the node's box against every ray */
+        for (i = 0; i < QUERY_PACKET_RAYS; ++i) {
+            enter[i] = 0.0f;
+            leave[i] = best[i];
+        }
+        for (a = 0; a < 3; ++a) {
+            float min = elem.center[a] - half, max = elem.center[a] + half;
+            for (i = 0; i < QUERY_PACKET_RAYS; ++i) {
+                float ta = (min - origin[a][i]) * inv_dir[a][i];
+                float tb = (max - origin[a][i]) * inv_dir[a][i];
+                float lo = (ta < tb) ? ta : tb;
+                float hi = (ta < tb) ? tb : ta;
+                enter[i] = (lo > enter[i]) ? lo : enter[i];
+                leave[i] = (hi < leave[i]) ? hi : leave[i];
+            }
+        }
+        for (i = 0; i < QUERY_PACKET_RAYS; ++i) hit_rays |= (unsigned)(enter[i] < leave[i]) << i;
+        elem.rays &= hit_rays;
+        if (!elem.rays) continue;
+        if (!(elem.rays & (elem.rays - 1))) {
+            /* Only one ray is left, which is quicker to walk on its own */
+            for (i = 0; !(elem.rays & (1U << i)); ++i);
+            if (ray_node(map, &ray[i], elem.node, elem.center, elem.size, enter[i], leave[i], elem.depth) == -1U) goto broken;
+            best[i] = out[i].dist;
+            continue;
+        }
+
+        node = &map->nodes[elem.node];
+        if (node->type == MAP_NODE_VIS) {
+            elem.node = map->vis[node->index].child;
+            if (elem.node == -1U) continue;
+            node = &map->nodes[elem.node];
+        }
+        if (node->type == MAP_NODE_GEOM) {
+            float points[8][3];
+            get_shape_points(map, elem.node, elem.center, elem.size, points);
+            for (i = 0; i < count; ++i) {
+                if ((elem.rays & (1U << i)) && ray_shape(&ray[i], points, elem.node, elem.center, elem.size, &out[i])) best[i] = out[i].dist;
+            }
+        } else if (node->type == MAP_NODE_PARENT && elem.depth < QUERY_MAX_DEPTH) {
+            float quarter = elem.size * 0.25f;
+            unsigned j;
+            /* Push from back to front so the front child comes off first */
+            for (j = 8; j-- > 0;) {
+                unsigned child = j ^ order;
+                struct query_packet_elem* sub;
+                if (!(node->child_mask & (1U << child))) continue;
+                sub = &stack[stack_len++];
+                sub->node = node->index + CHILD_OFFSET(node->child_mask, child);
+                sub->depth = elem.depth + 1;
+                sub->rays = elem.rays;
+                for (a = 0; a < 3; ++a) sub->center[a] = elem.center[a] + ((child & axis_bits[a]) ? -quarter : quarter);
+                sub->size = elem.size * 0.5f;
+            }
+        } else {
+            goto broken;
+        }
+    }
+    return;
+
+    broken:
+    /* Count them all as misses */
+    for (i = 0; i < count; ++i) {
+        out[i].geom = -1U;
+        out[i].dist = rays[i].max_dist;
+    }
+}
+
+/*
+    The same as 'query_rays', but each run of QUERY_PACKET_RAYS rays is
+    walked down the tree together. This is faster when the rays in each run
+    start close together and point the same way, like the rays through a
+    small block of pixels.
+*/
+void query_ray_packets(const struct map* map, const struct query_ray* rays, unsigned long count, struct query_ray_hit* out) {
+    unsigned long i;
+    for (i = 0; i < count; i += QUERY_PACKET_RAYS) {
+        unsigned batch = (count - i < QUERY_PACKET_RAYS) ? count - i : QUERY_PACKET_RAYS;
+        ray_packet(map, &rays[i], batch, &out[i]);
+    }
+}
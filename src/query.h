@@ -0,0 +1,56 @@
+#ifndef OCTEST_QUERY_H
+#define OCTEST_QUERY_H
+
+#include "util.h"
+#include "map.h"
+
+/*
+    Finds what is at points, in boxes and along rays in a map. Queries are
+    done in batches and write into buffers from the caller, so nothing is
+    allocated. For points and boxes, a 'geom' node takes up its whole cube,
+    whatever its shape is. Rays are tested against the shape itself.
+*/
+
+/* Nodes deeper than this are treated as a broken map */
+#define QUERY_MAX_DEPTH 48
+/* How many rays 'query_ray_packets' walks down the tree together */
+#define QUERY_PACKET_RAYS 16
+
+struct query_point_hit {
+    unsigned vis;     /* Indexes 'map.vis' (-1 if the map is broken), points outside the map get the closest one */
+    unsigned geom;    /* Indexes 'map.nodes' at the 'geom' node the point is in (-1 if there is none) */
+    struct vec3 pos;  /* Center of the smallest node the point was found to be in */
+    float size;
+};
+struct query_box {
+    struct vec3 min;
+    struct vec3 max;
+};
+struct query_node {
+    unsigned node;    /* Indexes 'map.nodes' */
+    struct vec3 pos;  /* Center of the node (the same node can be in many places if subtrees are shared) */
+    float size;
+};
+
+struct query_ray {
+    struct vec3 origin;
+    struct vec3 dir;    /* Does not have to be normalized, distances are in lengths of it */
+    float max_dist;
+};
+struct query_ray_hit {
+    unsigned geom;      /* Indexes 'map.nodes' at the 'geom' node hit (-1 if nothing was hit) */
+    unsigned face;      /* The 'enum map_face' of the face of the shape that was hit */
+    float dist;         /* The hit is at 'origin' + 'dir' * 'dist' */
+    struct vec3 pos;    /* Center of the node hit */
+    float size;
+};
+
+void query_points(const struct map* map, const struct vec3* points, unsigned long count, struct query_point_hit* out);
+unsigned long query_boxes(
+    const struct map* map, const struct query_box* boxes, unsigned long count,
+    struct query_node* nodes, unsigned long max_nodes, unsigned long* ends
+);
+void query_rays(const struct map* map, const struct query_ray* rays, unsigned long count, struct query_ray_hit* out);
+void query_ray_packets(const struct map* map, const struct query_ray* rays, unsigned long count, struct query_ray_hit* out);
+
+#endif
@@ -0,0 +1,267 @@
+#include "reload.h"
+#include "mapfile.h"
+#include "compiler.h"
+#include "vlb.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define RELOAD_SETTLE_MS 100 /* How long the map file has to stay unchanged before it is reloaded */
+
+struct reload_maps VLB(struct map);
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int wake_pipe[2] = {-1, -1};
+static int watch_fd = -1;
+static const char* src_path;
+static const char* bin_path;
+static const char* src_name; /* The part of 'src_path' after the directory */
+static struct compile_cache* cache; /* Only used on the thread, so maps after the first only recompile what changed */
+
+/* Guarded by 'lock' */
+static struct map ready_map;
+static struct reload_maps old_maps;
+static struct {
+    unsigned requested : 1;
+    unsigned busy      : 1;
+    unsigned ready     : 1; /* 'ready_map' is valid */
+    unsigned failed    : 1;
+    unsigned quit      : 1;
+} state;
+
+static void reload_wake(void) {
+    char c = 0;
+    while (write(wake_pipe[1], &c, 1) < 0 && errno == EINTR);
+}
+
+/* Returns 1 if the map file was among the files that changed */
+static unsigned reload_read_events(void) {
+    union {
+        struct inotify_event event;
+        char data[4096];
+    } buf;
+    unsigned changed = 0;
+    long len;
+    while ((len = read(watch_fd, buf.data, sizeof(buf.data))) > 0) {
+        long i = 0;
+        while (i < len) {
+            const struct inotify_event* event = (const struct inotify_event*)(buf.data + i);
+            if (event->len && !strcmp(event->name, src_name)) changed = 1;
+            i += sizeof(*event) + event->len;
+        }
+    }
+    return changed;
+}
+
+static void reload_free_old_maps(void) {
+    struct reload_maps maps;
+    unsigned long i;
+    pthread_mutex_lock(&lock);
+    maps = old_maps;
+    VLB_ZINIT(old_maps);
+    pthread_mutex_unlock(&lock);
+    for (i = 0; i < maps.len; ++i) {
+        free_map(&maps.data[i]);
+    }
+    VLB_FREE(maps);
+}
+
+static void reload_load(void) {
+    struct map map;
+    struct map replaced;
+    unsigned ok, have_replaced = 0;
+
+    ok = load_map(src_path, bin_path, cache, &map);
+    if (!ok) fputs("Failed to reload map\n", stderr);
+
+    pthread_mutex_lock(&lock);
+    state.busy = 0;
+    state.failed = !ok;
+    if (ok) {
+        /* Replace a map that was never taken */
+        if (state.ready) {
+            replaced = ready_map;
+            have_replaced = 1;
+        }
+        ready_map = map;
+        state.ready = 1;
+    }
+    pthread_mutex_unlock(&lock);
+    if (have_replaced) free_map(&replaced);
+}
+
+static void* reload_main(void* arg) {
+    int timeout = -1;
+    (void)arg;
+    while (1) {
+        struct pollfd fds[2];
+        unsigned fd_count = 1;
+        unsigned load;
+        int ret;
+
+        fds[0].fd = wake_pipe[0];
+        fds[0].events = POLLIN;
+        if (watch_fd >= 0) {
+            fds[1].fd = watch_fd;
+            fds[1].events = POLLIN;
+            ++fd_count;
+        }
+        ret = poll(fds, fd_count, timeout);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Map reload thread failed: %s\n", strerror(errno));
+            break;
+        }
+        if (!ret) {
+            /* The map file stopped changing */
+            timeout = -1;
+            reload_start();
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            char buf[64];
+            while (read(wake_pipe[0], buf, sizeof(buf)) > 0);
+        }
+        /* Editors can write a file in several steps, so wait for it to settle */
+        if (fd_count > 1 && (fds[1].revents & POLLIN) && reload_read_events()) timeout = RELOAD_SETTLE_MS;
+
+        reload_free_old_maps();
+
+        pthread_mutex_lock(&lock);
+        if (state.quit) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        load = state.requested;
+        if (load) {
+            state.requested = 0;
+            state.busy = 1;
+        }
+        pthread_mutex_unlock(&lock);
+        if (load) reload_load();
+    }
+    return NULL;
+}
+
+unsigned reload_init(const char* src, const char* bin, unsigned watch) {
+    const char* slash;
+
+    src_path = src;
+    bin_path = bin;
+    slash = strrchr(src, '/');
+    src_name = (slash) ? slash + 1 : src;
+    VLB_ZINIT(old_maps);
+    memset(&state, 0, sizeof(state));
+
+    if (pipe(wake_pipe)) {
+        fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+        return 0;
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+
+    /* Watch the directory as editors often replace the file instead of writing to it */
+    if (watch) {
+        char* dir = malloc(strlen(src) + 2);
+        if (!dir) {
+            fputs("Memory error\n", stderr);
+        } else {
+            if (slash) {
+                memcpy(dir, src, slash - src + 1);
+                dir[slash - src + 1] = '\0';
+            } else {
+                strcpy(dir, ".");
+            }
+            watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (watch_fd < 0 || inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+                fprintf(stderr, "Failed to watch '%s': %s\n", dir, strerror(errno));
+                if (watch_fd >= 0) close(watch_fd);
+                watch_fd = -1;
+            }
+            free(dir);
+        }
+    }
+
+    cache = new_compile_cache(); /* Not fatal if this fails as it only makes reloading faster */
+    if (pthread_create(&thread, NULL, reload_main, NULL)) {
+        fputs("Failed to start map reload thread\n", stderr);
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+        if (watch_fd >= 0) close(watch_fd);
+        watch_fd = -1;
+        if (cache) free_compile_cache(cache);
+        cache = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+void reload_quit(void) {
+    pthread_mutex_lock(&lock);
+    state.quit = 1;
+    pthread_mutex_unlock(&lock);
+    reload_wake();
+    pthread_join(thread, NULL);
+
+    reload_free_old_maps();
+    if (state.ready) free_map(&ready_map);
+    state.ready = 0;
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    if (watch_fd >= 0) close(watch_fd);
+    watch_fd = -1;
+    if (cache) free_compile_cache(cache);
+    cache = NULL;
+}
+
+void reload_start(void) {
+    pthread_mutex_lock(&lock);
+    state.requested = 1;
+    pthread_mutex_unlock(&lock);
+    reload_wake();
+}
+
+enum reload_status reload_get_status(void) {
+    enum reload_status status;
+    pthread_mutex_lock(&lock);
+    if (state.busy || state.requested) status = RELOAD_BUSY;
+    else if (state.ready) status = RELOAD_READY;
+    else if (state.failed) status = RELOAD_FAILED;
+    else status = RELOAD_IDLE;
+    pthread_mutex_unlock(&lock);
+    return status;
+}
+
+/* Returns 1 and moves the map to 'out' if a reloaded map is ready */
+unsigned reload_take_map(struct map* out) {
+    unsigned ready;
+    pthread_mutex_lock(&lock);
+    ready = state.ready;
+    if (ready) {
+        *out = ready_map;
+        state.ready = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return ready;
+}
+
+void reload_free_map(const struct map* map) {
+    unsigned queued = 1;
+    pthread_mutex_lock(&lock);
+    VLB_ADD(old_maps, *map, 2, 1, queued = 0;);
+    pthread_mutex_unlock(&lock);
+    if (!queued) {
+        /* Out of memory, so just free it here */
+        struct map tmp = *map;
+        free_map(&tmp);
+        return;
+    }
+    reload_wake();
+}
@@ -0,0 +1,27 @@
+#ifndef OCTEST_RELOAD_H
+#define OCTEST_RELOAD_H
+
+#include "map.h"
+
+/*
+    Loads maps on a background thread so the main loop never waits on the
+    compiler. The main loop picks up finished maps with 'reload_take_map'
+    between frames, and gives the old one to 'reload_free_map' so it is
+    freed on the background thread as well.
+*/
+
+enum reload_status {
+    RELOAD_IDLE,
+    RELOAD_BUSY,    /* A map is being loaded */
+    RELOAD_READY,   /* A map is waiting to be taken */
+    RELOAD_FAILED   /* The last load failed (until the next one starts) */
+};
+
+unsigned reload_init(const char* src_path, const char* bin_path, unsigned watch);
+void reload_quit(void);
+void reload_start(void);
+enum reload_status reload_get_status(void);
+unsigned reload_take_map(struct map* out);
+void reload_free_map(const struct map* map);
+
+#endif
@@ -1,12 +1,23 @@
-#define GL_GLEXT_PROTOTYPES
-#include <GL/gl.h>
-#include <GL/glext.h>
-
 #include "renderer.h"
-#include "crc.h"
+#include "glrender.h"
+#include "query.h"
+#include "workers.h"
 
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Largest grid 'mesh_faces' will merge faces on */
+#define RENDER_MAX_MESH_GRID (1024UL * 1024UL)
+/* Size of the depth buffer used for occlusion culling, and of the tiles it is split into */
+#define RENDER_OCCLUSION_WIDTH 128
+#define RENDER_OCCLUSION_HEIGHT 64
+#define RENDER_OCCLUSION_TILE 8
+/* Frustum culling is split into a job for each node this many levels down the tree */
+#define RENDER_CULL_SPLIT_DEPTH 2
+/* Cells each job of 'draw_list_job' makes draw commands for */
+#define RENDER_DRAW_BATCH 64
 
 static enum render_mode mode = RENDER_MODE_NORMAL;
 static float projmat[4][4] = {
@@ -22,64 +33,165 @@ static float viewmat[4][4] = {
     {0.0f, 0.0f, 0.0f, 1.0f}
 };
 static const struct map* map;
+static const struct render_backend* backend = &gl_render_backend;
+/* Vertices of the geometry in each 'vis' node, built by 'set_map' */
+static struct VLB(struct render_vertex) vertices;
+static struct render_cell {
+    unsigned long first;  /* Indexes 'vertices' */
+    unsigned long count;
+    unsigned frame;       /* The last frame the 'vis' node was found to be in the frustum in */
+    unsigned long geoms;  /* 'geom' nodes in the 'vis' node */
+    float min[3];         /* Box around the vertices */
+    float max[3];
+}* cells;                 /* One for each of 'map.vis' */
+/* A face covering a whole side of a 'geom' node, kept while building so it can be merged */
+struct render_face {
+    unsigned char face;   /* An 'enum map_face' */
+    unsigned char color[3];
+    float plane;          /* Position on the face's axis */
+    float min[2];         /* On the two axes after the face's axis (Y and Z for X, Z and X for Y, X and Y for Z) */
+    float max[2];
+};
+static struct VLB(struct render_face) faces;
+static struct VLB(unsigned char) grid; /* Scratch space for 'mesh_faces' */
+static unsigned long geom_count;       /* 'geom' nodes built so far */
+/* A run of quads in 'vertices' to draw, made of one or more cells that were built one after the other */
+struct render_cmd {
+    unsigned vis;         /* The first cell in the run */
+    unsigned cells;
+    unsigned long first;  /* Indexes 'vertices' */
+    unsigned long count;
+    unsigned long geoms;
+};
+/*
+    The draw commands of a frame. Each batch of RENDER_DRAW_BATCH cells in
+    the order they are drawn in gets that many commands, and 'cmd_counts'
+    holds how many each one used, so the batches can be made by different
+    threads and still be drawn in order.
+*/
+static struct render_cmd* cmds;
+static unsigned* cmd_counts;
+/* A subtree for 'cull_job' to frustum cull */
+struct render_cull_job {
+    unsigned node;
+    struct vec3 pos;
+    float size;
+    unsigned planes;
+};
+static struct VLB(struct render_cull_job) cull_jobs;
+/* What each thread counted for the stats */
+static struct render_worker {
+    unsigned long parent_nodes;
+    unsigned long vis_nodes;
+    unsigned frustum_culled;
+}* workers;
+static unsigned worker_space;
+static unsigned threads;               /* 0 until the first frame works out how many CPUs there are */
 static struct {
-    struct map_node* ptr;
+    const struct map_vis* ptr;
     struct vec3 min;      /* Smallest coord */
     struct vec3 max;      /* Largest coord */
 } cur_vis_node;
+/* A point is inside the frustum if a * x + b * y + c * z + d >= 0 for each plane (a, b, c, d) */
+static float frustum[6][4];
+static float viewprojmat[4][4]; /* 'projmat' * 'viewmat' */
+static unsigned frame;
+static unsigned occlusion_culling = 0;
+static float occlusion_near;    /* Anything closer than this gets clipped */
+static struct {
+    float depth[RENDER_OCCLUSION_HEIGHT][RENDER_OCCLUSION_WIDTH];
+    float tiles[RENDER_OCCLUSION_HEIGHT / RENDER_OCCLUSION_TILE][RENDER_OCCLUSION_WIDTH / RENDER_OCCLUSION_TILE];
+} occlusion;                    /* See 'occlusion_test_cell' */
+#ifndef OCTEST_NO_RENDER_STATS
+static struct render_stats stats_frames[RENDER_STATS_FRAMES];
+static struct render_stats* stats = stats_frames; /* The frame being drawn */
+static unsigned long stats_frame;                 /* Frames drawn so far */
+static unsigned long stats_time;                  /* When the last part of the frame ended */
+    #define STATS(x) do {x;} while (0)
+    /* Put the time since the last part of the frame ended in 'field' */
+    #define STATS_TIME(field) do {\
+        unsigned long STATS__now = gettime_us();\
+        stats->field = STATS__now - stats_time;\
+        stats_time = STATS__now;\
+    } while (0)
+#else
+    #define STATS(x) do {} while (0)
+    #define STATS_TIME(field) do {} while (0)
+#endif
 
 static void calc_view_mat(struct vec3* pos, struct vec3* rot, float mat[4][4]);
 
-/* Find the vis node the camera is currently in */
-static struct map_node* find_vis_node(const struct map* map, struct vec3* pos) {
-    /* Start at the root node */
-    struct map_node* node = &map->nodes[0];
-    while (1) {
-        /* If the node is a 'parent' node */
-        if (node->type == MAP_NODE_PARENT) {
-            /*
-                Follow the child closest the camera.
-                The children will never contain a -1 'none', so no '== -1' check
-                is needed.
-                Even if the space is empty, it must have a 'vis' node. That
-                'vis' node's child will just be -1 'none' instead.
-            */
-            node = &map->nodes[node->data.parent.children[
-                (pos->x < node->pos.x) |
-                ((pos->y < node->pos.y) << 2) |
-                ((pos->z < node->pos.z) << 1)
-            ]];
-        /* If the node is a 'vis' node */
-        } else if (node->type == MAP_NODE_VIS) {
-            /* Found it, return the pointer */
-            return node;
-        /* If something unexpected shows up (probably a 'geom' node) */
-        } else {
-            /*
-                Raise an error (this means a bug in the map compiler).
-                There should never be any 'geom' nodes without a 'vis' node
-                wraping it.
-            */
-            fputs("Expected node type of PARENT or VIS\n", stderr);
+/* Points of each face in the order they are drawn in (see 'enum map_face'), and how bright each face is */
+static const unsigned char face_points[6][4] = {
+    {0, 2, 6, 4},
+    {1, 5, 7, 3},
+    {0, 1, 3, 2},
+    {4, 6, 7, 5},
+    {0, 4, 5, 1},
+    {2, 3, 7, 6}
+};
+static const float face_shades[6] = {0.8f, 0.7f, 1.0f, 0.5f, 0.9f, 0.6f};
+/* Index bit of the negative side of each axis (see 'struct map_node_geom_shape') */
+static const unsigned axis_bits[3] = {1, 4, 2};
+
+static void add_vertex(struct render_vertex* vert, const float* pos, const unsigned char* color) {
+    vert->pos[0] = pos[0];
+    vert->pos[1] = pos[1];
+    vert->pos[2] = pos[2];
+    vert->color[0] = color[0];
+    vert->color[1] = color[1];
+    vert->color[2] = color[2];
+    vert->color[3] = 255;
+}
+
+/* Add a face that covers a whole side of its node to 'faces' so 'merge_faces' can join it up with others */
+static unsigned add_face(unsigned face, const float* node_pos, float offset, const unsigned char* color) {
+    unsigned axis = face >> 1;
+    struct render_face* out;
+    unsigned i;
+    VLB_EXPANDBY(faces, 1, 2, 1, fputs("Memory error\n", stderr); return 0;);
+    out = &faces.data[faces.len - 1];
+    out->face = face;
+    out->color[0] = color[0];
+    out->color[1] = color[1];
+    out->color[2] = color[2];
+    out->plane = node_pos[axis] + ((face & 1) ? -offset : offset);
+    for (i = 0; i < 2; ++i) {
+        out->min[i] = node_pos[(axis + 1 + i) % 3] - offset;
+        out->max[i] = node_pos[(axis + 1 + i) % 3] + offset;
+    }
+    return 1;
+}
+
+/* Add the quad of a face from 'faces' to the vertex array */
+static unsigned build_face(const struct render_face* face) {
+    unsigned axis = face->face >> 1;
+    struct render_vertex* vert;
+    unsigned i;
+    VLB_EXPANDBY(vertices, 4, 2, 1, fputs("Memory error\n", stderr); return 0;);
+    vert = &vertices.data[vertices.len - 4];
+    for (i = 0; i < 4; ++i) {
+        unsigned point = face_points[face->face][i];
+        float pos[3];
+        unsigned j;
+        pos[axis] = face->plane;
+        for (j = 0; j < 2; ++j) {
+            unsigned other = (axis + 1 + j) % 3;
+            pos[other] = (point & axis_bits[other]) ? face->min[j] : face->max[j];
         }
+        add_vertex(&vert[i], pos, face->color);
     }
+    return 1;
 }
 
-/* For px, py, and pz, + means "X/Y/Z is positive", - means "X/Y/Z is negative" */
-#define RENDER_NODE_VERT(sx, sy, sz) do {\
-    unsigned index = (sx 1 < 0) | ((sy 1 < 0) << 2) | ((sz 1 < 0) << 1);\
-    glVertex3f(\
-        node->pos.x + shape->points[index].x * offset,\
-        node->pos.y + shape->points[index].y * offset,\
-        node->pos.z + shape->points[index].z * offset\
-    );\
-} while (0)
-#define RENDER_NODE_COLOR(mul) glColor3f(color[0] * mul, color[1] * mul, color[2] * mul)
-static unsigned render_node(const struct map* map, struct map_node* node, struct vec3* pos) {
+/* Add the faces of every 'geom' node under a node */
+static unsigned build_node(const struct map* map, unsigned node_index, const struct vec3* node_pos, float node_size, const struct map_color* cell_color) {
+    const struct map_node* node = &map->nodes[node_index];
     /* If the node is a 'parent' node */
     if (node->type == MAP_NODE_PARENT) {
         /*
-            Make a bitmask to change the order that children are rendered in.
+            The order is fixed once the arrays are built, so the children are
+            just added in index order.
             The children are arranged in a specific order where:
                 .-----------------------------------------------.
                 | Index bit | Meaining                          |
@@ -93,87 +205,71 @@ static unsigned render_node(const struct map* map, struct map_node* node, struct
                 | 2         | If 0, child is up (+Y),           |
                 |           | if 1, child is down (-Y)          |
                 '-----------------------------------------------'
-            The goal is to draw the children that are closer to the camera before the ones farther away.
-            The bitmask inverts certain bits of the index based on where the camera is in relation to the node.
-            For example, if the camera is behind the node, the -Z children should be traversed first.
         */
-        unsigned xor_mask = (pos->x < node->pos.x) | ((pos->y < node->pos.y) << 2) | ((pos->z < node->pos.z) << 1);
+        unsigned children[8];
         unsigned i;
+        MAP_NODE_GET_CHILDREN(node, children);
         for (i = 0; i < 8; ++i) {
-            unsigned child = node->data.parent.children[i ^ xor_mask];
-            if (child == -1U) continue; /* Skip if child is set to 'none' */
-            if (!render_node(map, &map->nodes[child], pos)) return 0; /* Recursively traverse */
+            struct vec3 child_pos;
+            if (children[i] == -1U) continue; /* Skip if there is no child there */
+            MAP_NODE_CHILD_POS(*node_pos, node_size, i, child_pos);
+            if (!build_node(map, children[i], &child_pos, node_size * 0.5f, cell_color)) return 0; /* Recursively traverse */
         }
     /* If it is a 'geom' node */
     } else if (node->type == MAP_NODE_GEOM) {
         /* Get a pointer to the shape */
-        struct map_node_geom_shape* shape = &map->geom_shapes[node->data.geom.shape];
-        float offset = node->size * 0.5f; /* Pre-calculate the offset from the center each face will be */
-
-        unsigned index;
-        unsigned hash;
-        static const float mul = 1.0f / 255.0f;
-        float color[3];
-        switch (mode) {
-            case RENDER_MODE_NORMAL:
-                /* Generate a color off of the index */
-                index = (node - map->nodes);
-                hash = crc32(&index, sizeof(index));
-                color[0] = (((hash >> 16) & 255) | 64) * mul;
-                color[1] = (((hash >> 8) & 255) | 64) * mul;
-                color[2] = ((hash & 255) | 64) * mul;
-                break;
-            case RENDER_MODE_OVERDRAW:
-            case RENDER_MODE_OVERDRAW_NO_DEPTH:
-                glColor4f(1.0f, 0.0f, 0.0f, 0.05f);
-                break;
-        }
+        const struct map_node_geom_shape* shape = &map->geom_shapes[node->index];
+        const struct map_color* base_color = (node->color != MAP_COLOR_NONE) ? &map->palette[node->color] : cell_color;
+        float offset = node_size * 0.5f; /* Pre-calculate the offset from the center each face will be */
+        float pos[3];
+        unsigned face;
+
+        ++geom_count;
+        pos[0] = node_pos->x;
+        pos[1] = node_pos->y;
+        pos[2] = node_pos->z;
+        for (face = 0; face < 6; ++face) {
+            unsigned char color[3];
+            unsigned full = 1;
+            unsigned i;
+            if (!(node->face_mask & (1 << face))) continue; /* Skip faces the compiler found can't be seen */
+
+            color[0] = base_color->r * face_shades[face];
+            color[1] = base_color->g * face_shades[face];
+            color[2] = base_color->b * face_shades[face];
 
-        glBegin(GL_QUADS);
-            /* Right face */
-            if (mode == RENDER_MODE_NORMAL) RENDER_NODE_COLOR(0.8f);
-            RENDER_NODE_VERT(+, +, +); /* Send the (+X, +Y, +Z) vertex */
-            RENDER_NODE_VERT(+, +, -); /* Send the (+X, +Y, -Z) vertex */
-            RENDER_NODE_VERT(+, -, -); /* Send the (+X, -Y, -Z) vertex */
-            RENDER_NODE_VERT(+, -, +); /* Send the (+X, -Y, +Z) vertex */
-            /* Left face */
-            if (mode == RENDER_MODE_NORMAL) RENDER_NODE_COLOR(0.7f);
-            RENDER_NODE_VERT(-, +, +);
-            RENDER_NODE_VERT(-, -, +);
-            RENDER_NODE_VERT(-, -, -);
-            RENDER_NODE_VERT(-, +, -);
-            /* Top face */
-            if (mode == RENDER_MODE_NORMAL) RENDER_NODE_COLOR(1.0f);
-            RENDER_NODE_VERT(+, +, +);
-            RENDER_NODE_VERT(-, +, +);
-            RENDER_NODE_VERT(-, +, -);
-            RENDER_NODE_VERT(+, +, -);
-            /* Bottom face */
-            if (mode == RENDER_MODE_NORMAL) RENDER_NODE_COLOR(0.5f);
-            RENDER_NODE_VERT(+, -, +);
-            RENDER_NODE_VERT(+, -, -);
-            RENDER_NODE_VERT(-, -, -);
-            RENDER_NODE_VERT(-, -, +);
-            /* Front face */
-            if (mode == RENDER_MODE_NORMAL) RENDER_NODE_COLOR(0.9f);
-            RENDER_NODE_VERT(+, +, +);
-            RENDER_NODE_VERT(+, -, +);
-            RENDER_NODE_VERT(-, -, +);
-            RENDER_NODE_VERT(-, +, +);
-            /* Back face */
-            if (mode == RENDER_MODE_NORMAL) RENDER_NODE_COLOR(0.6f);
-            RENDER_NODE_VERT(+, +, -);
-            RENDER_NODE_VERT(-, +, -);
-            RENDER_NODE_VERT(-, -, -);
-            RENDER_NODE_VERT(+, -, -);
-        glEnd();
+            /* Check if each point is at its corner of the node */
+            for (i = 0; i < 4; ++i) {
+                unsigned point = face_points[face][i];
+                if (
+                    shape->points[point].x != ((point & 1) ? -1.0f : 1.0f) ||
+                    shape->points[point].y != ((point & 4) ? -1.0f : 1.0f) ||
+                    shape->points[point].z != ((point & 2) ? -1.0f : 1.0f)
+                ) full = 0;
+            }
+            if (full) {
+                if (!add_face(face, pos, offset, color)) return 0;
+            /* Faces of other shapes are added as they are */
+            } else {
+                struct render_vertex* vert;
+                VLB_EXPANDBY(vertices, 4, 2, 1, fputs("Memory error\n", stderr); return 0;);
+                vert = &vertices.data[vertices.len - 4];
+                for (i = 0; i < 4; ++i) {
+                    const struct vec3* point = &shape->points[face_points[face][i]];
+                    float point_pos[3];
+                    point_pos[0] = pos[0] + point->x * offset;
+                    point_pos[1] = pos[1] + point->y * offset;
+                    point_pos[2] = pos[2] + point->z * offset;
+                    add_vertex(&vert[i], point_pos, color);
+                }
+            }
+        }
     /* If something unexpected shows up (probably a 'vis' node) */
     } else {
         /*
             Raise an error (this means a bug in the map compiler).
-            The node used to render from is a 'vis' node, and its child is
-            passed in to this function to start traversing and rendering.
-            'vis' nodes should not be nested, so there should be no other 'vis'
+            The node used to build from is a 'vis' node's child, and 'vis'
+            nodes should not be nested, so there should be no other 'vis'
             nodes further down the tree.
         */
         fputs("Expected node type of PARENT or GEOM\n", stderr);
@@ -182,14 +278,537 @@ static unsigned render_node(const struct map* map, struct map_node* node, struct
     return 1;
 }
 
+/* Order faces so that the ones on the same plane with the same color are next to each other */
+static int sort_faces(const void* a_ptr, const void* b_ptr) {
+    const struct render_face* a = a_ptr;
+    const struct render_face* b = b_ptr;
+    if (a->face != b->face) return (a->face < b->face) ? -1 : 1;
+    if (a->plane != b->plane) return (a->plane < b->plane) ? -1 : 1;
+    return memcmp(a->color, b->color, sizeof(a->color));
+}
+static unsigned same_face_group(const struct render_face* a, const struct render_face* b) {
+    return a->face == b->face && a->plane == b->plane && !memcmp(a->color, b->color, sizeof(a->color));
+}
+
+/*
+    Merge a group of faces on the same plane with the same color into as few
+    rectangles as it can, and add them to the vertex array.
+    The faces are drawn onto a grid the size of the smallest one, and then
+    each rectangle is grown as far as it can go along the first axis of the
+    face, and then as far as the whole row can go along the second.
+*/
+static unsigned mesh_faces(const struct render_face* list, unsigned long count) {
+    struct render_face rect = list[0];
+    float min[2], max[2];
+    float unit = list[0].max[0] - list[0].min[0];
+    unsigned long w, h, x, y, i;
+
+    min[0] = list[0].min[0];
+    min[1] = list[0].min[1];
+    max[0] = list[0].max[0];
+    max[1] = list[0].max[1];
+    for (i = 1; i < count; ++i) {
+        if (list[i].min[0] < min[0]) min[0] = list[i].min[0];
+        if (list[i].min[1] < min[1]) min[1] = list[i].min[1];
+        if (list[i].max[0] > max[0]) max[0] = list[i].max[0];
+        if (list[i].max[1] > max[1]) max[1] = list[i].max[1];
+        if (list[i].max[0] - list[i].min[0] < unit) unit = list[i].max[0] - list[i].min[0];
+    }
+    w = (max[0] - min[0]) / unit + 0.5f;
+    h = (max[1] - min[1]) / unit + 0.5f;
+
+    /* Don't bother if there is nothing to merge or the grid would be too big, just add the faces as they are */
+    if (count == 1 || w * h > RENDER_MAX_MESH_GRID) {
+        for (i = 0; i < count; ++i) {
+            if (!build_face(&list[i])) return 0;
+        }
+        return 1;
+    }
+
+    grid.len = 0;
+    VLB_EXPANDTO(grid, w * h, 2, 1, fputs("Memory error\n", stderr); return 0;);
+    memset(grid.data, 0, w * h);
+    for (i = 0; i < count; ++i) {
+        unsigned long x0 = (list[i].min[0] - min[0]) / unit + 0.5f;
+        unsigned long x1 = (list[i].max[0] - min[0]) / unit + 0.5f;
+        unsigned long y0 = (list[i].min[1] - min[1]) / unit + 0.5f;
+        unsigned long y1 = (list[i].max[1] - min[1]) / unit + 0.5f;
+        for (y = y0; y < y1; ++y) {
+            memset(&grid.data[y * w + x0], 1, x1 - x0);
+        }
+    }
+
+    for (y = 0; y < h; ++y) {
+        for (x = 0; x < w; ++x) {
+            unsigned long end_x = x + 1;
+            unsigned long end_y = y + 1;
+            if (!grid.data[y * w + x]) continue;
+            while (end_x < w && grid.data[y * w + end_x]) ++end_x;
+            while (end_y < h) {
+                for (i = x; i < end_x; ++i) {
+                    if (!grid.data[end_y * w + i]) break;
+                }
+                if (i < end_x) break;
+                ++end_y;
+            }
+            for (i = y; i < end_y; ++i) {
+                memset(&grid.data[i * w + x], 0, end_x - x);
+            }
+            rect.min[0] = min[0] + x * unit;
+            rect.max[0] = min[0] + end_x * unit;
+            rect.min[1] = min[1] + y * unit;
+            rect.max[1] = min[1] + end_y * unit;
+            if (!build_face(&rect)) return 0;
+            x = end_x - 1;
+        }
+    }
+    return 1;
+}
+
+/*
+    Build the vertex array of the geometry in each 'vis' node.
+    Faces that cover a whole side of their node are greedily merged with the
+    others on the same plane in the same 'vis' node (see 'mesh_faces').
+*/
+static unsigned build_cells(const struct map* map) {
+    unsigned retval = 0;
+    unsigned i;
+    cells = malloc((map->vis_count + 1) * sizeof(*cells));
+    if (!cells) {
+        fputs("Memory error\n", stderr);
+        return 0;
+    }
+    VLB_ZINIT(faces);
+    VLB_ZINIT(grid);
+    geom_count = 0;
+    for (i = 0; i < map->vis_count; ++i) {
+        const struct map_vis* vis_node = &map->vis[i];
+        unsigned long first, j;
+
+        cells[i].first = vertices.len;
+        cells[i].frame = 0;
+        cells[i].geoms = geom_count;
+        faces.len = 0;
+        if (vis_node->child != -1U && !build_node(map, vis_node->child, &vis_node->pos, vis_node->size, &map->palette[vis_node->color])) goto ret;
+        /* Empty cells never allocate 'faces', and qsort can't be given NULL */
+        if (faces.len > 1) qsort(faces.data, faces.len, sizeof(*faces.data), sort_faces);
+        for (first = 0; first < faces.len; first = j) {
+            for (j = first + 1; j < faces.len && same_face_group(&faces.data[first], &faces.data[j]); ++j);
+            if (!mesh_faces(&faces.data[first], j - first)) goto ret;
+        }
+        cells[i].count = vertices.len - cells[i].first;
+        cells[i].geoms = geom_count - cells[i].geoms;
+        for (j = 0; j < 3; ++j) {
+            cells[i].min[j] = (cells[i].count) ? vertices.data[cells[i].first].pos[j] : 0.0f;
+            cells[i].max[j] = cells[i].min[j];
+        }
+        for (j = cells[i].first; j < vertices.len; ++j) {
+            unsigned k;
+            for (k = 0; k < 3; ++k) {
+                if (vertices.data[j].pos[k] < cells[i].min[k]) cells[i].min[k] = vertices.data[j].pos[k];
+                if (vertices.data[j].pos[k] > cells[i].max[k]) cells[i].max[k] = vertices.data[j].pos[k];
+            }
+        }
+    }
+    VLB_SHRINK(vertices, VLB_OOM_NOP);
+    retval = 1;
+
+    ret:
+    VLB_FREE(faces);
+    VLB_FREE(grid);
+    return retval;
+}
+
+static void draw_cmd(const struct render_cmd* cmd) {
+    backend->draw_quads(cmd->first, cmd->count);
+    STATS(
+        stats->cells_drawn += cmd->cells;
+        stats->geom_nodes += cmd->geoms;
+        stats->quads += cmd->count / 4;
+        stats->vertices += cmd->count
+    );
+}
+
+/* Work out 'viewprojmat' and the planes of the view frustum */
+static void calc_frustum(void) {
+    unsigned i, j, k;
+    for (i = 0; i < 4; ++i) {
+        for (j = 0; j < 4; ++j) {
+            viewprojmat[i][j] = 0.0f;
+            for (k = 0; k < 4; ++k) viewprojmat[i][j] += projmat[k][j] * viewmat[i][k];
+        }
+    }
+    /* Each plane is the last row plus or minus the row for its axis */
+    for (i = 0; i < 6; ++i) {
+        float sign = (i & 1) ? -1.0f : 1.0f;
+        for (j = 0; j < 4; ++j) frustum[i][j] = viewprojmat[j][3] + sign * viewprojmat[j][i >> 1];
+    }
+}
+
+/*
+    Find the children of a 'parent' node that are at least partly in the
+    frustum, and return a mask of them.
+    Bit N of 'planes' is set if the node is not completely on the inside of
+    frustum plane N. Children are only tested against those planes, so once
+    a node is completely inside, nothing under it gets tested at all.
+*/
+static unsigned cull_children(
+    const struct map_node* node, const struct vec3* node_pos, float node_size, unsigned planes,
+    unsigned* children, struct vec3* child_pos, unsigned* child_planes
+) {
+    /* The centers of the children, split up by axis so each plane can be tested against all of them at once */
+    float x[8], y[8], z[8];
+    float radius = node_size * 0.25f;
+    unsigned outside = 0;
+    unsigned i, p;
+
+    MAP_NODE_GET_CHILDREN(node, children);
+    for (i = 0; i < 8; ++i) {
+        MAP_NODE_CHILD_POS(*node_pos, node_size, i, child_pos[i]);
+        x[i] = child_pos[i].x;
+        y[i] = child_pos[i].y;
+        z[i] = child_pos[i].z;
+        child_planes[i] = planes;
+    }
+    for (p = 0; p < 6; ++p) {
+        const float* plane = frustum[p];
+        float dist[8];
+        float extent;
+        if (!(planes & (1U << p))) continue;
+        /* How far the corner of a child furthest along the plane's normal is from the center */
+        extent = radius * ((float)fabs(plane[0]) + (float)fabs(plane[1]) + (float)fabs(plane[2]));
+        for (i = 0; i < 8; ++i) dist[i] = plane[0] * x[i] + plane[1] * y[i] + plane[2] * z[i] + plane[3];
+        for (i = 0; i < 8; ++i) {
+            if (dist[i] < -extent) outside |= 1U << i;
+            else if (dist[i] >= extent) child_planes[i] &= ~(1U << p);
+        }
+    }
+    return node->child_mask & ~outside;
+}
+
+/* Mark each 'vis' node under a node that is in the frustum as being in it this frame */
+static void cull_node(struct render_worker* worker, unsigned node_index, const struct vec3* node_pos, float node_size, unsigned planes) {
+    const struct map_node* node = &map->nodes[node_index];
+    /* If the node is a 'vis' node */
+    if (node->type == MAP_NODE_VIS) {
+        cells[node->index].frame = frame;
+        STATS(++worker->vis_nodes);
+    /* If the node is a 'parent' node */
+    } else if (node->type == MAP_NODE_PARENT) {
+        unsigned children[8];
+        unsigned child_planes[8];
+        struct vec3 child_pos[8];
+        unsigned inside;
+        unsigned i;
+
+        STATS(++worker->parent_nodes);
+        inside = cull_children(node, node_pos, node_size, planes, children, child_pos, child_planes);
+        for (i = 0; i < 8; ++i) {
+            if (inside & (1U << i)) cull_node(worker, children[i], &child_pos[i], node_size * 0.5f, child_planes[i]);
+        }
+    }
+}
+
+/*
+    Cull the top 'depth' levels of the tree, and add what is left under them
+    to 'cull_jobs' so the subtrees can be culled on different threads.
+    Returns 0 if it ran out of memory.
+*/
+static unsigned split_cull(
+    struct render_worker* worker, unsigned node_index, const struct vec3* node_pos, float node_size, unsigned planes,
+    unsigned depth
+) {
+    const struct map_node* node = &map->nodes[node_index];
+    struct render_cull_job* job;
+    if (depth && node->type == MAP_NODE_PARENT) {
+        unsigned children[8];
+        unsigned child_planes[8];
+        struct vec3 child_pos[8];
+        unsigned inside;
+        unsigned i;
+
+        STATS(++worker->parent_nodes);
+        inside = cull_children(node, node_pos, node_size, planes, children, child_pos, child_planes);
+        for (i = 0; i < 8; ++i) {
+            if (!(inside & (1U << i))) continue;
+            if (!split_cull(worker, children[i], &child_pos[i], node_size * 0.5f, child_planes[i], depth - 1)) return 0;
+        }
+        return 1;
+    }
+    VLB_EXPANDBY(cull_jobs, 1, 2, 1, fputs("Memory error\n", stderr); return 0;);
+    job = &cull_jobs.data[cull_jobs.len - 1];
+    job->node = node_index;
+    job->pos = *node_pos;
+    job->size = node_size;
+    job->planes = planes;
+    return 1;
+}
+
+static unsigned cull_job(void* data, unsigned worker, unsigned long job) {
+    const struct render_cull_job* in = &cull_jobs.data[job];
+    /* Counted on the stack so threads don't keep writing next to each other */
+    struct render_worker counts;
+    (void)data;
+    (void)worker; /* Only used for the stats */
+    counts.parent_nodes = 0;
+    counts.vis_nodes = 0;
+    cull_node(&counts, in->node, &in->pos, in->size, in->planes);
+    STATS(workers[worker].parent_nodes += counts.parent_nodes);
+    STATS(workers[worker].vis_nodes += counts.vis_nodes);
+    return 1;
+}
+
+/*
+    Make the draw commands for a batch of cells. The cells are the current
+    'vis' node and then each of its siblings from near to far, and 'data'
+    is its sibling list. Cells that were built one after the other are drawn
+    with one command, unless each one has to be occlusion tested.
+*/
+static unsigned draw_list_job(void* data, unsigned worker, unsigned long job) {
+    const unsigned* siblings = data;
+    struct render_cmd* out = &cmds[job * RENDER_DRAW_BATCH];
+    unsigned long start = job * RENDER_DRAW_BATCH;
+    unsigned long end = start + RENDER_DRAW_BATCH;
+    unsigned count = 0;
+    unsigned culled = 0;
+    unsigned long i;
+    (void)worker; /* Only used for the stats */
+
+    if (end > cur_vis_node.ptr->sibling_count + 1UL) end = cur_vis_node.ptr->sibling_count + 1UL;
+    for (i = start; i < end; ++i) {
+        unsigned vis = (i) ? siblings[i - 1] : (unsigned)(cur_vis_node.ptr - map->vis);
+        const struct render_cell* cell = &cells[vis];
+        /* The current 'vis' node is always drawn */
+        if (i && cell->frame != frame) {
+            ++culled;
+            continue;
+        }
+        if (!cell->count) continue;
+        if (count && !occlusion_culling && out[count - 1].first + out[count - 1].count == cell->first) {
+            ++out[count - 1].cells;
+            out[count - 1].count += cell->count;
+            out[count - 1].geoms += cell->geoms;
+            continue;
+        }
+        out[count].vis = vis;
+        out[count].cells = 1;
+        out[count].first = cell->first;
+        out[count].count = cell->count;
+        out[count].geoms = cell->geoms;
+        ++count;
+    }
+    cmd_counts[job] = count;
+    STATS(workers[worker].frustum_culled += culled);
+    return 1;
+}
+
+/*
+    Occlusion culling works on a small depth buffer on the CPU, in the style of
+    masked software occlusion culling. Each cell that gets drawn has its faces
+    drawn into it too, and cells are drawn from near to far, so each cell can
+    be tested against what is in front of it before it is drawn.
+    The buffer holds 1 / W (bigger is closer) of the closest face that covers
+    all of each pixel, at the furthest point of that face in the pixel, so it
+    never says something is hidden when part of it could be seen. Each tile
+    of pixels also keeps the furthest value in it so most tests only have to
+    look at the tiles.
+*/
+
+/* Put a point through 'viewprojmat' */
+static void occlusion_project(const float* pos, float* out) {
+    unsigned i;
+    for (i = 0; i < 4; ++i) {
+        out[i] = viewprojmat[0][i] * pos[0] + viewprojmat[1][i] * pos[1] + viewprojmat[2][i] * pos[2] + viewprojmat[3][i];
+    }
+}
+
+/* Turn a point from 'occlusion_project' into (x, y, 1 / W) in pixels of the depth buffer, or return 0 if it is too close to the camera */
+static unsigned occlusion_to_screen(const float* clip, float* out) {
+    float inv_w;
+    if (clip[3] < occlusion_near) return 0;
+    inv_w = 1.0f / clip[3];
+    out[0] = (clip[0] * inv_w * 0.5f + 0.5f) * RENDER_OCCLUSION_WIDTH;
+    out[1] = (clip[1] * inv_w * 0.5f + 0.5f) * RENDER_OCCLUSION_HEIGHT;
+    out[2] = inv_w;
+    return 1;
+}
+
+static void occlusion_update_tiles(unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+    unsigned tx, ty, x, y;
+    for (ty = y0 / RENDER_OCCLUSION_TILE; ty <= (y1 - 1) / RENDER_OCCLUSION_TILE; ++ty) {
+        for (tx = x0 / RENDER_OCCLUSION_TILE; tx <= (x1 - 1) / RENDER_OCCLUSION_TILE; ++tx) {
+            float tile_min = occlusion.depth[ty * RENDER_OCCLUSION_TILE][tx * RENDER_OCCLUSION_TILE];
+            for (y = ty * RENDER_OCCLUSION_TILE; y < (ty + 1) * RENDER_OCCLUSION_TILE; ++y) {
+                for (x = tx * RENDER_OCCLUSION_TILE; x < (tx + 1) * RENDER_OCCLUSION_TILE; ++x) {
+                    if (occlusion.depth[y][x] < tile_min) tile_min = occlusion.depth[y][x];
+                }
+            }
+            occlusion.tiles[ty][tx] = tile_min;
+        }
+    }
+}
+
+/* Draw a triangle into the depth buffer if it faces the camera */
+static void occlusion_draw_tri(const float* a, const float* b, const float* c) {
+    float area, plane_x, plane_y, plane_c;
+    float min_x, min_y, max_x, max_y;
+    unsigned x0, y0, x1, y1, x, y;
+
+    /* Skip it if it faces away, as it would not be drawn */
+    area = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+    if (area <= 0.0f) return;
+
+    /* 1 / W is linear across the screen, so work out the plane it is on */
+    plane_x = ((b[2] - a[2]) * (c[1] - a[1]) - (c[2] - a[2]) * (b[1] - a[1])) / area;
+    plane_y = ((c[2] - a[2]) * (b[0] - a[0]) - (b[2] - a[2]) * (c[0] - a[0])) / area;
+    plane_c = a[2] - plane_x * a[0] - plane_y * a[1];
+
+    /* Only pixels completely inside the triangle are touched */
+    min_x = a[0]; if (b[0] < min_x) min_x = b[0]; if (c[0] < min_x) min_x = c[0];
+    min_y = a[1]; if (b[1] < min_y) min_y = b[1]; if (c[1] < min_y) min_y = c[1];
+    max_x = a[0]; if (b[0] > max_x) max_x = b[0]; if (c[0] > max_x) max_x = c[0];
+    max_y = a[1]; if (b[1] > max_y) max_y = b[1]; if (c[1] > max_y) max_y = c[1];
+    if (min_x < 0.0f) min_x = 0.0f;
+    if (min_y < 0.0f) min_y = 0.0f;
+    if (max_x > RENDER_OCCLUSION_WIDTH) max_x = RENDER_OCCLUSION_WIDTH;
+    if (max_y > RENDER_OCCLUSION_HEIGHT) max_y = RENDER_OCCLUSION_HEIGHT;
+    if (min_x >= max_x || min_y >= max_y) return;
+    x0 = (unsigned)ceil(min_x);
+    y0 = (unsigned)ceil(min_y);
+    x1 = (unsigned)floor(max_x);
+    y1 = (unsigned)floor(max_y);
+    if (x0 >= x1 || y0 >= y1) return;
+
+    for (y = y0; y < y1; ++y) {
+        for (x = x0; x < x1; ++x) {
+            const float* edges[3][2];
+            float depth;
+            unsigned corner, e;
+            edges[0][0] = a; edges[0][1] = b;
+            edges[1][0] = b; edges[1][1] = c;
+            edges[2][0] = c; edges[2][1] = a;
+            for (corner = 0; corner < 4; ++corner) {
+                float px = (float)(x + (corner & 1));
+                float py = (float)(y + (corner >> 1));
+                for (e = 0; e < 3; ++e) {
+                    const float* p = edges[e][0];
+                    const float* q = edges[e][1];
+                    if ((q[0] - p[0]) * (py - p[1]) - (q[1] - p[1]) * (px - p[0]) < 0.0f) break;
+                }
+                if (e < 3) break;
+            }
+            if (corner < 4) continue;
+            /* The furthest point in the pixel is at one of its corners */
+            depth = plane_c + plane_x * x + plane_y * y;
+            if (plane_x < 0.0f) depth += plane_x;
+            if (plane_y < 0.0f) depth += plane_y;
+            if (depth > occlusion.depth[y][x]) occlusion.depth[y][x] = depth;
+        }
+    }
+    occlusion_update_tiles(x0, y0, x1, y1);
+}
+
+/* Draw the faces of a 'vis' node into the depth buffer */
+static void occlusion_draw_cell(unsigned vis_index) {
+    const struct render_vertex* vert = &vertices.data[cells[vis_index].first];
+    unsigned long i;
+    for (i = 0; i < cells[vis_index].count; i += 4) {
+        float screen[4][3];
+        unsigned j;
+        for (j = 0; j < 4; ++j) {
+            float clip[4];
+            occlusion_project(vert[i + j].pos, clip);
+            if (!occlusion_to_screen(clip, screen[j])) break;
+        }
+        if (j < 4) continue;
+        /* Quads are drawn as the triangles (0, 1, 2) and (0, 2, 3) */
+        occlusion_draw_tri(screen[0], screen[1], screen[2]);
+        occlusion_draw_tri(screen[0], screen[2], screen[3]);
+    }
+}
+
+/* Check if the box around the geometry of a 'vis' node is behind what has been drawn into the depth buffer */
+static unsigned occlusion_test_cell(unsigned vis_index) {
+    const struct render_cell* cell = &cells[vis_index];
+    float min_x = (float)RENDER_OCCLUSION_WIDTH, min_y = (float)RENDER_OCCLUSION_HEIGHT;
+    float max_x = 0.0f, max_y = 0.0f;
+    float nearest = 0.0f;
+    unsigned x0, y0, x1, y1, x, y;
+    unsigned i;
+
+    for (i = 0; i < 8; ++i) {
+        float pos[3], clip[4], screen[3];
+        pos[0] = (i & 1) ? cell->min[0] : cell->max[0];
+        pos[1] = (i & 4) ? cell->min[1] : cell->max[1];
+        pos[2] = (i & 2) ? cell->min[2] : cell->max[2];
+        occlusion_project(pos, clip);
+        if (!occlusion_to_screen(clip, screen)) return 0; /* The camera might be in it */
+        if (screen[0] < min_x) min_x = screen[0];
+        if (screen[1] < min_y) min_y = screen[1];
+        if (screen[0] > max_x) max_x = screen[0];
+        if (screen[1] > max_y) max_y = screen[1];
+        if (screen[2] > nearest) nearest = screen[2];
+    }
+    if (min_x < 0.0f) min_x = 0.0f;
+    if (min_y < 0.0f) min_y = 0.0f;
+    if (max_x > RENDER_OCCLUSION_WIDTH) max_x = RENDER_OCCLUSION_WIDTH;
+    if (max_y > RENDER_OCCLUSION_HEIGHT) max_y = RENDER_OCCLUSION_HEIGHT;
+    if (min_x >= max_x || min_y >= max_y) return 0;
+    x0 = (unsigned)floor(min_x);
+    y0 = (unsigned)floor(min_y);
+    x1 = (unsigned)ceil(max_x);
+    y1 = (unsigned)ceil(max_y);
+
+    for (y = y0 / RENDER_OCCLUSION_TILE; y <= (y1 - 1) / RENDER_OCCLUSION_TILE; ++y) {
+        for (x = x0 / RENDER_OCCLUSION_TILE; x <= (x1 - 1) / RENDER_OCCLUSION_TILE; ++x) {
+            unsigned px, py;
+            if (occlusion.tiles[y][x] > nearest) continue; /* The whole tile is in front of it */
+            for (py = y * RENDER_OCCLUSION_TILE; py < (y + 1) * RENDER_OCCLUSION_TILE; ++py) {
+                if (py < y0 || py >= y1) continue;
+                for (px = x * RENDER_OCCLUSION_TILE; px < (x + 1) * RENDER_OCCLUSION_TILE; ++px) {
+                    if (px < x0 || px >= x1) continue;
+                    if (occlusion.depth[py][px] <= nearest) return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+#ifndef OCTEST_NO_RENDER_STATS
+/* Move on to the next frame in 'stats_frames' */
+static void start_stats(void) {
+    stats = &stats_frames[stats_frame % RENDER_STATS_FRAMES];
+    memset(stats, 0, sizeof(*stats));
+    stats->frame = ++stats_frame;
+    stats_time = gettime_us();
+}
+#endif
+
 unsigned render(struct vec3* pos, struct vec3* rot) {
-    unsigned child;
+    static const struct vec3 root_pos = {0.0f, 0.0f, 0.0f};
+    unsigned thread_count;
+    unsigned long batches;
+    unsigned retval;
+    unsigned long i;
+
+    STATS(start_stats());
+
     /* If the current 'vis' node pointer is not set yet, or the camera is outside of it */
     if (!cur_vis_node.ptr || !point_is_inside_box(pos, &cur_vis_node.min, &cur_vis_node.max)) {
+        struct query_point_hit hit;
+        const struct map_vis* vis_node;
         float offset;
  
         /* Find the vis node the camera is in (or closest to) */
-        cur_vis_node.ptr = find_vis_node(map, pos);
+        query_points(map, pos, 1, &hit);
+        if (hit.vis == -1U) {
+            fputs("Could not find the 'vis' node the camera is in\n", stderr);
+            return 0;
+        }
+        vis_node = &map->vis[hit.vis];
+        STATS(stats->vis_changed = (vis_node != cur_vis_node.ptr));
+        cur_vis_node.ptr = vis_node;
  
         /* Calculate the min and max coords to use with point_is_inside_box() next time */
         offset = cur_vis_node.ptr->size * 0.5f;
@@ -200,71 +819,171 @@ unsigned render(struct vec3* pos, struct vec3* rot) {
         cur_vis_node.max.y = cur_vis_node.ptr->pos.y + offset;
         cur_vis_node.max.z = cur_vis_node.ptr->pos.z + offset;
     }
+    STATS(stats->vis_node = cur_vis_node.ptr - map->vis);
+    STATS_TIME(find_us);
+
+    calc_view_mat(pos, rot, viewmat);
 
-    glEnable(GL_CULL_FACE);
-    switch (mode) {
-        case RENDER_MODE_NORMAL:
-            glClearColor(0.0f, 0.0f, 0.1f, 1.0f);
-            glEnable(GL_DEPTH_TEST);
-            glDisable(GL_BLEND);
-            break;
-        case RENDER_MODE_OVERDRAW:
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-            glEnable(GL_DEPTH_TEST);
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-            break;
-        case RENDER_MODE_OVERDRAW_NO_DEPTH:
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-            glDisable(GL_DEPTH_TEST);
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-            break;
+    /*
+        Find the 'vis' nodes in the frustum, and then make the draw commands,
+        each on as many threads as there are jobs for
+    */
+    /* Finding out how many CPUs there are is slow, so it is only done once */
+    if (!threads) threads = get_cpu_count();
+    /*
+        Handing out work to other threads costs more than it saves when there
+        are only a few cells, so there is at most one thread per draw batch
+        (and everything is done on this thread if there is only one)
+    */
+    batches = (cur_vis_node.ptr->sibling_count + RENDER_DRAW_BATCH) / RENDER_DRAW_BATCH;
+    thread_count = (threads < batches) ? threads : batches;
+    if (thread_count > worker_space) {
+        struct render_worker* new_workers = realloc(workers, thread_count * sizeof(*workers));
+        if (!new_workers) {
+            fputs("Memory error\n", stderr);
+            return 0;
+        }
+        workers = new_workers;
+        worker_space = thread_count;
+    }
+    memset(workers, 0, thread_count * sizeof(*workers));
+    calc_frustum();
+    ++frame;
+    cull_jobs.len = 0;
+    if (
+        !split_cull(&workers[0], 0, &root_pos, map->size, 63, (thread_count > 1) ? RENDER_CULL_SPLIT_DEPTH : 0) ||
+        !run_workers(thread_count, cull_jobs.len, cull_job, NULL) ||
+        !run_workers(thread_count, batches, draw_list_job, map->vis_sibs + cur_vis_node.ptr->first_sibling)
+    ) {
+        fputs("Failed to cull frame\n", stderr);
+        return 0;
+    }
+    #ifndef OCTEST_NO_RENDER_STATS
+    for (i = 0; i < thread_count; ++i) {
+        stats->parent_nodes += workers[i].parent_nodes;
+        stats->vis_nodes += workers[i].vis_nodes;
+        stats->frustum_culled += workers[i].frustum_culled;
     }
+    #endif
+    backend->begin_frame(mode, (float*)projmat, (float*)viewmat);
+    STATS_TIME(cull_us);
 
-    glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+    if (vertices.len) {
+        unsigned current = cur_vis_node.ptr - map->vis;
 
-    calc_view_mat(pos, rot, viewmat);
-    glMatrixMode(GL_PROJECTION);
-    glLoadMatrixf((float*)projmat);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadMatrixf((float*)viewmat);
+        backend->set_vertices(vertices.data);
 
-    /* Start at the child of the current 'vis' node */
-    child = cur_vis_node.ptr->data.vis.child;
-    /* Start rendering if it's not -1 'none', and return 0 if there is a problem */
-    if (child != -1U && !render_node(map, &map->nodes[child], pos)) return 0;
+        STATS(stats->cells = cur_vis_node.ptr->sibling_count + 1);
+        if (occlusion_culling) memset(&occlusion, 0, sizeof(occlusion));
 
-    {
-        unsigned* siblings = map->vis_sibs + cur_vis_node.ptr->data.vis.first_sibling;
-        unsigned i;
-        /* For each sibling */
-        for (i = 0; i < cur_vis_node.ptr->data.vis.sibling_count; ++i) {
-            struct map_node* vis_node = &map->nodes[siblings[i]];
-            /* Get its child */
-            child = vis_node->data.vis.child;
-            /* Start rendering if it's not -1 'none', and return 0 if there is a problem */
-            if (child != -1U) {
-                /* TODO: Frustum culling */
-                if (!render_node(map, &map->nodes[child], pos)) return 0;
+        /* Draw the commands in order, which is the current 'vis' node and then each sibling from near to far */
+        for (i = 0; i < batches; ++i) {
+            const struct render_cmd* cmd = &cmds[i * RENDER_DRAW_BATCH];
+            unsigned j;
+            for (j = 0; j < cmd_counts[i]; ++j, ++cmd) {
+                if (occlusion_culling) {
+                    /* Each command is one cell, and the current one is never tested */
+                    if (cmd->vis != current && occlusion_test_cell(cmd->vis)) {
+                        STATS(++stats->occlusion_culled);
+                        continue;
+                    }
+                    draw_cmd(cmd);
+                    occlusion_draw_cell(cmd->vis);
+                } else {
+                    draw_cmd(cmd);
+                }
             }
         }
     }
 
-    glFlush();
+    STATS_TIME(draw_us);
 
-    return 1;
+    retval = backend->end_frame();
+    STATS_TIME(finish_us);
+    return retval;
 }
 
-void set_map(const struct map* in) {
+/* Returns 0 if the map could not be prepared for rendering. Pass NULL to free what was built for the last map. */
+unsigned set_map(const struct map* in) {
+    unsigned long max_cells = 0;
+    unsigned long batches;
+    unsigned i;
+    VLB_FREE(vertices);
+    VLB_ZINIT(vertices);
+    free(cells);
+    cells = NULL;
+    free(cmds);
+    cmds = NULL;
+    free(cmd_counts);
+    cmd_counts = NULL;
     map = in;
     cur_vis_node.ptr = NULL;
+    frame = 0;
+    if (!in) {
+        VLB_FREE(cull_jobs);
+        VLB_ZINIT(cull_jobs);
+        free(workers);
+        workers = NULL;
+        worker_space = 0;
+        return 1;
+    }
+    if (!build_cells(in)) goto reterr;
+    /* Make room for the draw commands of the longest list of cells */
+    for (i = 0; i < in->vis_count; ++i) {
+        if (in->vis[i].sibling_count + 1UL > max_cells) max_cells = in->vis[i].sibling_count + 1UL;
+    }
+    batches = (max_cells + RENDER_DRAW_BATCH - 1) / RENDER_DRAW_BATCH;
+    cmds = malloc((batches * RENDER_DRAW_BATCH + 1) * sizeof(*cmds));
+    cmd_counts = malloc((batches + 1) * sizeof(*cmd_counts));
+    if (!cmds || !cmd_counts) {
+        fputs("Memory error\n", stderr);
+        goto reterr;
+    }
+    return 1;
+
+    reterr:
+    map = NULL;
+    return 0;
+}
+
+/* Set how many threads frames are culled on, 0 to use one for each CPU */
+void set_render_threads(unsigned count) {
+    threads = count;
+}
+
+/* Set what draws frames. 'recalc_proj' has to be called after this, before the next frame. */
+void set_render_backend(const struct render_backend* in) {
+    backend = in;
 }
 
 void set_render_mode(enum render_mode in) {
     mode = in;
 }
 
+void set_occlusion_culling(unsigned enabled) {
+    occlusion_culling = enabled;
+}
+unsigned get_occlusion_culling(void) {
+    return occlusion_culling;
+}
+
+/*
+    Get the stats of a frame, 'age' frames before the last one. Returns 0 if
+    they were not kept (that frame was not drawn yet, or it was more than
+    RENDER_STATS_FRAMES frames ago).
+*/
+unsigned get_render_stats(unsigned age, struct render_stats* out) {
+    #ifndef OCTEST_NO_RENDER_STATS
+    if (age >= RENDER_STATS_FRAMES || age >= stats_frame) return 0;
+    *out = stats_frames[(stats_frame - 1 - age) % RENDER_STATS_FRAMES];
+    return 1;
+    #else
+    (void)age;
+    (void)out;
+    return 0;
+    #endif
+}
+
 static void calc_proj_mat(float aspect, float fov, float nearplane, float farplane, float mat[4][4]) {
     float tmp1 = 1.0f / (float)tan(DEGTORAD_FLT(fov) * 0.5f);
     float tmp2 = 1.0f / (nearplane - farplane);
@@ -308,7 +1027,9 @@ static void calc_view_mat(struct vec3* pos, struct vec3* rot, float mat[4][4]) {
     mat[3][2] = front[0] * pos->x + front[1] * pos->y + front[2] * pos->z;
 }
 
-void recalc_proj(const struct uvec2* size, float fov, float nearplane, float farplane) {
-    glViewport(0, 0, size->x, size->y);
+/* Returns 0 if the backend could not be resized */
+unsigned recalc_proj(const struct uvec2* size, float fov, float nearplane, float farplane) {
+    occlusion_near = nearplane;
     calc_proj_mat((float)size->x / size->y, fov, nearplane, farplane, projmat);
+    return backend->resize(size);
 }
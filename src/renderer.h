@@ -9,10 +9,59 @@ enum render_mode {
     RENDER_MODE_OVERDRAW,
     RENDER_MODE_OVERDRAW_NO_DEPTH
 };
+/* A vertex of the arrays given to a backend */
+struct render_vertex {
+    float pos[3];
+    unsigned char color[4];
+};
+/*
+    Draws what the renderer works out needs to be drawn.
+    Each frame is 'begin_frame', then 'set_vertices' if there is anything to
+    draw, then any number of 'draw_quads', then 'end_frame'. Matrices are 16
+    floats stored by column, like OpenGL's. In the overdraw modes, the colors
+    of the vertices are ignored and each quad adds 5% red where it is drawn.
+*/
+struct render_backend {
+    unsigned (*resize)(const struct uvec2* size);
+    void (*begin_frame)(enum render_mode mode, const float* projmat, const float* viewmat);
+    void (*set_vertices)(const struct render_vertex* vertices);
+    void (*draw_quads)(unsigned long first, unsigned long count);
+    unsigned (*end_frame)(void);
+};
+/* How many of the last frames 'get_render_stats' keeps the stats of */
+#define RENDER_STATS_FRAMES 256
+/*
+    What the renderer did in a frame. Defining OCTEST_NO_RENDER_STATS when
+    building leaves out keeping them, and 'get_render_stats' always returns 0.
+*/
+struct render_stats {
+    unsigned long frame;         /* Counts up from 1 */
+    unsigned vis_node;           /* Index of the 'vis' node the camera is in */
+    unsigned vis_changed;        /* 1 if the camera moved into a different 'vis' node */
+    unsigned long parent_nodes;  /* 'parent' nodes visited while frustum culling */
+    unsigned long vis_nodes;     /* 'vis' nodes found to be in the frustum */
+    unsigned long geom_nodes;    /* 'geom' nodes in the cells that were drawn */
+    unsigned cells;              /* The current 'vis' node and its siblings */
+    unsigned frustum_culled;
+    unsigned occlusion_culled;
+    unsigned cells_drawn;
+    unsigned long quads;         /* Given to the backend to draw */
+    unsigned long vertices;
+    /* Microseconds spent on each part of the frame */
+    unsigned long find_us;       /* Finding the 'vis' node the camera is in */
+    unsigned long cull_us;       /* Frustum culling, making the draw commands and starting the frame */
+    unsigned long draw_us;       /* Occlusion culling and giving the draw commands to the backend */
+    unsigned long finish_us;     /* The backend finishing the frame */
+};
 
-void recalc_proj(const struct uvec2* size, float fov, float nearplane, float farplane);
-void set_map(const struct map* map);
+void set_render_backend(const struct render_backend* backend);
+unsigned recalc_proj(const struct uvec2* size, float fov, float nearplane, float farplane);
+unsigned set_map(const struct map* map);
 void set_render_mode(enum render_mode mode);
+void set_render_threads(unsigned count);
+void set_occlusion_culling(unsigned enabled);
+unsigned get_occlusion_culling(void);
+unsigned get_render_stats(unsigned age, struct render_stats* out);
 unsigned render(struct vec3* pos, struct vec3* rot);
 
 #endif
@@ -0,0 +1,398 @@
+#include "softrender.h"
+#include "workers.h"
+#include "vlb.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SOFT_TILE_SIZE 64
+/*
+    Pixels worked on at once in the inner loop. The loops over them are kept
+    simple and free of branches so the compiler can turn them into SIMD.
+*/
+#define SOFT_LANES 8
+
+/* A triangle set up for drawing, in pixels with (0, 0) at the bottom left */
+struct soft_tri {
+    float edges[3][3];  /* (A, B, C) of each edge, where A * x + B * y + C >= 0 is inside */
+    float depth[3];     /* Depth = depth[0] * x + depth[1] * y + depth[2] */
+    unsigned char top_left[3]; /* Pixels exactly on the edge are drawn if it is set (so shared edges are only drawn once) */
+    unsigned char color[4];
+    unsigned min_x, min_y, max_x, max_y; /* Bounds in pixels, with the max not included */
+};
+
+static struct {
+    unsigned width;
+    unsigned height;
+    unsigned tiles_x;
+    unsigned tiles_y;
+    unsigned char* color;
+    float* depth;
+    unsigned short* overdraw;
+    enum render_mode mode;
+    float mat[4][4];        /* Projection * view, stored by column */
+    const struct render_vertex* vertices;
+    struct VLB(struct soft_tri) tris;
+    unsigned* bin_firsts;   /* Where the triangles of each tile start in 'bins', plus the end */
+    struct VLB(unsigned) bins; /* Each indexes 'tris' */
+    unsigned threads;       /* 0 to use one for each CPU */
+    unsigned cpu_count;     /* 0 until the first frame */
+    unsigned failed : 1;    /* Set if something could not be added to the frame */
+} soft;
+
+void set_soft_render_threads(unsigned count) {
+    soft.threads = count;
+}
+
+static unsigned soft_resize(const struct uvec2* size) {
+    unsigned long pixels = (unsigned long)size->x * size->y;
+    unsigned char* color;
+    float* depth;
+    unsigned short* overdraw;
+    unsigned* bin_firsts;
+    unsigned tiles_x = (size->x + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    unsigned tiles_y = (size->y + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+
+    color = realloc(soft.color, pixels * 4);
+    if (color) soft.color = color;
+    depth = realloc(soft.depth, pixels * sizeof(*depth));
+    if (depth) soft.depth = depth;
+    overdraw = realloc(soft.overdraw, pixels * sizeof(*overdraw));
+    if (overdraw) soft.overdraw = overdraw;
+    bin_firsts = realloc(soft.bin_firsts, ((unsigned long)tiles_x * tiles_y + 1) * sizeof(*bin_firsts));
+    if (bin_firsts) soft.bin_firsts = bin_firsts;
+    if (!color || !depth || !overdraw || !bin_firsts) {
+        fputs("Memory error\n", stderr);
+        soft.width = 0;
+        soft.height = 0;
+        soft.tiles_x = 0;
+        soft.tiles_y = 0;
+        return 0;
+    }
+    soft.width = size->x;
+    soft.height = size->y;
+    soft.tiles_x = tiles_x;
+    soft.tiles_y = tiles_y;
+    return 1;
+}
+
+static void soft_begin_frame(enum render_mode mode, const float* projmat, const float* viewmat) {
+    unsigned i, j, k;
+    soft.mode = mode;
+    for (i = 0; i < 4; ++i) {
+        for (j = 0; j < 4; ++j) {
+            soft.mat[i][j] = 0.0f;
+            for (k = 0; k < 4; ++k) soft.mat[i][j] += projmat[k * 4 + j] * viewmat[i * 4 + k];
+        }
+    }
+    soft.vertices = NULL;
+    soft.tris.len = 0;
+    soft.failed = 0;
+}
+
+static void soft_set_vertices(const struct render_vertex* vertices) {
+    soft.vertices = vertices;
+}
+
+/* Work out the edges and depth of a triangle in clip space and add it to the frame */
+static void soft_add_tri(const float* a, const float* b, const float* c, const unsigned char* color) {
+    float screen[3][3];
+    const float* points[3];
+    float area, min_x, min_y, max_x, max_y;
+    struct soft_tri* tri;
+    unsigned i;
+
+    points[0] = a;
+    points[1] = b;
+    points[2] = c;
+    for (i = 0; i < 3; ++i) {
+        float inv_w = 1.0f / points[i][3];
+        screen[i][0] = (points[i][0] * inv_w * 0.5f + 0.5f) * soft.width;
+        screen[i][1] = (points[i][1] * inv_w * 0.5f + 0.5f) * soft.height;
+        screen[i][2] = points[i][2] * inv_w * 0.5f + 0.5f;
+    }
+
+    /* Faces going clockwise on the screen face away, and are culled */
+    area = (screen[1][0] - screen[0][0]) * (screen[2][1] - screen[0][1]) - (screen[1][1] - screen[0][1]) * (screen[2][0] - screen[0][0]);
+    if (!(area > 0.0f)) return;
+
+    min_x = max_x = screen[0][0];
+    min_y = max_y = screen[0][1];
+    for (i = 1; i < 3; ++i) {
+        if (screen[i][0] < min_x) min_x = screen[i][0];
+        if (screen[i][0] > max_x) max_x = screen[i][0];
+        if (screen[i][1] < min_y) min_y = screen[i][1];
+        if (screen[i][1] > max_y) max_y = screen[i][1];
+    }
+    if (min_x < 0.0f) min_x = 0.0f;
+    if (min_y < 0.0f) min_y = 0.0f;
+    if (max_x > soft.width) max_x = soft.width;
+    if (max_y > soft.height) max_y = soft.height;
+    if (min_x >= max_x || min_y >= max_y) return;
+
+    VLB_EXPANDBY(soft.tris, 1, 2, 1, soft.failed = 1; return;);
+    tri = &soft.tris.data[soft.tris.len - 1];
+    /* Pixel centers are at +0.5, so only pixels whose centers could be inside are kept */
+    tri->min_x = (unsigned)floor(min_x);
+    tri->min_y = (unsigned)floor(min_y);
+    tri->max_x = (unsigned)ceil(max_x);
+    tri->max_y = (unsigned)ceil(max_y);
+    for (i = 0; i < 3; ++i) {
+        const float* p = screen[i];
+        const float* q = screen[(i + 1) % 3];
+        float* edge = tri->edges[i];
+        edge[0] = p[1] - q[1];
+        edge[1] = q[0] - p[0];
+        edge[2] = -(edge[0] * p[0] + edge[1] * p[1]);
+        tri->top_left[i] = edge[0] > 0.0f || (edge[0] == 0.0f && edge[1] < 0.0f);
+    }
+    tri->depth[0] = ((screen[1][2] - screen[0][2]) * (screen[2][1] - screen[0][1]) - (screen[2][2] - screen[0][2]) * (screen[1][1] - screen[0][1])) / area;
+    tri->depth[1] = ((screen[2][2] - screen[0][2]) * (screen[1][0] - screen[0][0]) - (screen[1][2] - screen[0][2]) * (screen[2][0] - screen[0][0])) / area;
+    tri->depth[2] = screen[0][2] - tri->depth[0] * screen[0][0] - tri->depth[1] * screen[0][1];
+    memcpy(tri->color, color, sizeof(tri->color));
+}
+
+/*
+    Clip a polygon in clip space to the side of a plane where
+    z * 'sign' + w >= 0 (the near plane for a 'sign' of 1, and the far plane
+    for -1). Returns the new number of points.
+*/
+static unsigned soft_clip_poly(float in[][4], unsigned count, float sign, float out[][4]) {
+    unsigned out_count = 0;
+    unsigned i;
+    for (i = 0; i < count; ++i) {
+        const float* p = in[i];
+        const float* q = in[(i + 1) % count];
+        float dp = p[2] * sign + p[3];
+        float dq = q[2] * sign + q[3];
+        if (dp >= 0.0f) memcpy(out[out_count++], p, sizeof(*out));
+        if ((dp >= 0.0f) != (dq >= 0.0f)) {
+            float t = dp / (dp - dq);
+            unsigned j;
+            for (j = 0; j < 4; ++j) out[out_count][j] = p[j] + (q[j] - p[j]) * t;
+            ++out_count;
+        }
+    }
+    return out_count;
+}
+
+static void soft_draw_quads(unsigned long first, unsigned long count) {
+    unsigned long i;
+    for (i = first; i + 3 < first + count; i += 4) {
+        float clip[4][4];
+        unsigned inside = 0;
+        unsigned j, k;
+        for (j = 0; j < 4; ++j) {
+            const float* pos = soft.vertices[i + j].pos;
+            for (k = 0; k < 4; ++k) {
+                clip[j][k] = soft.mat[0][k] * pos[0] + soft.mat[1][k] * pos[1] + soft.mat[2][k] * pos[2] + soft.mat[3][k];
+            }
+            if (clip[j][2] >= -clip[j][3] && clip[j][2] <= clip[j][3]) ++inside;
+        }
+        if (inside == 4) {
+            /* Quads are drawn as the triangles (0, 1, 2) and (0, 2, 3), like OpenGL does */
+            soft_add_tri(clip[0], clip[1], clip[2], soft.vertices[i].color);
+            soft_add_tri(clip[0], clip[2], clip[3], soft.vertices[i].color);
+        } else {
+            /* Clip the quad to the near and far planes first (each plane can add a point) */
+            float tmp[6][4], poly[6][4];
+            unsigned poly_count = soft_clip_poly(clip, 4, 1.0f, tmp);
+            if (poly_count >= 3) poly_count = soft_clip_poly(tmp, poly_count, -1.0f, poly);
+            else poly_count = 0;
+            for (j = 2; j < poly_count; ++j) {
+                soft_add_tri(poly[0], poly[j - 1], poly[j], soft.vertices[i].color);
+            }
+        }
+    }
+}
+
+/* Draw a triangle into the part of it in a tile */
+static void soft_draw_tri(const struct soft_tri* tri, unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+    unsigned depth_test = soft.mode != RENDER_MODE_OVERDRAW_NO_DEPTH;
+    unsigned blend = soft.mode != RENDER_MODE_NORMAL;
+    unsigned x, y;
+    if (tri->min_x > x0) x0 = tri->min_x;
+    if (tri->min_y > y0) y0 = tri->min_y;
+    if (tri->max_x < x1) x1 = tri->max_x;
+    if (tri->max_y < y1) y1 = tri->max_y;
+    for (y = y0; y < y1; ++y) {
+        float py = y + 0.5f;
+        for (x = x0; x < x1; x += SOFT_LANES) {
+            float depth[SOFT_LANES];
+            unsigned char inside[SOFT_LANES];
+            unsigned long pixel = (unsigned long)y * soft.width + x;
+            unsigned lane, e;
+            /* Work out every lane at once */
+            for (lane = 0; lane < SOFT_LANES; ++lane) {
+                float px = (float)(x + lane) + 0.5f;
+                depth[lane] = tri->depth[0] * px + tri->depth[1] * py + tri->depth[2];
+                inside[lane] = (x + lane) < x1;
+            }
+            for (e = 0; e < 3; ++e) {
+                const float* edge = tri->edges[e];
+                unsigned char top_left = tri->top_left[e];
+                for (lane = 0; lane < SOFT_LANES; ++lane) {
+                    float px = (float)(x + lane) + 0.5f;
+                    float dist = edge[0] * px + edge[1] * py + edge[2];
+                    inside[lane] &= (dist > 0.0f) | ((dist == 0.0f) & top_left);
+                }
+            }
+            /* Then write the pixels that are in */
+            for (lane = 0; lane < SOFT_LANES; ++lane) {
+                unsigned long p = pixel + lane;
+                unsigned char* color;
+                if (!inside[lane]) continue;
+                if (depth_test) {
+                    if (!(depth[lane] < soft.depth[p])) continue;
+                    soft.depth[p] = depth[lane];
+                }
+                if (soft.overdraw[p] != 65535) ++soft.overdraw[p];
+                color = &soft.color[p * 4];
+                if (blend) {
+                    /* Adds 5% red, like blending (1, 0, 0, 0.05) with (GL_SRC_ALPHA, GL_ONE) */
+                    color[0] = (color[0] > 255 - 13) ? 255 : color[0] + 13;
+                } else {
+                    memcpy(color, tri->color, 4);
+                }
+            }
+        }
+    }
+}
+
+/* Clear a tile and draw every triangle touching it */
+static unsigned soft_draw_tile(void* data, unsigned worker, unsigned long tile) {
+    unsigned x0 = (tile % soft.tiles_x) * SOFT_TILE_SIZE;
+    unsigned y0 = (tile / soft.tiles_x) * SOFT_TILE_SIZE;
+    unsigned x1 = x0 + SOFT_TILE_SIZE;
+    unsigned y1 = y0 + SOFT_TILE_SIZE;
+    unsigned char clear[4];
+    unsigned x, y, i;
+    (void)data;
+    (void)worker;
+    if (x1 > soft.width) x1 = soft.width;
+    if (y1 > soft.height) y1 = soft.height;
+
+    clear[0] = 0;
+    clear[1] = 0;
+    clear[2] = (soft.mode == RENDER_MODE_NORMAL) ? 26 : 0;
+    clear[3] = 255;
+    for (y = y0; y < y1; ++y) {
+        unsigned long row = (unsigned long)y * soft.width;
+        for (x = x0; x < x1; ++x) {
+            memcpy(&soft.color[(row + x) * 4], clear, 4);
+            soft.depth[row + x] = 1.0f;
+            soft.overdraw[row + x] = 0;
+        }
+    }
+
+    for (i = soft.bin_firsts[tile]; i < soft.bin_firsts[tile + 1]; ++i) {
+        soft_draw_tri(&soft.tris.data[soft.bins.data[i]], x0, y0, x1, y1);
+    }
+    return 1;
+}
+
+/* Sort the triangles into the tiles they touch, and then draw the tiles */
+static unsigned soft_end_frame(void) {
+    unsigned long tile_count = (unsigned long)soft.tiles_x * soft.tiles_y;
+    unsigned long i;
+    unsigned threads;
+
+    if (soft.failed) {
+        fputs("Memory error\n", stderr);
+        return 0;
+    }
+
+    /* Count the triangles in each tile, then turn the counts into where each tile's run ends */
+    memset(soft.bin_firsts, 0, (tile_count + 1) * sizeof(*soft.bin_firsts));
+    for (i = 0; i < soft.tris.len; ++i) {
+        const struct soft_tri* tri = &soft.tris.data[i];
+        unsigned tx, ty;
+        for (ty = tri->min_y / SOFT_TILE_SIZE; ty <= (tri->max_y - 1) / SOFT_TILE_SIZE; ++ty) {
+            for (tx = tri->min_x / SOFT_TILE_SIZE; tx <= (tri->max_x - 1) / SOFT_TILE_SIZE; ++tx) {
+                ++soft.bin_firsts[ty * soft.tiles_x + tx + 1];
+            }
+        }
+    }
+    for (i = 0; i < tile_count; ++i) soft.bin_firsts[i + 1] += soft.bin_firsts[i];
+    soft.bins.len = 0;
+    VLB_EXPANDTO(soft.bins, soft.bin_firsts[tile_count], 2, 1, fputs("Memory error\n", stderr); return 0;);
+    /* Then fill them in order, which moves each start back to where it was */
+    for (i = 0; i < soft.tris.len; ++i) {
+        const struct soft_tri* tri = &soft.tris.data[i];
+        unsigned tx, ty;
+        for (ty = tri->min_y / SOFT_TILE_SIZE; ty <= (tri->max_y - 1) / SOFT_TILE_SIZE; ++ty) {
+            for (tx = tri->min_x / SOFT_TILE_SIZE; tx <= (tri->max_x - 1) / SOFT_TILE_SIZE; ++tx) {
+                soft.bins.data[soft.bin_firsts[ty * soft.tiles_x + tx]++] = i;
+            }
+        }
+    }
+    for (i = tile_count; i > 0; --i) soft.bin_firsts[i] = soft.bin_firsts[i - 1];
+    soft.bin_firsts[0] = 0;
+
+    /* Finding out how many CPUs there are is slow, so it is only done once */
+    if (!soft.cpu_count) soft.cpu_count = get_cpu_count();
+    threads = (soft.threads) ? soft.threads : soft.cpu_count;
+    if (!run_workers(threads, tile_count, soft_draw_tile, NULL)) {
+        fputs("Failed to draw frame\n", stderr);
+        return 0;
+    }
+    return 1;
+}
+
+void get_soft_render_buffers(struct soft_render_buffers* out) {
+    out->width = soft.width;
+    out->height = soft.height;
+    out->color = soft.color;
+    out->depth = soft.depth;
+    out->overdraw = soft.overdraw;
+}
+
+/* Write the color buffer of the last frame to a binary PPM file */
+unsigned write_soft_render_image(const char* path) {
+    FILE* f = fopen(path, "wb");
+    unsigned y;
+    if (!f) {
+        fprintf(stderr, "Failed to open '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    fprintf(f, "P6\n%u %u\n255\n", soft.width, soft.height);
+    for (y = soft.height; y > 0; --y) {
+        const unsigned char* row = &soft.color[(unsigned long)(y - 1) * soft.width * 4];
+        unsigned x;
+        for (x = 0; x < soft.width; ++x) {
+            if (fwrite(&row[x * 4], 1, 3, f) != 3) break;
+        }
+        if (x < soft.width) break;
+    }
+    if (y > 0 || fclose(f)) {
+        fprintf(stderr, "Failed to write '%s': %s\n", path, strerror(errno));
+        if (y > 0) fclose(f);
+        return 0;
+    }
+    return 1;
+}
+
+void free_soft_render(void) {
+    unsigned threads = soft.threads;
+    unsigned cpu_count = soft.cpu_count;
+    free(soft.color);
+    free(soft.depth);
+    free(soft.overdraw);
+    free(soft.bin_firsts);
+    VLB_FREE(soft.tris);
+    VLB_FREE(soft.bins);
+    memset(&soft, 0, sizeof(soft));
+    soft.threads = threads;
+    soft.cpu_count = cpu_count;
+}
+
+const struct render_backend soft_render_backend = {
+    soft_resize,
+    soft_begin_frame,
+    soft_set_vertices,
+    soft_draw_quads,
+    soft_end_frame
+};
@@ -0,0 +1,27 @@
+#ifndef OCTEST_SOFTRENDER_H
+#define OCTEST_SOFTRENDER_H
+
+#include "renderer.h"
+
+/*
+    Draws on the CPU into buffers in memory, so it needs no window or GL
+    context. The screen is split into tiles that are drawn on their own
+    threads once the frame is done.
+*/
+extern const struct render_backend soft_render_backend;
+
+/* The buffers of the last frame, with the bottom row first like OpenGL */
+struct soft_render_buffers {
+    unsigned width;
+    unsigned height;
+    const unsigned char* color;     /* RGBA */
+    const float* depth;             /* 0 (near) to 1 (far) */
+    const unsigned short* overdraw; /* How many times each pixel was drawn to */
+};
+
+void set_soft_render_threads(unsigned count);
+void get_soft_render_buffers(struct soft_render_buffers* out);
+unsigned write_soft_render_image(const char* path);
+void free_soft_render(void);
+
+#endif
@@ -0,0 +1,140 @@
+#include "workers.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+    The threads are started the first time they are needed and kept around
+    until 'free_workers', so a call only has to wake them up. More than one
+    thread can call 'run_workers' at once (e.g. the renderer and a map being
+    compiled in the background), so each call adds a run to a list, and the
+    threads work on whichever runs they can.
+*/
+struct workers_run {
+    struct workers_run* next;
+    unsigned long next_job;
+    unsigned long job_count;
+    worker_func func;
+    void* data;
+    unsigned thread_count;
+    unsigned active;        /* How many of the pool's threads are working on the run */
+    unsigned failed : 1;
+};
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    /* Signaled when a run is added or the threads should stop */
+    pthread_cond_t done;    /* Signaled when the last thread working on a run leaves it */
+    struct workers_run* runs;
+    pthread_t* threads;     /* Thread N has a worker index of N + 1 (the calling thread is 0) */
+    unsigned thread_count;
+    unsigned stop : 1;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0};
+
+/* Do jobs from 'run' until there are none left. The pool must be locked. */
+static void work_on_run(struct workers_run* run, unsigned worker) {
+    while (run->next_job < run->job_count) {
+        unsigned long job = run->next_job++;
+        unsigned ok;
+        pthread_mutex_unlock(&pool.lock);
+        ok = run->func(run->data, worker, job);
+        pthread_mutex_lock(&pool.lock);
+        if (!ok) {
+            /* Stop handing out jobs */
+            run->failed = 1;
+            run->next_job = run->job_count;
+        }
+    }
+}
+
+static void* worker_main(void* arg) {
+    unsigned worker = (unsigned)(unsigned long)arg;
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        struct workers_run* run;
+        for (run = pool.runs; run; run = run->next) {
+            if (worker < run->thread_count && run->next_job < run->job_count) break;
+        }
+        if (!run) {
+            if (pool.stop) break;
+            pthread_cond_wait(&pool.wake, &pool.lock);
+            continue;
+        }
+        ++run->active;
+        work_on_run(run, worker);
+        if (!--run->active) pthread_cond_broadcast(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/* Start threads until there are enough for 'thread_count' workers. The pool must be locked. */
+static void grow_workers(unsigned thread_count) {
+    pthread_t* threads;
+    if (thread_count - 1 <= pool.thread_count) return;
+    threads = realloc(pool.threads, (thread_count - 1) * sizeof(*threads));
+    if (!threads) return;
+    pool.threads = threads;
+    /* If a thread can't be started, the ones that did just pick up its share of the jobs */
+    while (pool.thread_count < thread_count - 1) {
+        if (pthread_create(&pool.threads[pool.thread_count], NULL, worker_main, (void*)(unsigned long)(pool.thread_count + 1))) break;
+        ++pool.thread_count;
+    }
+}
+
+unsigned run_workers(unsigned thread_count, unsigned long job_count, worker_func func, void* data) {
+    struct workers_run run;
+    struct workers_run** link;
+
+    if (thread_count > job_count) thread_count = job_count;
+    if (thread_count <= 1) {
+        unsigned long job;
+        for (job = 0; job < job_count; ++job) {
+            if (!func(data, 0, job)) return 0;
+        }
+        return 1;
+    }
+
+    run.next_job = 0;
+    run.job_count = job_count;
+    run.func = func;
+    run.data = data;
+    run.thread_count = thread_count;
+    run.active = 0;
+    run.failed = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    grow_workers(thread_count);
+    run.next = pool.runs;
+    pool.runs = &run;
+    pthread_cond_broadcast(&pool.wake);
+
+    work_on_run(&run, 0);
+    while (run.active) pthread_cond_wait(&pool.done, &pool.lock);
+
+    link = &pool.runs;
+    while (*link != &run) link = &(*link)->next;
+    *link = run.next;
+    pthread_mutex_unlock(&pool.lock);
+    return !run.failed;
+}
+
+void free_workers(void) {
+    unsigned i;
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.thread_count; ++i) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.thread_count = 0;
+    pool.stop = 0;
+}
+
+unsigned get_cpu_count(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? count : 1;
+}
@@ -0,0 +1,20 @@
+#ifndef OCTEST_WORKERS_H
+#define OCTEST_WORKERS_H
+
+/*
+    Runs 'func' on every job number from 0 to 'job_count' - 1 using up to
+    'thread_count' threads (the calling thread is one of them). Jobs are
+    handed out in order, but may finish in any order, so anything that needs
+    a set order has to be put back together after. 'worker' is the index of
+    the thread running the job and is less than 'thread_count', so it can be
+    used to pick per-thread scratch data.
+    If 'func' returns 0, no more jobs are started and 0 is returned.
+    The threads are kept waiting between calls until 'free_workers'.
+*/
+typedef unsigned (*worker_func)(void* data, unsigned worker, unsigned long job);
+
+unsigned run_workers(unsigned thread_count, unsigned long job_count, worker_func func, void* data);
+void free_workers(void);
+unsigned get_cpu_count(void);
+
+#endif
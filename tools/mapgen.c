@@ -0,0 +1,449 @@
+/*
+    Makes maps for stress testing the compiler and renderer.
+    The tree is written out as it is worked out, so only a few hundred leaves
+    are held in memory at a time no matter how big the map is.
+*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Below this many levels, a node's leaves are worked out up front so empty and full nodes can be collapsed */
+#define MAPGEN_BLOCK_DEPTH 3
+#define MAPGEN_BLOCK_SIZE (1 << MAPGEN_BLOCK_DEPTH)
+
+enum mapgen_kind {
+    MAPGEN_TERRAIN,
+    MAPGEN_CAVES,
+    MAPGEN_CITY
+};
+enum mapgen_class {
+    MAPGEN_EMPTY,
+    MAPGEN_FULL,
+    MAPGEN_MIXED
+};
+/* What is in a leaf, and the shape it has if it is solid */
+enum mapgen_shape {
+    MAPGEN_SHAPE_NONE,
+    MAPGEN_SHAPE_CUBE,
+    MAPGEN_SHAPE_WEDGE_FRONT,
+    MAPGEN_SHAPE_WEDGE_BACK,
+    MAPGEN_SHAPE_WEDGE_RIGHT,
+    MAPGEN_SHAPE_WEDGE_LEFT
+};
+static const char* const shape_names[] = {
+    "none", "cube", "wedge_front", "wedge_back", "wedge_right", "wedge_left"
+};
+static const char shape_defs[] =
+    "shape cube {,,,,,,,,,,,,,,,,,,,,,,,};\n"
+    "shape wedge_front {, 0,,, 0,,,,,,,,,,,,,,,,,,,};\n"
+    "shape wedge_back {,,,,,,, 0,,, 0,,,,,,,,,,,,,};\n"
+    "shape wedge_right {, 0,,,,,, 0,,,,,,,,,,,,,,,,};\n"
+    "shape wedge_left {,,,, 0,,,,,, 0,,,,,,,,,,,,,};\n";
+
+static struct {
+    enum mapgen_kind kind;
+    float size;
+    unsigned depth;
+    float density;      /* 0 to 1, how much of the map is solid */
+    float mix;          /* 0 to 1, how many of the top faces are wedges instead of cubes */
+    unsigned seed;
+    float min_vis_size;
+    float max_vis_dist;
+    float leaf;         /* Size of the smallest nodes */
+    float scale;        /* Size of the biggest features of the noise */
+} opt;
+
+static FILE* out;
+static unsigned long geom_count;
+static unsigned long parent_count;
+
+/* Hash some ints into a number from 0 to 1 */
+static unsigned hash3(int x, int y, int z) {
+    unsigned h = opt.seed * 0x9E3779B9U;
+    h ^= (unsigned)x * 0x85EBCA6BU;
+    h = (h << 13) | (h >> 19);
+    h ^= (unsigned)y * 0xC2B2AE35U;
+    h = (h << 13) | (h >> 19);
+    h ^= (unsigned)z * 0x27D4EB2FU;
+    h ^= h >> 16;
+    h *= 0x7FEB352DU;
+    h ^= h >> 15;
+    h *= 0x846CA68BU;
+    h ^= h >> 16;
+    return h;
+}
+static float hashf(int x, int y, int z) {
+    return (hash3(x, y, z) & 0xFFFFFF) / (float)0xFFFFFF;
+}
+
+static float smooth(float t) {
+    return t * t * (3.0f - 2.0f * t);
+}
+static float lerp(float a, float b, float t) {
+    return a + (b - a) * t;
+}
+
+/* Value noise from -1 to 1 */
+static float noise3(float x, float y, float z) {
+    int ix = (int)floor(x), iy = (int)floor(y), iz = (int)floor(z);
+    float fx = smooth(x - ix), fy = smooth(y - iy), fz = smooth(z - iz);
+    float a = lerp(hashf(ix, iy, iz), hashf(ix + 1, iy, iz), fx);
+    float b = lerp(hashf(ix, iy + 1, iz), hashf(ix + 1, iy + 1, iz), fx);
+    float c = lerp(hashf(ix, iy, iz + 1), hashf(ix + 1, iy, iz + 1), fx);
+    float d = lerp(hashf(ix, iy + 1, iz + 1), hashf(ix + 1, iy + 1, iz + 1), fx);
+    return lerp(lerp(a, b, fy), lerp(c, d, fy), fz) * 2.0f - 1.0f;
+}
+
+/* Noise with 4 octaves, from -1 to 1 */
+static float fbm3(float x, float y, float z) {
+    float sum = 0.0f, amp = 0.5f;
+    unsigned i;
+    for (i = 0; i < 4; ++i) {
+        sum += noise3(x, y, z) * amp;
+        x *= 2.0f;
+        y *= 2.0f;
+        z *= 2.0f;
+        amp *= 0.5f;
+    }
+    return sum / 0.9375f;
+}
+
+/*
+    Terrain: a height map of noise. 'density' sets the average height, and
+    the hills go up and down by an eighth of the map.
+*/
+static float terrain_height(float x, float z) {
+    return -opt.size * 0.5f + opt.density * opt.size + fbm3(x / opt.scale, 0.0f, z / opt.scale) * opt.size * 0.125f;
+}
+static unsigned terrain_solid(float x, float y, float z) {
+    return y < terrain_height(x, z);
+}
+static enum mapgen_class terrain_class(const float* min, const float* max) {
+    float mid = -opt.size * 0.5f + opt.density * opt.size;
+    if (min[1] >= mid + opt.size * 0.125f) return MAPGEN_EMPTY;
+    if (max[1] <= mid - opt.size * 0.125f) return MAPGEN_FULL;
+    return MAPGEN_MIXED;
+}
+
+/*
+    Caves: solid wherever 3D noise is over a threshold, so tunnels wind
+    through the whole map. Nothing can be skipped, every leaf is worked out.
+*/
+static unsigned caves_solid(float x, float y, float z) {
+    return fbm3(x / opt.scale, y / opt.scale, z / opt.scale) * 0.5f + 0.5f < opt.density;
+}
+static enum mapgen_class caves_class(const float* min, const float* max) {
+    (void)min;
+    (void)max;
+    return MAPGEN_MIXED;
+}
+
+/*
+    City: a ground slab and a grid of blocks 16 leaves across with 2 leaf
+    wide streets between them. 'density' is how likely a block is to have a
+    building, and how tall they can get.
+*/
+#define CITY_BLOCK 16
+#define CITY_STREET 2
+static float city_ground(void) {
+    return -opt.size * 0.5f + opt.leaf * 2.0f;
+}
+static float city_max_height(void) {
+    return city_ground() + opt.density * (opt.size - opt.leaf * 2.0f) * 0.75f;
+}
+static unsigned city_solid(float x, float y, float z) {
+    long lx = (long)floor((x + opt.size * 0.5f) / opt.leaf);
+    long lz = (long)floor((z + opt.size * 0.5f) / opt.leaf);
+    long bx = lx / CITY_BLOCK, bz = lz / CITY_BLOCK;
+    long ox = lx % CITY_BLOCK, oz = lz % CITY_BLOCK;
+    float height;
+    if (y < city_ground()) return 1;
+    if (ox < CITY_STREET || oz < CITY_STREET) return 0;
+    if (hashf(bx, 0, bz) >= opt.density) return 0;
+    height = city_ground() + (city_max_height() - city_ground()) * (0.1f + 0.9f * hashf(bx, 1, bz));
+    /* Split some blocks into four towers */
+    if (hash3(bx, 2, bz) & 1) {
+        long half = (CITY_BLOCK + CITY_STREET) / 2;
+        if (ox == half || oz == half) return 0;
+        height *= 0.5f + 0.5f * hashf(bx * 2 + (ox > half), 3, bz * 2 + (oz > half));
+    }
+    return y < height;
+}
+static enum mapgen_class city_class(const float* min, const float* max) {
+    if (max[1] <= city_ground()) return MAPGEN_FULL;
+    if (min[1] >= city_max_height()) return MAPGEN_EMPTY;
+    return MAPGEN_MIXED;
+}
+
+static unsigned is_solid(float x, float y, float z) {
+    switch (opt.kind) {
+        case MAPGEN_TERRAIN: return terrain_solid(x, y, z);
+        case MAPGEN_CAVES: return caves_solid(x, y, z);
+        default: return city_solid(x, y, z);
+    }
+}
+/* Work out if a node is surely empty or full without looking at its leaves */
+static enum mapgen_class classify(const float* min, const float* max) {
+    switch (opt.kind) {
+        case MAPGEN_TERRAIN: return terrain_class(min, max);
+        case MAPGEN_CAVES: return caves_class(min, max);
+        default: return city_class(min, max);
+    }
+}
+
+/* Pick the shape of the leaf centered at (x, y, z), given if it and the leaf above it are solid */
+static enum mapgen_shape leaf_shape(float x, float y, float z, unsigned solid, unsigned solid_above) {
+    unsigned h;
+    if (!solid) return MAPGEN_SHAPE_NONE;
+    if (opt.mix <= 0.0f || solid_above) return MAPGEN_SHAPE_CUBE;
+    /* Only the tops of things become wedges */
+    h = hash3((int)floor(x / opt.leaf), (int)floor(y / opt.leaf), (int)floor(z / opt.leaf));
+    if ((h & 0xFFFF) >= opt.mix * 65536.0f) return MAPGEN_SHAPE_CUBE;
+    return MAPGEN_SHAPE_WEDGE_FRONT + ((h >> 16) & 3);
+}
+
+static void put_indent(unsigned level) {
+    putc('\n', out);
+    while (level--) fputs("    ", out);
+}
+static void put_leaf(enum mapgen_shape shape) {
+    if (shape == MAPGEN_SHAPE_NONE) {
+        fputs("none", out);
+    } else {
+        fprintf(out, "geom(%s)", shape_names[shape]);
+        ++geom_count;
+    }
+}
+
+/*
+    The leaves of a node near the bottom of the tree, indexed [y][z][x] from
+    the smallest coord.
+*/
+static unsigned char block[MAPGEN_BLOCK_SIZE][MAPGEN_BLOCK_SIZE][MAPGEN_BLOCK_SIZE];
+
+/* Child 'i' covers this part of its parent on each axis (see the child order in the map format) */
+#define CHILD_X(i) (((i) & 1) ? 0 : 1)
+#define CHILD_Y(i) (((i) & 4) ? 0 : 1)
+#define CHILD_Z(i) (((i) & 2) ? 0 : 1)
+
+/* Work out the leaves of the node with corner 'min' that is 'n' leaves across */
+static void fill_block(const float* min, unsigned n) {
+    float heights[MAPGEN_BLOCK_SIZE][MAPGEN_BLOCK_SIZE];
+    unsigned x, y, z;
+    /* The terrain only needs one height for each column */
+    if (opt.kind == MAPGEN_TERRAIN) {
+        for (z = 0; z < n; ++z) {
+            for (x = 0; x < n; ++x) heights[z][x] = terrain_height(min[0] + (x + 0.5f) * opt.leaf, min[2] + (z + 0.5f) * opt.leaf);
+        }
+    }
+    for (y = 0; y < n; ++y) {
+        float py = min[1] + (y + 0.5f) * opt.leaf;
+        for (z = 0; z < n; ++z) {
+            float pz = min[2] + (z + 0.5f) * opt.leaf;
+            for (x = 0; x < n; ++x) {
+                float px = min[0] + (x + 0.5f) * opt.leaf;
+                unsigned solid, solid_above;
+                if (opt.kind == MAPGEN_TERRAIN) {
+                    solid = py < heights[z][x];
+                    solid_above = py + opt.leaf < heights[z][x];
+                } else {
+                    solid = is_solid(px, py, pz);
+                    solid_above = solid && opt.mix > 0.0f && is_solid(px, py + opt.leaf, pz);
+                }
+                block[y][z][x] = leaf_shape(px, py, pz, solid, solid_above);
+            }
+        }
+    }
+}
+
+/* Returns MAPGEN_SHAPE_NONE if all of the part of 'block' is empty, MAPGEN_SHAPE_CUBE if it is all cubes, or -1U */
+static unsigned block_uniform(unsigned x, unsigned y, unsigned z, unsigned n) {
+    unsigned first = block[y][z][x];
+    unsigned i, j, k;
+    if (first != MAPGEN_SHAPE_NONE && first != MAPGEN_SHAPE_CUBE) return -1U;
+    for (i = 0; i < n; ++i) {
+        for (j = 0; j < n; ++j) {
+            for (k = 0; k < n; ++k) {
+                if (block[y + i][z + j][x + k] != first) return -1U;
+            }
+        }
+    }
+    return first;
+}
+
+/* Write the part of 'block' 'n' leaves across starting at (x, y, z) */
+static void put_block(unsigned x, unsigned y, unsigned z, unsigned n) {
+    unsigned uniform;
+    unsigned i;
+    if (n == 1) {
+        put_leaf(block[y][z][x]);
+        return;
+    }
+    uniform = block_uniform(x, y, z, n);
+    if (uniform != -1U) {
+        put_leaf(uniform);
+        return;
+    }
+    fputs("parent(", out);
+    ++parent_count;
+    for (i = 0; i < 8; ++i) {
+        unsigned half = n / 2;
+        if (i) putc(',', out);
+        put_block(x + CHILD_X(i) * half, y + CHILD_Y(i) * half, z + CHILD_Z(i) * half, half);
+    }
+    putc(')', out);
+}
+
+/* Write the node with corner 'min' and size 'size' that has 'depth' levels under it */
+static void put_node(const float* min, float size, unsigned depth, unsigned level) {
+    float max[3];
+    unsigned i;
+    max[0] = min[0] + size;
+    max[1] = min[1] + size;
+    max[2] = min[2] + size;
+    switch (classify(min, max)) {
+        case MAPGEN_EMPTY: put_leaf(MAPGEN_SHAPE_NONE); return;
+        case MAPGEN_FULL: put_leaf(MAPGEN_SHAPE_CUBE); return;
+        default: break;
+    }
+
+    if (depth <= MAPGEN_BLOCK_DEPTH) {
+        fill_block(min, 1U << depth);
+        put_block(0, 0, 0, 1U << depth);
+        return;
+    }
+
+    fputs("parent(", out);
+    ++parent_count;
+    for (i = 0; i < 8; ++i) {
+        float child_min[3];
+        float half = size * 0.5f;
+        if (i) putc(',', out);
+        /* Keep the top few levels on their own lines */
+        if (level < 3) put_indent(level + 1);
+        child_min[0] = min[0] + CHILD_X(i) * half;
+        child_min[1] = min[1] + CHILD_Y(i) * half;
+        child_min[2] = min[2] + CHILD_Z(i) * half;
+        put_node(child_min, half, depth - 1, level + 1);
+    }
+    if (level < 3) put_indent(level);
+    putc(')', out);
+}
+
+static void put_usage_text(const char* argv0) {
+    fprintf(stderr, "Usage: %s [-t TYPE] [-s SIZE] [-d DEPTH] [-f DENSITY] [-m MIX] [-r SEED] [-v MINVIS] [-x MAXDIST] [OUTFILE]\n", argv0);
+    fputs("    -t TYPE    - terrain, caves or city (default: terrain)\n", stderr);
+    fputs("    -s SIZE    - Size of the map (default: 256)\n", stderr);
+    fputs("    -d DEPTH   - Levels in the tree, the smallest nodes are SIZE / 2^DEPTH (default: 8)\n", stderr);
+    fputs("    -f DENSITY - How full the map is, from 0 to 1 (default: 0.5)\n", stderr);
+    fputs("    -m MIX     - How many of the tops of things are wedges, from 0 to 1 (default: 0.25)\n", stderr);
+    fputs("    -r SEED    - Seed for the noise (default: 1)\n", stderr);
+    fputs("    -v MINVIS  - 'min_vis_size' of the map, over 1 (default: SIZE / 16, at least 1.5)\n", stderr);
+    fputs("    -x MAXDIST - 'max_vis_dist' of the map (default: none)\n", stderr);
+}
+
+static unsigned read_float(const char* arg, float min, float max, float* out) {
+    char* end;
+    double value = strtod(arg, &end);
+    if (!*arg || *end || !(value >= (double)min && value <= (double)max)) {
+        fprintf(stderr, "Invalid value '%s' (must be from %g to %g)\n", arg, (double)min, (double)max);
+        return 0;
+    }
+    *out = value;
+    return 1;
+}
+
+static unsigned read_unsigned(const char* arg, unsigned long max, unsigned* out) {
+    char* end;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (!*arg || *end || *arg == '-' || value > max) {
+        fprintf(stderr, "Invalid value '%s' (must be from 0 to %lu)\n", arg, max);
+        return 0;
+    }
+    *out = value;
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    const char* out_filename = NULL;
+    float root_min[3];
+    int opt_char;
+
+    opt.kind = MAPGEN_TERRAIN;
+    opt.size = 256.0f;
+    opt.depth = 8;
+    opt.density = 0.5f;
+    opt.mix = 0.25f;
+    opt.seed = 1;
+    opt.min_vis_size = 0.0f;
+    opt.max_vis_dist = 0.0f;
+    while ((opt_char = getopt(argc, argv, "t:s:d:f:m:r:v:x:")) != -1) {
+        switch (opt_char) {
+            case 't':
+                if (!strcmp(optarg, "terrain")) opt.kind = MAPGEN_TERRAIN;
+                else if (!strcmp(optarg, "caves")) opt.kind = MAPGEN_CAVES;
+                else if (!strcmp(optarg, "city")) opt.kind = MAPGEN_CITY;
+                else {
+                    fprintf(stderr, "Unknown map type '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's': if (!read_float(optarg, 1.0f, 1e9f, &opt.size)) return 1; break;
+            case 'd': if (!read_unsigned(optarg, 20, &opt.depth)) return 1; break;
+            case 'f': if (!read_float(optarg, 0.0f, 1.0f, &opt.density)) return 1; break;
+            case 'm': if (!read_float(optarg, 0.0f, 1.0f, &opt.mix)) return 1; break;
+            case 'r': if (!read_unsigned(optarg, 0xFFFFFFFFUL, &opt.seed)) return 1; break;
+            case 'v':
+                if (!read_float(optarg, 1.0f, 1e9f, &opt.min_vis_size)) return 1;
+                /* The compiler wants 'min_vis_size' to be over 1 */
+                if (opt.min_vis_size <= 1.0f) {
+                    fprintf(stderr, "Invalid value '%s' (must be over 1)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'x': if (!read_float(optarg, 0.0f, 1e9f, &opt.max_vis_dist)) return 1; break;
+            default: put_usage_text(argv[0]); return 1;
+        }
+    }
+    if (optind < argc) out_filename = argv[optind++];
+    if (optind < argc) {
+        put_usage_text(argv[0]);
+        return 1;
+    }
+    opt.leaf = opt.size / (float)(1UL << opt.depth);
+    opt.scale = opt.size * 0.25f;
+    /* The default is kept over 1 for small maps, since the compiler wants that */
+    if (opt.min_vis_size <= 0.0f) {
+        opt.min_vis_size = opt.size / 16.0f;
+        if (opt.min_vis_size <= 1.0f) opt.min_vis_size = 1.5f;
+    }
+
+    if (out_filename) {
+        out = fopen(out_filename, "w");
+        if (!out) {
+            fprintf(stderr, "Failed to open '%s': %s\n", out_filename, strerror(errno));
+            return 1;
+        }
+    } else {
+        out = stdout;
+    }
+
+    fprintf(out, "min_vis_size %g;\nsize %g;\n", (double)opt.min_vis_size, (double)opt.size);
+    if (opt.max_vis_dist > 0.0f) fprintf(out, "max_vis_dist %g;\n", (double)opt.max_vis_dist);
+    fputs(shape_defs, out);
+    fputs("tree {\n", out);
+    root_min[0] = root_min[1] = root_min[2] = -opt.size * 0.5f;
+    put_node(root_min, opt.size, opt.depth, 0);
+    fputs("\n};\n", out);
+
+    if (ferror(out) | ((out != stdout) ? fclose(out) : fflush(out))) {
+        fprintf(stderr, "Failed to write '%s': %s\n", (out_filename) ? out_filename : "stdout", strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "Wrote %lu 'geom' nodes and %lu 'parent' nodes\n", geom_count, parent_count);
+    return 0;
+}